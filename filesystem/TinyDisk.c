@@ -2,11 +2,154 @@
  * DO NOT MODIFY THIS FILE
  */
 
+#define _XOPEN_SOURCE 700
+
 #include "TinyDisk.h"
 
-// the disk in memory
-Block* disk;
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+// the disk in memory: diskBlocks blocks of diskBlockSize bytes
+char* disk;
+static int diskBlockSize = BLOCK_SIZE;
+static int diskBlocks    = 0;
+
+// blocks written since the disk last matched syncedFile (one bit per block)
+static uint64_t* dirty      = NULL;
+static char*     syncedFile = NULL;
+
+// 1 = every block outside the dirty set is zero (created, never synced), so a save can be sparse
+static int diskFresh = 0;
+
+// called after every Disk_Write, see Disk_SetWriteHook
+static Disk_WriteHook writeHook = NULL;
+
+#define DIRTY_BYTES(n) ((((size_t)(n) + 63) / 64) * sizeof(uint64_t))
 
+/*
+ * Lazy load: Disk_Load keeps the image open and reads each LOAD_CHUNK-byte
+ * chunk of it into memory the first time a block in it is touched (one bit
+ * per chunk). Chunks do not depend on the block size, so Disk_SetBlockSize
+ * leaves them alone. loadMutex serializes loading; a set bit is final.
+ */
+#define LOAD_CHUNK 4096
+
+static int             imageFd    = -1;
+static size_t          imageBytes = 0;
+static uint64_t*       loaded     = NULL;  // NULL = the whole disk is in memory
+static pthread_mutex_t loadMutex  = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The in-memory disk now matches file: remember it and clear the dirty set.
+ */
+static void markSynced(char* file) {
+    if (syncedFile == NULL || strcmp(syncedFile, file) != 0) {
+        free(syncedFile);
+        syncedFile = strdup(file);
+    }
+    memset(dirty, 0, DIRTY_BYTES(diskBlocks));
+    diskFresh = 0;
+}
+
+/* Forget the lazily loaded image, if any */
+static void dropImage(void) {
+    if (imageFd >= 0) {
+        close(imageFd);
+        imageFd = -1;
+    }
+    free(loaded);
+    loaded     = NULL;
+    imageBytes = 0;
+}
+
+/* Replace the disk with bytes (taking ownership), numBlocks of the current block size */
+static int setDisk(char* bytes, int numBlocks) {
+    uint64_t* bits = calloc(1, DIRTY_BYTES(numBlocks));
+    if (bits == NULL) {
+        free(bytes);
+        return E_DISK_ERROR;
+    }
+    dropImage();
+    free(disk);
+    free(dirty);
+    disk       = bytes;
+    dirty      = bits;
+    diskBlocks = numBlocks;
+    return 0;
+}
+
+/* pread all of len bytes at off */
+static int readFully(int fd, char* buf, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, off);
+        if (n <= 0) {
+            return E_DISK_ERROR;
+        }
+        buf += n;
+        len -= (size_t)n;
+        off += n;
+    }
+    return 0;
+}
+
+/*
+ * Make bytes [off, off + len) of the disk present in memory. A writer passes
+ * the len bytes it is about to store as src: a chunk they cover entirely is
+ * filled from there instead of being read.
+ */
+static int loadRange(size_t off, size_t len, const char* src) {
+    if (loaded == NULL || len == 0) {
+        return 0;
+    }
+    for (size_t c = off / LOAD_CHUNK; c <= (off + len - 1) / LOAD_CHUNK; c++) {
+        uint64_t bit = (uint64_t)1 << (c % 64);
+        if (__atomic_load_n(&loaded[c / 64], __ATOMIC_ACQUIRE) & bit) {
+            continue;
+        }
+        pthread_mutex_lock(&loadMutex);
+        int rc = 0;
+        if (!(__atomic_load_n(&loaded[c / 64], __ATOMIC_ACQUIRE) & bit)) {
+            size_t start = c * LOAD_CHUNK;
+            size_t n = imageBytes - start < LOAD_CHUNK ? imageBytes - start : LOAD_CHUNK;
+            if (src != NULL && start >= off && start + n <= off + len) {
+                memcpy(disk + start, src + (start - off), n);
+            } else {
+                rc = readFully(imageFd, disk + start, n, (off_t)start);
+            }
+            if (rc == 0) {
+                __atomic_or_fetch(&loaded[c / 64], bit, __ATOMIC_RELEASE);
+            }
+        }
+        pthread_mutex_unlock(&loadMutex);
+        if (rc < 0) {
+            return E_DISK_ERROR;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Creates a zero-filled disk of numBlocks blocks of blockSize bytes.
+ */
+int Disk_Create(int blockSize, int numBlocks) {
+    if (blockSize <= 0 || numBlocks <= 0) {
+	    return E_DISK_ERROR;
+    }
+    char* bytes = calloc((size_t)numBlocks, (size_t)blockSize);
+    if (bytes == NULL) {
+	    return E_DISK_ERROR;
+    }
+    diskBlockSize = blockSize;
+    if (setDisk(bytes, numBlocks) < 0) {
+	    return E_DISK_ERROR;
+    }
+    free(syncedFile);
+    syncedFile = NULL;
+    diskFresh  = 1;
+    return 0;
+}
 
 /*
  * Initializes the disk area.
@@ -14,13 +157,47 @@ Block* disk;
  */
 int Disk_Init(){
     // create the disk image and fill every block with zeroes
-    disk = (Block *) calloc(NUM_BLOCKS, sizeof(Block));
-    if(disk == NULL) {
+    return Disk_Create(BLOCK_SIZE, NUM_BLOCKS);
+}
+
+/*
+ * Reads the same disk bytes in blocks of blockSize; the disk must be a
+ * whole number of them. The dirty set is kept only if nothing is dirty.
+ */
+int Disk_SetBlockSize(int blockSize) {
+    size_t bytes = (size_t)diskBlocks * (size_t)diskBlockSize;
+    if (blockSize <= 0 || bytes % (size_t)blockSize != 0) {
 	    return E_DISK_ERROR;
     }
+    int numBlocks = (int)(bytes / (size_t)blockSize);
+    uint64_t* bits = calloc(1, DIRTY_BYTES(numBlocks));
+    if (bits == NULL) {
+	    return E_DISK_ERROR;
+    }
+    for (size_t w = 0; w < DIRTY_BYTES(diskBlocks) / sizeof(uint64_t); w++) {
+	    if (dirty[w] != 0) {
+		    // keep it simple: everything must go out on the next sync
+		    free(syncedFile);
+		    syncedFile = NULL;
+		    diskFresh  = 0;
+		    break;
+	    }
+    }
+    free(dirty);
+    dirty         = bits;
+    diskBlockSize = blockSize;
+    diskBlocks    = numBlocks;
     return 0;
 }
 
+int Disk_BlockSize(void) {
+    return diskBlockSize;
+}
+
+int Disk_NumBlocks(void) {
+    return diskBlocks;
+}
+
 /*
  * Makes sure the current disk image gets saved to memory - this
  * will overwrite an existing file with the same name so be careful
@@ -30,6 +207,11 @@ int Disk_Save(char* file) {
     if (file == NULL) {
 	    return E_DISK_ERROR;
     }
+
+    // everything must be in memory first (file may be the image it comes from)
+    if (loadRange(0, imageBytes, NULL) < 0) {
+	    return E_DISK_ERROR;
+    }
     
     // open the diskFile
     if ((diskFile = fopen(file, "w")) == NULL) {
@@ -37,36 +219,50 @@ int Disk_Save(char* file) {
     }
     
     // actually write the disk image to a file
-    if ((fwrite(disk, sizeof(Block), NUM_BLOCKS, diskFile)) != NUM_BLOCKS) {
+    if ((fwrite(disk, (size_t)diskBlockSize, (size_t)diskBlocks, diskFile)) != (size_t)diskBlocks) {
 	    fclose(diskFile);
 	    return E_DISK_ERROR;
     }
 
     fclose(diskFile);
+    markSynced(file);
     return 0;
 }
 
 /*
  * Loads a current disk image from disk into memory - requires that
- * the disk be created first.
+ * the disk be created first. The image must be a whole number of blocks
+ * of the current block size; its length gives the block count. Nothing is
+ * read yet: each chunk comes in on first touch (see loadRange).
  */
 int Disk_Load(char* file) {
-    FILE* diskFile;
     if (file == NULL) {
 	    return E_DISK_ERROR;
     }
     
-    // open the diskFile
-    if ((diskFile = fopen(file, "r")) == NULL) {
+    // open the image and size the disk after it
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
 	    return E_DISK_ERROR;
     }
-    
-    // actually read the disk image into memory
-    if ((fread(disk, sizeof(Block), NUM_BLOCKS, diskFile)) != NUM_BLOCKS) {
-	    fclose(diskFile);
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size <= 0 || st.st_size % diskBlockSize != 0) {
+	    close(fd);
 	    return E_DISK_ERROR;
     }
-    fclose(diskFile);
+    size_t length = (size_t)st.st_size;
+    size_t chunks = (length + LOAD_CHUNK - 1) / LOAD_CHUNK;
+    char* bytes = calloc(1, length);
+    uint64_t* bits = calloc((chunks + 63) / 64, sizeof(uint64_t));
+    if (bytes == NULL || bits == NULL || setDisk(bytes, (int)(length / diskBlockSize)) < 0) {
+	    free(bits);
+	    close(fd);
+	    return E_DISK_ERROR;
+    }
+    imageFd    = fd;
+    imageBytes = length;
+    loaded     = bits;
+    markSynced(file);
     return 0;
 }
 
@@ -75,11 +271,14 @@ int Disk_Load(char* file) {
  * by the user.
  */
 int Disk_Read(int block, char* buffer) {
-    if ((block < 0) || (block >= NUM_BLOCKS) || (buffer == NULL)) {
+    if ((block < 0) || (block >= diskBlocks) || (buffer == NULL)) {
+	    return E_DISK_ERROR;
+    }
+    if (loadRange((size_t)block * diskBlockSize, diskBlockSize, NULL) < 0) {
 	    return E_DISK_ERROR;
     }
     
-    if((memcpy((void*)buffer, (void*)(disk + block), sizeof(Block))) == NULL) {
+    if((memcpy((void*)buffer, (void*)(disk + (size_t)block * diskBlockSize), diskBlockSize)) == NULL) {
 	    return E_DISK_ERROR;
     }
     
@@ -90,12 +289,98 @@ int Disk_Read(int block, char* buffer) {
  * Writes a single block from memory to "disk".
  */
 int Disk_Write(int block, char* buffer) {
-    if((block < 0) || (block >= NUM_BLOCKS) || (buffer == NULL)) {
+    if((block < 0) || (block >= diskBlocks) || (buffer == NULL)) {
+	    return E_DISK_ERROR;
+    }
+    if (loadRange((size_t)block * diskBlockSize, diskBlockSize, buffer) < 0) {
 	    return E_DISK_ERROR;
     }
     
-    if((memcpy((void*)(disk + block), (void*)buffer, sizeof(Block))) == NULL) {
+    if((memcpy((void*)(disk + (size_t)block * diskBlockSize), (void*)buffer, diskBlockSize)) == NULL) {
+	    return E_DISK_ERROR;
+    }
+    dirty[block / 64] |= (uint64_t)1 << (block % 64);
+    if (writeHook != NULL) {
+	    writeHook(block);
+    }
+    return 0;
+}
+
+void Disk_SetWriteHook(Disk_WriteHook hook) {
+    writeHook = hook;
+}
+
+/*
+ * Copies the whole disk into buffer, reading in whatever part of a lazily
+ * loaded image has not been touched yet.
+ */
+int Disk_Copy(char* buffer) {
+    if (buffer == NULL || loadRange(0, imageBytes, NULL) < 0) {
 	    return E_DISK_ERROR;
     }
+    memcpy(buffer, disk, (size_t)diskBlocks * diskBlockSize);
+    return 0;
+}
+
+/*
+ * Incremental save: pwrites only the blocks written since the disk last
+ * matched file, one write per run of adjacent dirty blocks, then clears the
+ * dirty set. If file is not that image, a fresh disk (zero outside the
+ * dirty set) is saved the same way into a sparse file of its length, and
+ * anything else falls back to a full Disk_Save.
+ */
+int Disk_SyncDirty(char* file) {
+    if (file == NULL) {
+	    return E_DISK_ERROR;
+    }
+
+    int fd;
+    if (syncedFile != NULL && strcmp(syncedFile, file) == 0) {
+	    if ((fd = open(file, O_WRONLY)) < 0) {
+		    return Disk_Save(file);
+	    }
+    } else if (diskFresh) {
+	    fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	    if (fd < 0) {
+		    return E_DISK_ERROR;
+	    }
+	    if (ftruncate(fd, (off_t)diskBlocks * (off_t)diskBlockSize) < 0) {
+		    close(fd);
+		    return E_DISK_ERROR;
+	    }
+    } else {
+	    return Disk_Save(file);
+    }
+
+    int block = 0;
+    while (block < diskBlocks) {
+	    // skip to the next dirty block, a word at a time
+	    uint64_t bits = dirty[block / 64] >> (block % 64);
+	    if (bits == 0) {
+		    block = (block / 64 + 1) * 64;
+		    continue;
+	    }
+	    block += __builtin_ctzll(bits);
+	    if (block >= diskBlocks) {
+		    break;
+	    }
+
+	    // extend the run over adjacent dirty blocks
+	    int end = block;
+	    while (end < diskBlocks && (dirty[end / 64] >> (end % 64)) & 1) {
+		    end++;
+	    }
+
+	    size_t len = (size_t)(end - block) * (size_t)diskBlockSize;
+	    off_t  off = (off_t)block * (off_t)diskBlockSize;
+	    if (pwrite(fd, (void*)(disk + (size_t)block * diskBlockSize), len, off) != (ssize_t)len) {
+		    close(fd);
+		    return E_DISK_ERROR;
+	    }
+	    block = end;
+    }
+
+    close(fd);
+    markSynced(file);
     return 0;
 }
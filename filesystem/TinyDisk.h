@@ -10,8 +10,12 @@
 #include <unistd.h>
 #include <string.h>
 
-// a few disk parameters
+// default disk geometry (build with -DTINYFS_BLOCK_SIZE=n to fix the block size at compile time)
+#ifdef TINYFS_BLOCK_SIZE
+#define BLOCK_SIZE  TINYFS_BLOCK_SIZE
+#else
 #define BLOCK_SIZE  512
+#endif
 #define NUM_BLOCKS  1000
 
 
@@ -22,10 +26,28 @@ typedef struct block {
   char data[BLOCK_SIZE];
 } Block;
 
-int Disk_Init();
+int Disk_Init();  // NUM_BLOCKS blocks of BLOCK_SIZE bytes
 int Disk_Save(char* file);
 int Disk_Load(char* file);
 int Disk_Write(int block, char* buffer);
 int Disk_Read(int block, char* buffer);
 
+// write only the blocks changed since the last save/load/sync of file
+int Disk_SyncDirty(char* file);
+
+// geometry: Disk_Create makes a zeroed disk of any shape, Disk_Load keeps the
+// block size and takes the block count from the image's length, and
+// Disk_SetBlockSize reads the same bytes in blocks of another size
+int Disk_Create(int blockSize, int numBlocks);
+int Disk_SetBlockSize(int blockSize);
+int Disk_BlockSize(void);
+int Disk_NumBlocks(void);
+
+// crash testing: the hook runs after every Disk_Write with the block it
+// wrote (NULL = none), and Disk_Copy copies out the whole disk as it is
+// (Disk_NumBlocks() * Disk_BlockSize() bytes), i.e. what a crash would leave
+typedef void (*Disk_WriteHook)(int block);
+void Disk_SetWriteHook(Disk_WriteHook hook);
+int Disk_Copy(char* buffer);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,294 @@
+/*********************************************************************
+* Memory-mapped disk backend for TinyFS.
+*
+* Implements the TinyDisk.h interface on top of mmap instead of a calloc'd
+* array. Disk_Load maps the image file in place, so an existing image boots
+* in O(1) and pages are only faulted in when touched. Disk_Write marks the
+* pages it changes, and Disk_Save on the mapped image writes back just those
+* pages instead of rewriting every block.
+*
+* The mapping is private (copy-on-write): as with the in-memory backend,
+* nothing changes in the image file until Disk_Save, so a run that never
+* syncs leaves the image as it was loaded.
+*
+* Build TinyFS with `make DISK_BACKEND=mmap` to use it.
+**********************************************************************/
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
+
+#include "TinyDisk.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// the disk, either an anonymous mapping or the mapped image file, and its shape
+char* disk = NULL;
+static size_t diskBytes     = 0;
+static int    diskBlockSize = BLOCK_SIZE;
+static int    diskBlocks    = 0;
+
+static int            diskFd       = -1;    // image file backing the mapping, -1 = anonymous
+static char*          diskPath     = NULL;  // path of that image file
+static size_t         pageSize     = 0;
+static size_t         numPages     = 0;
+static unsigned char* dirtyPages   = NULL;  // one flag per page written since the last sync
+static Disk_WriteHook writeHook    = NULL;  // called after every Disk_Write
+
+/* Unmap the current disk and forget its backing file */
+static void unmapDisk(void) {
+    if (disk != NULL) {
+        munmap(disk, diskBytes);
+        disk = NULL;
+    }
+    if (diskFd >= 0) {
+        close(diskFd);
+        diskFd = -1;
+    }
+    free(diskPath);
+    diskPath = NULL;
+}
+
+/* Size the dirty-page flags for a disk of bytes bytes, all clean */
+static int resizeDirtyPages(size_t bytes) {
+    pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    size_t pages = (bytes + pageSize - 1) / pageSize;
+    unsigned char* flags = calloc(pages > 0 ? pages : 1, 1);
+    if (flags == NULL) {
+        return E_DISK_ERROR;
+    }
+    free(dirtyPages);
+    dirtyPages = flags;
+    numPages   = pages;
+    return 0;
+}
+
+/* Map the first bytes bytes of an open image file, replacing the current disk */
+static int mapFile(int fd, char* file, size_t bytes) {
+    void* map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return E_DISK_ERROR;
+    }
+    char* path = strdup(file);
+    if (path == NULL || resizeDirtyPages(bytes) < 0) {
+        free(path);
+        munmap(map, bytes);
+        return E_DISK_ERROR;
+    }
+
+    unmapDisk();
+    disk      = (char *) map;
+    diskBytes = bytes;
+    diskFd    = fd;
+    diskPath  = path;
+    return 0;
+}
+
+/* Write the dirty pages to the image file fd, one pwrite per run of adjacent pages */
+static int syncDirtyPages(int fd) {
+    size_t p = 0;
+    while (p < numPages) {
+        if (!dirtyPages[p]) {
+            p++;
+            continue;
+        }
+        size_t start = p;
+        while (p < numPages && dirtyPages[p]) {
+            p++;
+        }
+
+        size_t offset = start * pageSize;
+        size_t length = (p - start) * pageSize;
+        if (offset + length > diskBytes) {
+            length = diskBytes - offset;
+        }
+        if (pwrite(fd, (char *) disk + offset, length, (off_t) offset) != (ssize_t) length) {
+            return E_DISK_ERROR;
+        }
+        memset(dirtyPages + start, 0, p - start);
+    }
+    return fdatasync(fd) < 0 ? E_DISK_ERROR : 0;
+}
+
+/*
+ * Creates a disk of numBlocks blocks of blockSize bytes as an anonymous
+ * (zero-filled) mapping.
+ */
+int Disk_Create(int blockSize, int numBlocks) {
+    if (blockSize <= 0 || numBlocks <= 0) {
+        return E_DISK_ERROR;
+    }
+    unmapDisk();
+
+    size_t bytes = (size_t) numBlocks * (size_t) blockSize;
+    if (resizeDirtyPages(bytes) < 0) {
+        return E_DISK_ERROR;
+    }
+    void* map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return E_DISK_ERROR;
+    }
+    disk          = (char *) map;
+    diskBytes     = bytes;
+    diskBlockSize = blockSize;
+    diskBlocks    = numBlocks;
+    return 0;
+}
+
+/*
+ * Initializes the disk area as an anonymous (zero-filled) mapping.
+ * THIS FUNCTION MUST BE CALLED BEFORE ANY OTHER FUNCTION IN HERE CAN BE USED!
+ */
+int Disk_Init() {
+    return Disk_Create(BLOCK_SIZE, NUM_BLOCKS);
+}
+
+/*
+ * Reads the mapped bytes in blocks of blockSize; the disk must be a whole
+ * number of them. Dirty tracking is per page, so it carries over.
+ */
+int Disk_SetBlockSize(int blockSize) {
+    if (blockSize <= 0 || diskBytes % (size_t) blockSize != 0) {
+        return E_DISK_ERROR;
+    }
+    diskBlockSize = blockSize;
+    diskBlocks    = (int) (diskBytes / (size_t) blockSize);
+    return 0;
+}
+
+int Disk_BlockSize(void) {
+    return diskBlockSize;
+}
+
+int Disk_NumBlocks(void) {
+    return diskBlocks;
+}
+
+/*
+ * Saves the disk image. When file is the image currently mapped, only the
+ * pages written since the last save are flushed. An anonymous disk is zero
+ * outside its dirty pages, so it is saved as a sparse file holding just
+ * those, which is then mapped so later saves are incremental. Any other
+ * mapped image is written out whole.
+ */
+int Disk_Save(char* file) {
+    if (file == NULL || disk == NULL) {
+        return E_DISK_ERROR;
+    }
+
+    if (diskPath != NULL && strcmp(diskPath, file) == 0) {
+        return syncDirtyPages(diskFd);
+    }
+
+    int fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return E_DISK_ERROR;
+    }
+
+    if (diskFd < 0) {
+        if (ftruncate(fd, (off_t) diskBytes) < 0 || syncDirtyPages(fd) < 0 ||
+            mapFile(fd, file, diskBytes) < 0) {
+            close(fd);
+            return E_DISK_ERROR;
+        }
+        return 0;
+    }
+
+    // actually write the disk image to a file
+    size_t done = 0;
+    while (done < diskBytes) {
+        ssize_t n = write(fd, (char *) disk + done, diskBytes - done);
+        if (n <= 0) {
+            close(fd);
+            return E_DISK_ERROR;
+        }
+        done += (size_t) n;
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+ * Maps an existing disk image in place - requires that the disk be
+ * created first. Nothing is read until blocks are touched. The image must
+ * be a whole number of blocks of the current block size.
+ */
+int Disk_Load(char* file) {
+    if (file == NULL) {
+        return E_DISK_ERROR;
+    }
+
+    int fd = open(file, O_RDWR);
+    if (fd < 0) {
+        return E_DISK_ERROR;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size <= 0 || st.st_size % diskBlockSize != 0) {
+        close(fd);
+        return E_DISK_ERROR;
+    }
+
+    if (mapFile(fd, file, (size_t) st.st_size) < 0) {
+        close(fd);
+        return E_DISK_ERROR;
+    }
+    diskBlocks = (int) (st.st_size / diskBlockSize);
+    return 0;
+}
+
+/*
+ * Reads a single block from "disk" and puts it into a buffer provided
+ * by the user.
+ */
+int Disk_Read(int block, char* buffer) {
+    if ((block < 0) || (block >= diskBlocks) || (buffer == NULL) || (disk == NULL)) {
+        return E_DISK_ERROR;
+    }
+
+    memcpy((void*)buffer, (void*)(disk + (size_t) block * diskBlockSize), diskBlockSize);
+    return 0;
+}
+
+/*
+ * Writes a single block from memory to "disk" and marks its pages dirty.
+ */
+int Disk_Write(int block, char* buffer) {
+    if ((block < 0) || (block >= diskBlocks) || (buffer == NULL) || (disk == NULL)) {
+        return E_DISK_ERROR;
+    }
+
+    memcpy((void*)(disk + (size_t) block * diskBlockSize), (void*)buffer, diskBlockSize);
+
+    size_t first = ((size_t) block * diskBlockSize) / pageSize;
+    size_t last  = ((size_t) (block + 1) * diskBlockSize - 1) / pageSize;
+    for (size_t p = first; p <= last; p++) {
+        dirtyPages[p] = 1;
+    }
+    if (writeHook != NULL) {
+        writeHook(block);
+    }
+    return 0;
+}
+
+void Disk_SetWriteHook(Disk_WriteHook hook) {
+    writeHook = hook;
+}
+
+/* Copies the whole disk into buffer (faulting in what was never touched) */
+int Disk_Copy(char* buffer) {
+    if (buffer == NULL || disk == NULL) {
+        return E_DISK_ERROR;
+    }
+    memcpy(buffer, disk, diskBytes);
+    return 0;
+}
+
+/*
+ * Incremental save: the dirty pages of the mapped image only. Same as
+ * Disk_Save, which already takes this path for the mapped file.
+ */
+int Disk_SyncDirty(char* file) {
+    return Disk_Save(file);
+}
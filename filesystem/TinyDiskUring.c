@@ -0,0 +1,544 @@
+/*********************************************************************
+* io_uring disk backend for TinyFS.
+*
+* Implements the TinyDisk.h interface with the disk held in memory, like
+* TinyDisk.c, but moves every transfer to and from the image file through
+* an io_uring instead of one blocking fread/fwrite/pwrite at a time. The
+* image is split into chunks (Disk_Load, Disk_Save) or runs of dirty blocks
+* (Disk_SyncDirty), and up to URING_DEPTH of them are in flight at once, so
+* the storage can overlap them. Saves end with a data sync.
+*
+* The ring is set up with the raw io_uring_setup/io_uring_enter system
+* calls (no liburing). When the kernel refuses to create one, the same
+* transfers run as plain pread/pwrite calls.
+*
+* Build TinyFS with `make DISK_BACKEND=uring` to use it.
+**********************************************************************/
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
+
+#include "TinyDisk.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* Requests in flight at once, and blocks per request when moving the whole image */
+#define URING_DEPTH       32
+#define IMAGE_CHUNK       64
+
+// the disk in memory: diskBlocks blocks of diskBlockSize bytes
+char* disk;
+static int diskBlockSize = (int) sizeof(Block);
+static int diskBlocks    = 0;
+
+// blocks written since the disk last matched syncedFile (one bit per block)
+static uint64_t* dirty      = NULL;
+static char*     syncedFile = NULL;
+
+// 1 = every block outside the dirty set is zero (created, never synced), so a save can be sparse
+static int diskFresh = 0;
+
+// called after every Disk_Write, see Disk_SetWriteHook
+static Disk_WriteHook writeHook = NULL;
+
+#define DIRTY_BYTES(n) ((((size_t)(n) + 63) / 64) * sizeof(uint64_t))
+
+/* One transfer between the disk and the image file */
+typedef struct {
+    char*  buf;
+    size_t len;
+    off_t  off;
+} DiskIo;
+
+/* The submission and completion rings, mapped from the kernel */
+typedef struct {
+    int                  fd;        // -1 = not set up, -2 = unavailable
+    unsigned*            sqHead;
+    unsigned*            sqTail;
+    unsigned*            sqMask;
+    unsigned*            sqArray;
+    struct io_uring_sqe* sqes;
+    unsigned*            cqHead;
+    unsigned*            cqTail;
+    unsigned*            cqMask;
+    struct io_uring_cqe* cqes;
+} Uring;
+
+static Uring ring = { .fd = -1 };
+
+/*
+ * The in-memory disk now matches file: remember it and clear the dirty set.
+ */
+static void markSynced(char* file) {
+    if (syncedFile == NULL || strcmp(syncedFile, file) != 0) {
+        free(syncedFile);
+        syncedFile = strdup(file);
+    }
+    memset(dirty, 0, DIRTY_BYTES(diskBlocks));
+    diskFresh = 0;
+}
+
+/* Replace the disk with bytes (taking ownership), numBlocks of the current block size */
+static int setDisk(char* bytes, int numBlocks) {
+    uint64_t* bits = calloc(1, DIRTY_BYTES(numBlocks));
+    if (bits == NULL) {
+        free(bytes);
+        return E_DISK_ERROR;
+    }
+    free(disk);
+    free(dirty);
+    disk       = bytes;
+    dirty      = bits;
+    diskBlocks = numBlocks;
+    return 0;
+}
+
+/* Create the ring on first use; 0 if it is usable */
+static int uringSetup(void) {
+    if (ring.fd != -1) {
+        return ring.fd >= 0 ? 0 : -1;
+    }
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int) syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+    if (fd < 0) {
+        ring.fd = -2;
+        return -1;
+    }
+
+    size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && cqSize > sqSize) {
+        sqSize = cqSize;
+    }
+
+    char* sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char* cq = sq;
+    if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    void* sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        close(fd);
+        ring.fd = -2;
+        return -1;
+    }
+
+    ring.sqHead  = (unsigned*) (sq + p.sq_off.head);
+    ring.sqTail  = (unsigned*) (sq + p.sq_off.tail);
+    ring.sqMask  = (unsigned*) (sq + p.sq_off.ring_mask);
+    ring.sqArray = (unsigned*) (sq + p.sq_off.array);
+    ring.sqes    = sqes;
+    ring.cqHead  = (unsigned*) (cq + p.cq_off.head);
+    ring.cqTail  = (unsigned*) (cq + p.cq_off.tail);
+    ring.cqMask  = (unsigned*) (cq + p.cq_off.ring_mask);
+    ring.cqes    = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+    ring.fd      = fd;
+    return 0;
+}
+
+/* Queue one request; the caller keeps fewer than URING_DEPTH in flight */
+static void uringQueue(int opcode, int fd, DiskIo* io, unsigned flags, uint64_t tag) {
+    unsigned tail = *ring.sqTail;
+    unsigned idx  = tail & *ring.sqMask;
+    struct io_uring_sqe* sqe = &ring.sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = (uint8_t) opcode;
+    sqe->fd        = fd;
+    sqe->user_data = tag;
+    if (io != NULL) {
+        sqe->addr = (uint64_t) (uintptr_t) io->buf;
+        sqe->len  = (uint32_t) io->len;
+        sqe->off  = (uint64_t) io->off;
+    }
+    sqe->fsync_flags = flags;
+    ring.sqArray[idx] = idx;
+    __atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Hand the queued requests to the kernel and wait for at least one to finish */
+static int uringSubmitAndWait(unsigned submit) {
+    for (;;) {
+        long rc = syscall(__NR_io_uring_enter, ring.fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (rc >= 0) {
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+        submit = 0;  // already consumed before the interruption
+    }
+}
+
+/*
+ * The ring failed with inFlight requests on it: take back the ones the
+ * kernel has not picked up, wait out the others (their buffers must not
+ * change under them) and stop using the ring, so this and every later
+ * transfer runs through runIoSync.
+ */
+static void uringAbandon(int inFlight) {
+    unsigned tail = *ring.sqTail;
+    unsigned unsubmitted = tail - __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE);
+    __atomic_store_n(ring.sqTail, tail - unsubmitted, __ATOMIC_RELEASE);
+    inFlight -= (int) unsubmitted;
+    while (inFlight > 0) {
+        unsigned head = *ring.cqHead;
+        unsigned done = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+        if (head != done) {
+            inFlight -= (int) (done - head);
+            __atomic_store_n(ring.cqHead, done, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            break;  // cannot wait: closing the ring cancels what is left
+        }
+    }
+    close(ring.fd);
+    ring.fd = -2;
+}
+
+/* Same transfers, one blocking call at a time */
+static int runIoSync(int fd, int write, DiskIo* ios, int n) {
+    for (int i = 0; i < n; i++) {
+        DiskIo io = ios[i];
+        while (io.len > 0) {
+            ssize_t done = write ? pwrite(fd, io.buf, io.len, io.off) : pread(fd, io.buf, io.len, io.off);
+            if (done <= 0) {
+                return E_DISK_ERROR;
+            }
+            io.buf += done;
+            io.len -= (size_t) done;
+            io.off += done;
+        }
+    }
+    return write && fdatasync(fd) < 0 ? E_DISK_ERROR : 0;
+}
+
+/*
+ * Run n transfers on fd, keeping up to URING_DEPTH in flight. A short
+ * transfer is queued again for its remainder. Writes end with a data sync.
+ */
+static int runIo(int fd, int write, DiskIo* ios, int n) {
+    if (uringSetup() < 0) {
+        return runIoSync(fd, write, ios, n);
+    }
+
+    int* todo = malloc((size_t) (n > 0 ? n : 1) * sizeof(int));
+    if (todo == NULL) {
+        return E_DISK_ERROR;
+    }
+    int nTodo = 0;
+    for (int i = n - 1; i >= 0; i--) {
+        todo[nTodo++] = i;
+    }
+
+    int opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    int inFlight = 0, rc = 0;
+    while ((nTodo > 0 && rc == 0) || inFlight > 0) {
+        unsigned queued = 0;
+        while (rc == 0 && nTodo > 0 && inFlight < URING_DEPTH) {
+            int i = todo[--nTodo];
+            uringQueue(opcode, fd, &ios[i], 0, (uint64_t) i);
+            inFlight++;
+            queued++;
+        }
+        if (uringSubmitAndWait(queued) < 0) {
+            // redo the lot without the ring: a transfer done twice just lands again
+            uringAbandon(inFlight);
+            free(todo);
+            return runIoSync(fd, write, ios, n);
+        }
+
+        unsigned head = *ring.cqHead;
+        while (head != __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cqMask];
+            DiskIo* io = &ios[cqe->user_data];
+            if (cqe->res <= 0) {
+                rc = E_DISK_ERROR;
+            } else if ((size_t) cqe->res < io->len) {
+                io->buf += cqe->res;
+                io->len -= (size_t) cqe->res;
+                io->off += cqe->res;
+                todo[nTodo++] = (int) cqe->user_data;
+            }
+            inFlight--;
+            head++;
+        }
+        __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+    }
+    free(todo);
+
+    if (rc == 0 && write) {
+        uringQueue(IORING_OP_FSYNC, fd, NULL, IORING_FSYNC_DATASYNC, 0);
+        if (uringSubmitAndWait(1) < 0) {
+            uringAbandon(1);
+            return fdatasync(fd) < 0 ? E_DISK_ERROR : 0;
+        }
+        unsigned head = *ring.cqHead;
+        rc = ring.cqes[head & *ring.cqMask].res < 0 ? E_DISK_ERROR : 0;
+        __atomic_store_n(ring.cqHead, head + 1, __ATOMIC_RELEASE);
+    }
+    return rc;
+}
+
+/* Whole-image transfer in IMAGE_CHUNK-block requests */
+static int runImage(int fd, int write) {
+    DiskIo* ios = malloc(((size_t) (diskBlocks + IMAGE_CHUNK - 1) / IMAGE_CHUNK + 1) * sizeof(DiskIo));
+    if (ios == NULL) {
+        return E_DISK_ERROR;
+    }
+    int n = 0;
+    for (int b = 0; b < diskBlocks; b += IMAGE_CHUNK) {
+        int count = diskBlocks - b < IMAGE_CHUNK ? diskBlocks - b : IMAGE_CHUNK;
+        ios[n].buf = disk + (size_t) b * diskBlockSize;
+        ios[n].len = (size_t) count * (size_t) diskBlockSize;
+        ios[n].off = (off_t) b * (off_t) diskBlockSize;
+        n++;
+    }
+    int rc = runIo(fd, write, ios, n);
+    free(ios);
+    return rc;
+}
+
+/*
+ * Creates a zero-filled disk of numBlocks blocks of blockSize bytes.
+ */
+int Disk_Create(int blockSize, int numBlocks) {
+    if (blockSize <= 0 || numBlocks <= 0) {
+        return E_DISK_ERROR;
+    }
+    char* bytes = calloc((size_t) numBlocks, (size_t) blockSize);
+    if (bytes == NULL) {
+        return E_DISK_ERROR;
+    }
+    diskBlockSize = blockSize;
+    if (setDisk(bytes, numBlocks) < 0) {
+        return E_DISK_ERROR;
+    }
+    free(syncedFile);
+    syncedFile = NULL;
+    diskFresh  = 1;
+    return 0;
+}
+
+/*
+ * Initializes the disk area.
+ * THIS FUNCTION MUST BE CALLED BEFORE ANY OTHER FUNCTION IN HERE CAN BE USED!
+ */
+int Disk_Init() {
+    // create the disk image and fill every block with zeroes (sizeof(Block):
+    // <linux/io_uring.h> pulls in <linux/fs.h>, whose BLOCK_SIZE is not ours)
+    return Disk_Create((int) sizeof(Block), NUM_BLOCKS);
+}
+
+/*
+ * Reads the same disk bytes in blocks of blockSize; the disk must be a
+ * whole number of them. Pending dirty blocks force a full save next time.
+ */
+int Disk_SetBlockSize(int blockSize) {
+    size_t bytes = (size_t) diskBlocks * (size_t) diskBlockSize;
+    if (blockSize <= 0 || bytes % (size_t) blockSize != 0) {
+        return E_DISK_ERROR;
+    }
+    int numBlocks = (int) (bytes / (size_t) blockSize);
+    uint64_t* bits = calloc(1, DIRTY_BYTES(numBlocks));
+    if (bits == NULL) {
+        return E_DISK_ERROR;
+    }
+    for (size_t w = 0; w < DIRTY_BYTES(diskBlocks) / sizeof(uint64_t); w++) {
+        if (dirty[w] != 0) {
+            free(syncedFile);
+            syncedFile = NULL;
+            diskFresh  = 0;
+            break;
+        }
+    }
+    free(dirty);
+    dirty         = bits;
+    diskBlockSize = blockSize;
+    diskBlocks    = numBlocks;
+    return 0;
+}
+
+int Disk_BlockSize(void) {
+    return diskBlockSize;
+}
+
+int Disk_NumBlocks(void) {
+    return diskBlocks;
+}
+
+/*
+ * Saves the whole disk image - this will overwrite an existing file with
+ * the same name so be careful
+ */
+int Disk_Save(char* file) {
+    if (file == NULL) {
+        return E_DISK_ERROR;
+    }
+
+    int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return E_DISK_ERROR;
+    }
+    int rc = runImage(fd, 1);
+    close(fd);
+    if (rc < 0) {
+        return E_DISK_ERROR;
+    }
+    markSynced(file);
+    return 0;
+}
+
+/*
+ * Loads a current disk image from disk into memory - requires that
+ * the disk be created first. The image must be a whole number of blocks
+ * of the current block size; its length gives the block count.
+ */
+int Disk_Load(char* file) {
+    if (file == NULL) {
+        return E_DISK_ERROR;
+    }
+
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        return E_DISK_ERROR;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size <= 0 || st.st_size % diskBlockSize != 0) {
+        close(fd);
+        return E_DISK_ERROR;
+    }
+    char* bytes = malloc((size_t) st.st_size);
+    if (bytes == NULL || setDisk(bytes, (int) (st.st_size / diskBlockSize)) < 0) {
+        close(fd);
+        return E_DISK_ERROR;
+    }
+    int rc = runImage(fd, 0);
+    close(fd);
+    if (rc < 0) {
+        return E_DISK_ERROR;
+    }
+    markSynced(file);
+    return 0;
+}
+
+/*
+ * Reads a single block from "disk" and puts it into a buffer provided
+ * by the user.
+ */
+int Disk_Read(int block, char* buffer) {
+    if ((block < 0) || (block >= diskBlocks) || (buffer == NULL)) {
+        return E_DISK_ERROR;
+    }
+    memcpy((void*) buffer, (void*) (disk + (size_t) block * diskBlockSize), diskBlockSize);
+    return 0;
+}
+
+/*
+ * Writes a single block from memory to "disk".
+ */
+int Disk_Write(int block, char* buffer) {
+    if ((block < 0) || (block >= diskBlocks) || (buffer == NULL)) {
+        return E_DISK_ERROR;
+    }
+    memcpy((void*) (disk + (size_t) block * diskBlockSize), (void*) buffer, diskBlockSize);
+    dirty[block / 64] |= (uint64_t) 1 << (block % 64);
+    if (writeHook != NULL) {
+        writeHook(block);
+    }
+    return 0;
+}
+
+void Disk_SetWriteHook(Disk_WriteHook hook) {
+    writeHook = hook;
+}
+
+/* Copies the whole disk into buffer */
+int Disk_Copy(char* buffer) {
+    if (buffer == NULL) {
+        return E_DISK_ERROR;
+    }
+    memcpy(buffer, disk, (size_t) diskBlocks * (size_t) diskBlockSize);
+    return 0;
+}
+
+/*
+ * Incremental save: every run of adjacent dirty blocks becomes one write
+ * request, and all of them are in flight together. If file is not the
+ * image the disk last matched, a fresh disk (zero outside the dirty set) is
+ * saved the same way into a sparse file of its length, and anything else
+ * falls back to a full Disk_Save.
+ */
+int Disk_SyncDirty(char* file) {
+    if (file == NULL) {
+        return E_DISK_ERROR;
+    }
+
+    int fd;
+    if (syncedFile != NULL && strcmp(syncedFile, file) == 0) {
+        if ((fd = open(file, O_WRONLY)) < 0) {
+            return Disk_Save(file);
+        }
+    } else if (diskFresh) {
+        fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return E_DISK_ERROR;
+        }
+        if (ftruncate(fd, (off_t) diskBlocks * (off_t) diskBlockSize) < 0) {
+            close(fd);
+            return E_DISK_ERROR;
+        }
+    } else {
+        return Disk_Save(file);
+    }
+
+    DiskIo* ios = malloc(((size_t) (diskBlocks + 1) / 2 + 1) * sizeof(DiskIo));
+    if (ios == NULL) {
+        close(fd);
+        return E_DISK_ERROR;
+    }
+    int n = 0;
+    int block = 0;
+    while (block < diskBlocks) {
+        // skip to the next dirty block, a word at a time
+        uint64_t bits = dirty[block / 64] >> (block % 64);
+        if (bits == 0) {
+            block = (block / 64 + 1) * 64;
+            continue;
+        }
+        block += __builtin_ctzll(bits);
+        if (block >= diskBlocks) {
+            break;
+        }
+
+        // extend the run over adjacent dirty blocks
+        int end = block;
+        while (end < diskBlocks && (dirty[end / 64] >> (end % 64)) & 1) {
+            end++;
+        }
+        ios[n].buf = disk + (size_t) block * diskBlockSize;
+        ios[n].len = (size_t) (end - block) * (size_t) diskBlockSize;
+        ios[n].off = (off_t) block * (off_t) diskBlockSize;
+        n++;
+        block = end;
+    }
+
+    int rc = runIo(fd, 1, ios, n);
+    free(ios);
+    close(fd);
+    if (rc < 0) {
+        return E_DISK_ERROR;
+    }
+    markSynced(file);
+    return 0;
+}
@@ -7,31 +7,68 @@
 * structure with bitmaps for allocation tracking.
 **********************************************************************/
 
+#define _XOPEN_SOURCE 700
+
 #include "TinyFS.h"
 #include "TinyDisk.h"
 
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 /************************************************************
  *  TINYFS DISK LAYOUT 
  *
+ *  The geometry (block size, block count, inode count) is chosen when the
+ *  file system is formatted; every region after the superblock is placed
+ *  then and recorded in it, and mounting lays the file system out from it.
+ *
  *  Block 0 : SUPERBLOCK
- *      - must store MAGIC_NUMBER at the start
+ *      - MAGIC_NUMBER, then the geometry and the regions (see Superblock)
+ *
+ *  Blocks 1 ... : INODE BITMAP
+ *      - FS_NUM_INODES bits packed into uint64_t words (0 = free, 1 = used),
+ *        as many blocks as that takes
+ *
+ *  Following blocks ... : DATA BITMAP
+ *      - FS_NUM_BLOCKS bits, likewise
  *
- *  Block 1 : INODE BITMAP
- *      - array of MAX_FILES ints (0 = free, 1 = used)
+ *  Following blocks ... : BLOCK REFERENCE COUNTS
+ *      - one byte per block: references to it beyond the first (snapshots
+ *        sharing a data block with the live file system, see SNAPSHOTS)
  *
- *  Block 2 : DATA BITMAP
- *      - array of NUM_BLOCKS ints (0 = free, 1 = used)
+ *  Following JOURNAL_BLOCKS blocks : METADATA JOURNAL
+ *      - sized at format time (at least JOURNAL_MIN_BLOCKS) so that one
+ *        group commit always fits, see journalSize()
+ *      - block 0 of the region: header (magic, sequence of the first transaction)
+ *      - then transactions back to back, each one
+ *          * descriptor: seq, home blocks logged, home blocks revoked
+ *          * a copy of each block that descriptor logs
+ *          * more descriptors with their copies, as many as the group needs
+ *          * commit record: seq and checksum of the above
  *
- * Block 3 ... ??? : INODE BLOCKS
- *      Each inode contains:
- *          * filename[MAX_FILENAME_LENGTH]
+ * Following blocks ... ??? : INODE BLOCKS
+ *      Each inode is a fixed 32-byte record, FS_BLOCK_SIZE / 32 per block:
  *          * int size
- *          * int dataBlocks[NUM_DIRECT_POINTERS]   // exactly 5
+ *          * int flags                 // INODE_INLINE, INODE_DIR
+ *          * int dataBlocks[NUM_DIRECT_POINTERS]   // exactly 4
+ *          * int indirectBlock         // block of PTRS_PER_BLOCK pointers
+ *          * int doubleIndirectBlock   // block of pointers to indirect blocks
+ *      An inline inode keeps its data in place of the pointer fields.
+ *      Directory inodes (INODE_DIR, inode 0 is the root) hold their names
+ *      as packed variable-length entries; past one block, block 0 becomes
+ *      a hash index over the others (see DIRECTORY).
  *
  *  Remaining blocks after inode blocks are DATA BLOCKS
  ************************************************************/
@@ -42,487 +79,5393 @@
 
 #define MAGIC_NUMBER 0x12345678
 
+/* Inodes by default: one per file, plus the root directory */
+#define DEFAULT_NUM_INODES (MAX_FILES + 1)
+#define ROOT_INODE 0
+
+/*
+ * Block sizes a file system can be formatted with: powers of two, at least
+ * one bitmap word per pointer block and no longer than a directory entry's
+ * recLen can span.
+ */
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 32768
+
+/*
+ * Block size of the mounted file system, read from its superblock. Built
+ * with -DTINYFS_BLOCK_SIZE=n it is that constant instead (the default for
+ * new file systems, and the only one that mounts), so every division by it
+ * and every block buffer is sized at compile time on the hot paths.
+ */
+#ifdef TINYFS_BLOCK_SIZE
+#define FS_BLOCK_SIZE TINYFS_BLOCK_SIZE
+#else
+#define FS_BLOCK_SIZE fsBlockSize
+#endif
+
 /* File descriptors returned to user start at 3 (like stdin=0, stdout=1, stderr=2) */
 #define FD_OFFSET 3
 
-/* Size of Open File Table (max open files at once) */
-#define OPEN_FILE_TABLE_SIZE 5
+/* Open File Table grows one chunk of entries at a time, up to MAX_OPEN_FILES */
+#define OFT_CHUNK_SIZE 64
+#define OFT_MAX_CHUNKS ((MAX_OPEN_FILES + OFT_CHUNK_SIZE - 1) / OFT_CHUNK_SIZE)
+
+/* OFT free-list head: ABA tag in the high 32 bits, entry index (-1 = empty) in the low 32 */
+#define OFT_HEAD_PACK(tag, idx) (((uint64_t)(tag) << 32) | (uint32_t)(idx))
+#define OFT_HEAD_INDEX(head)    ((int)(uint32_t)(head))
+#define OFT_HEAD_TAG(head)      ((uint32_t)((head) >> 32))
 
-/* Block roles */
+/* Block roles: the superblock is always block 0, the other regions are recorded in it */
 #define SUPERBLOCK_INDEX     0
-#define INODE_BITMAP_INDEX   1
-#define DATA_BITMAP_INDEX    2
+
+/*
+ * Redo journal for metadata (bitmaps, inode table, pointer blocks). Updates
+ * from up to JOURNAL_GROUP_OPS operations are committed together as one
+ * transaction, or sooner once JOURNAL_TX_BLOCKS metadata blocks are waiting.
+ * Besides the blocks in front of the journal (superblock, bitmaps, reference
+ * counts), one operation changes at most JOURNAL_OP_BLOCKS metadata blocks;
+ * a write, preallocation or compression pass longer than
+ * JOURNAL_PIECE_BLOCKS file blocks is done as several operations.
+ */
+#define JOURNAL_MIN_BLOCKS   64
+#define JOURNAL_MAGIC        0x4A524E4C
+#define JOURNAL_DESC_MAGIC   0x4A444553
+#define JOURNAL_COMMIT_MAGIC 0x4A434D54
+#define JOURNAL_GROUP_OPS    16
+#define JOURNAL_TX_BLOCKS    16
+#define JOURNAL_OP_BLOCKS    24
+#define JOURNAL_PIECE_BLOCKS (8 * PTRS_PER_BLOCK)
+
+/* Block numbers one descriptor can list */
+#define JOURNAL_DESC_SLOTS(blockSize) (((blockSize) - 4 * (int)sizeof(int)) / (int)sizeof(int))
+
+/* Block pointers held by one indirect block */
+#define PTRS_PER_BLOCK (FS_BLOCK_SIZE / (int)sizeof(int))
+
+/*
+ * Flag bit in a data block pointer: the block is reserved but was never
+ * written (unwritten extent), so it reads back as zeros without touching
+ * the disk and needs no zero-fill until the first write lands in it.
+ */
+#define PTR_UNWRITTEN  0x40000000
+
+/*
+ * Flag bit in a data block pointer: the block belongs to a compressed group
+ * (see COMPRESSION). The group's first pointers list the blocks holding the
+ * compressed bytes, in order; the rest carry the flag and block 0.
+ */
+#define PTR_COMPRESSED 0x20000000
+#define PTR_BLOCK(p)   ((p) & ~(PTR_UNWRITTEN | PTR_COMPRESSED))
+
+/* Inode flags: the data lives in the inode itself (see inlineData()); a directory; hash-indexed;
+ * groups written are compressed on close (File_SetCompression); blocks written are deduplicated */
+#define INODE_INLINE   0x1
+#define INODE_DIR      0x2
+#define INODE_INDEXED  0x4
+#define INODE_COMPRESS 0x8
+#define INODE_DEDUP    0x10
+
+/* 64-bit words needed for a bitmap of n bits */
+#define BITMAP_WORDS(n) (((n) + 63) / 64)
+#define BITMAP_WORDS_PER_BLOCK (FS_BLOCK_SIZE / (int)sizeof(uint64_t))
+
+/* Inodes a thread claims per refill of its pool, and block frees it batches */
+#define INODE_POOL_BATCH     4
+#define POOL_FREE_BATCH      64
+
+/* Dentry cache: sets (power of two) of DCACHE_WAYS entries each */
+#define DCACHE_SETS          256
+#define DCACHE_WAYS          4
+
+/* Directory index: root and interior block magics, children one index block holds, and index blocks on a path */
+#define DIR_INDEX_MAGIC      0x44495848
+#define DIR_NODE_MAGIC       0x44494E44
+#define DIR_INDEX_MAX        ((FS_BLOCK_SIZE - 2 * (int)sizeof(int)) / (int)sizeof(DirIndexEntry))
+#define DIR_INDEX_LEVELS     4
+
+/* Async submission queue: outstanding (unreaped) requests, and worker threads */
+#define ASYNC_QUEUE_DEPTH    256
+#define ASYNC_WORKERS        4
+
+/* Blocks held by the write-back block cache (override with -DCACHE_BLOCKS=n) */
+#ifndef CACHE_BLOCKS
+#define CACHE_BLOCKS 64
+#endif
+
+/* Sequential read-ahead window bounds in blocks (kept to a quarter of the cache), and queued runs */
+#define READAHEAD_MAX        (CACHE_BLOCKS / 4 > 32 ? 32 : CACHE_BLOCKS / 4 < 1 ? 1 : CACHE_BLOCKS / 4)
+#define READAHEAD_MIN        (READAHEAD_MAX < 4 ? READAHEAD_MAX : 4)
+#define READAHEAD_QUEUE      64
 
 /* ------------------------- */
 /*       IN-MEMORY TYPES     */
 /* ------------------------- */
 
 typedef struct {
-    char filename[MAX_FILENAME_LENGTH];
     int  size;
+    int  flags;                            // INODE_INLINE, INODE_DIR
     int  dataBlocks[NUM_DIRECT_POINTERS];  // direct pointers to data blocks
+    int  indirectBlock;                    // single-indirect pointer block, -1 = none
+    int  doubleIndirectBlock;              // double-indirect pointer block, -1 = none
 } Inode;
 
+/* Inode table density: the whole record is fixed-size, names live in the directory */
+typedef char inodeIsCompact[MIN_BLOCK_SIZE / sizeof(Inode) >= 16 ? 1 : -1];
+
+/* A snapshot in the superblock: its id, and a file holding its copy of the inode table then the inode bitmap */
+typedef struct {
+    int   id;       // > 0; 0 = free slot
+    int   unused;
+    Inode table;
+} SnapshotRecord;
+
+/* Block 0: the geometry picked at format time and where each region starts */
+typedef struct {
+    int magic;              // MAGIC_NUMBER
+    int blockSize;
+    int numBlocks;
+    int numInodes;
+    int inodeBitmapStart;
+    int inodeBitmapBlocks;
+    int dataBitmapStart;
+    int dataBitmapBlocks;
+    int journalStart;
+    int journalBlocks;
+    int inodeTableStart;
+    int inodeTableBlocks;
+    int dataStart;          // first data block
+    int freeInodes;         // free-space counters as of the last commit, see FS_Stat()
+    int freeBlocks;
+    int refCountStart;      // block reference counts; 0 blocks on images from before them
+    int refCountBlocks;
+    int lastSnapshotId;
+    SnapshotRecord snapshots[FS_MAX_SNAPSHOTS];
+    int sharedRefs;         // sum of the reference counts as of the last commit: 0 = nothing shared
+} Superblock;
+
+typedef char superblockFitsBlock[sizeof(Superblock) <= MIN_BLOCK_SIZE ? 1 : -1];
+
+/*
+ * Directory entry, packed back to back in a directory's blocks. recLen runs
+ * to the next entry (the last one to the end of its block); an entry only
+ * needs DIRENT_SIZE(nameLen) of it, the rest is free for a new entry.
+ */
+typedef struct {
+    int            inode;    // -1 = unused
+    unsigned short recLen;
+    unsigned char  nameLen;
+    unsigned char  type;     // DIRENT_FILE or DIRENT_DIR
+    char           name[];   // nameLen bytes, no terminator
+} DirEntry;
+
+#define DIRENT_SIZE(len) ((int)((offsetof(DirEntry, name) + (len) + 3) & ~(size_t)3))
+#define DIRENT_FILE      1
+#define DIRENT_DIR       2
+
+/*
+ * Index block of an indexed directory: block 0 (the root) and the interior
+ * blocks under it. Its children are sorted by the lowest name hash each one
+ * covers (the root's entries[0].hash is 0); names with hash h live under
+ * the last entry whose hash is <= h. levels counts the index levels below
+ * the block, 0 = its children are leaves.
+ */
+typedef struct {
+    unsigned int hash;
+    int          lblk;   // child's block number within the directory
+} DirIndexEntry;
+
+typedef struct {
+    int            magic;   // DIR_INDEX_MAGIC in the root, DIR_NODE_MAGIC below it
+    unsigned short count;
+    unsigned short levels;
+    DirIndexEntry  entries[];
+} DirIndexNode;
+
+/* One step of a lookup down the index: an index block and the entry taken in it */
+typedef struct {
+    int lblk;
+    int slot;
+} DirIndexPos;
+
+/* Dentry cache entry: a resolved (directory, name) pair */
+typedef struct {
+    int          dir;     // directory inode
+    int          inode;   // -1 = empty way
+    int          type;    // DIRENT_FILE or DIRENT_DIR
+    unsigned int hash;
+    unsigned int stamp;   // last use, for replacement
+    char         name[MAX_FILENAME_LENGTH];
+} Dentry;
+
+/*
+ * Per-thread allocation pool: free inodes and data blocks this thread has
+ * reserved (one bitmap word each) and hands out without synchronization,
+ * plus block frees waiting to be applied together.
+ */
+typedef struct {
+    int          registered; // thread-exit destructor installed
+    unsigned int boot;       // poolBootEpoch the reservations belong to
+    unsigned int epoch;      // poolEpoch last seen; a newer one recalls the reservations
+    int          blockWord;  // dataClaimed word the reserved blocks are in
+    uint64_t     blockMask;  // reserved blocks not handed out yet
+    int          inodeWord;
+    uint64_t     inodeMask;
+    int          nFreed;
+    int          freed[POOL_FREE_BATCH];
+} AllocPool;
+
+/* One File_ReadAsync / File_WriteAsync submission */
+typedef struct {
+    int              id;        // request id, 0 = slot free
+    int              state;     // ASYNC_QUEUED, ASYNC_RUNNING or ASYNC_DONE
+    int              waited;    // 1 = an FS_WaitAsync reaps it: FS_PollAsync leaves it alone
+    int              write;     // 1 = File_Write, 0 = File_Read
+    int              fd;
+    void            *buffer;
+    int              size;
+    int              result;    // return value of the call, once ASYNC_DONE
+    FS_AsyncCallback callback;
+    void            *arg;
+} AsyncRequest;
+
+enum { ASYNC_QUEUED, ASYNC_RUNNING, ASYNC_DONE };
+
+/* A run of len blocks mapping file block lblk onward to disk block pblk onward */
+typedef struct {
+    int lblk;
+    int pblk;
+    int len;
+} Extent;
+
+typedef struct {
+    int  block;      // disk block cached here, -1 = empty slot
+    int  dirty;      // 1 = differs from disk, write back before reuse
+    int  referenced; // CLOCK reference bit
+    int  meta;       // 1 = metadata block, goes through the journal
+    int  pending;    // 1 = metadata changed since the last commit, must not reach home yet
+    char *data;      // FS_BLOCK_SIZE bytes in cacheData
+} CacheEntry;
+
+/*
+ * Journal descriptor block: which home blocks the following copies belong
+ * to. The block after the copies is the transaction's next descriptor, or
+ * its commit record.
+ */
+typedef struct {
+    int magic;
+    int seq;
+    int count;                      // logged copies that follow
+    int revokeCount;                // freed blocks listed after them
+    int blocks[];                   // count home blocks, then revokeCount revoked ones
+} JournalDescriptor;
+
+/* Journal header and commit record share this shape; checksum unused in the header */
+typedef struct {
+    int          magic;
+    int          seq;
+    unsigned int checksum;
+} JournalRecord;
+
+/* Latest committed copy of a metadata block not yet written home */
+typedef struct {
+    int  block;
+    char *data;      // FS_BLOCK_SIZE bytes in journalFrozenData
+} JournalFrozen;
+
+/* In-core copy of an open inode, shared by every fd open on it */
+typedef struct {
+    int   inodeIndex;
+    int   openCount; // fds open on it; released when this drops to 0
+    int   dirty;     // 1 = ino differs from the inode table
+    int   writtenLo; // file blocks written since the last compression pass, lo > hi = none
+    int   writtenHi;
+    pthread_rwlock_t lock; // readers share it; writers and flushes hold it exclusively
+    Inode ino;
+} InCoreInode;
+
 typedef struct {
     int used;        // 0 = free, 1 = in use
     int inodeIndex;  // which inode this fd refers to
     int filePointer; // current byte offset within file
+    InCoreInode *ip; // pinned in-core inode
+
+    /* last indirect block this fd resolved through, valid while indGen matches */
+    int          indBlock;
+    unsigned int indGen;
+    int         *indPtrs;   // PTRS_PER_BLOCK entries, stored after the entry's chunk
+
+    /* sequential read detector, see readAhead() */
+    int raNext;      // offset a sequential read would start at, -1 = none
+    int raWindow;    // read-ahead window in blocks, 0 = not sequential
+    int raAhead;     // first file block past the prefetched stretch
+
+    int nextFree;    // next free entry (table index) while unused, -1 = end
+    pthread_mutex_t lock; // serializes calls on this fd (file pointer, indirect cache)
 } OpenFile;
 
 /* ------------------------- */
 /*        GLOBAL STATE       */
 /* ------------------------- */
 
-/* Bitmaps live both in memory and on disk */
-static int inodeBitmap[MAX_FILES];
-static int dataBitmap[NUM_BLOCKS];
+/* Bitmaps live both in memory and on disk, one bit per inode / block (sized in FS_Boot) */
+static uint64_t *inodeBitmap = NULL;
+static uint64_t *dataBitmap  = NULL;
+
+/*
+ * Claimed copies of the bitmaps: allocated bits plus those reserved in some
+ * thread's pool. Pools are refilled by claiming bits here atomically; the
+ * bitmaps above (what goes to disk) only gain a bit once it is handed out.
+ */
+static uint64_t *inodeClaimed = NULL;
+static uint64_t *dataClaimed  = NULL;
+
+/*
+ * Data blocks freed since the last commit: clear in dataBitmap but still
+ * set in dataClaimed until the commit that frees them on disk. Reusing one
+ * sooner would let new data overwrite a block that the committed metadata
+ * (the deleted file, or its pointer block) still refers to when a crash
+ * leaves the free uncommitted. dataHeldCount counts them.
+ */
+static uint64_t *dataHeld      = NULL;
+static int       dataHeldCount = 0;
+
+/*
+ * A mount leaves the bitmaps on disk: they (and the claimed copies) are
+ * read in by the first allocation or free, see bitmapsEnsure().
+ */
+static int             bitmapsLoaded   = 0;
+static pthread_mutex_t bitmapLoadMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Free inodes and data blocks (clear bits of the bitmaps above), changed
+ * atomically with them. A commit that changes them carries them to the
+ * superblock, so a mount knows them before the bitmaps are read.
+ */
+static int freeInodeCount = 0;
+static int freeBlockCount = 0;
+
+/*
+ * References to each block beyond the first, FS_NUM_BLOCKS bytes (see
+ * SNAPSHOTS and DEDUPLICATION). Read in with the bitmaps, and only then if
+ * something is shared: sharedRefs is their sum, 0 = every count is 0.
+ * snapshotCount is the number of snapshots.
+ */
+static unsigned char *blockRefs     = NULL;
+static int            sharedRefs    = 0;
+static int            snapshotCount = 0;
 
-/* Open File Table */
-static OpenFile oft[OPEN_FILE_TABLE_SIZE];
+/* FS_BootSnapshot: mounted read-only, with the inodes read from this snapshot's copy of the table */
+static int   readOnly = 0;
+static Inode snapshotTable;
 
-/* Layout variables (computed in FS_Boot) */
+/* Rotating allocation hints: next bitmap word to claim from first */
+static int inodeAllocHint = 0;
+static int dataAllocHint  = 0;
+
+/*
+ * Open File Table: chunks allocated on demand and never moved, so an fd's
+ * entry stays put as the table grows and can be found without a lock. Free
+ * entries form a lock-free LIFO free-list (compare-and-swap on a tagged
+ * head), making fd allocation and release O(1); only growing takes a lock.
+ */
+static OpenFile        *oftChunks[OFT_MAX_CHUNKS];
+static int              oftCapacity = 0;                      // entries in allocated chunks
+static uint64_t         oftFreeHead = OFT_HEAD_PACK(0, -1);   // first free entry
+static pthread_mutex_t  oftGrowMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Allocation pools: the calling thread's, and the epochs that recall or void them */
+static __thread AllocPool threadPool;
+static pthread_key_t      poolKey;
+static pthread_once_t     poolKeyOnce   = PTHREAD_ONCE_INIT;
+static unsigned int       poolEpoch     = 0;  // bumped by FS_Sync and when allocation runs dry
+static unsigned int       poolBootEpoch = 1;  // bumped by FS_Boot
+
+/* Non-zero while the calling thread runs an FS_Batch: its operations count as one */
+static __thread int batchDepth = 0;
+
+/* Geometry and layout variables (from the superblock, set in FS_Boot) */
+#ifndef TINYFS_BLOCK_SIZE
+static int fsBlockSize            = BLOCK_SIZE;
+#endif
+static int FS_NUM_BLOCKS          = 0;
+static int FS_NUM_INODES          = 0;
+static int FS_MAX_FILE_SIZE       = 0;
+static int INODE_BITMAP_START     = 0;
+static int INODE_BITMAP_BLOCKS    = 0;
+static int DATA_BITMAP_START      = 0;
+static int DATA_BITMAP_BLOCKS     = 0;
+static int REFCOUNT_START         = 0;
+static int REFCOUNT_BLOCKS        = 0;
+static int JOURNAL_START          = 0;
+static int JOURNAL_BLOCKS         = 0;
 static int INODES_PER_BLOCK       = 0;
 static int INODE_TABLE_START      = 0;
 static int INODE_TABLE_BLOCKS     = 0;
 static int DATA_BLOCK_START       = 0;
 
+/*
+ * Dentry cache: recently resolved (directory, name) -> inode pairs, so a
+ * path walk resolves every component it has seen before from memory.
+ * dcacheMutex guards it: lookups run under a shared nameLock and fill it
+ * concurrently. Entries go when their name is removed.
+ */
+static Dentry          dcache[DCACHE_SETS][DCACHE_WAYS];
+static unsigned int    dcacheClock = 0;
+static pthread_mutex_t dcacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Write-back block cache. cacheSlot[] maps a disk block to the cache entry
+ * holding it (-1 = not cached); victims are picked with the CLOCK hand.
+ * Pending metadata cannot be evicted, so when every entry is pending the
+ * cache grows past CACHE_BLOCKS; the overflow goes after the next commit.
+ */
+static CacheEntry   *cache = NULL;      // cacheEntries entries
+static int           cacheEntries = 0;
+static char         *cacheData = NULL;  // the first CACHE_BLOCKS entries' blocks; overflow ones have their own
+static int          *cacheSlot = NULL;  // FS_NUM_BLOCKS entries
+static int           cacheHand = 0;
+static FS_CacheStats cacheStats;
+
+/*
+ * Group cache: compressed groups decompressed by a read, keyed by the first
+ * block of their compressed bytes, under cacheMutex like the block cache.
+ * groupCacheData holds GROUP_CACHE_SLOTS groups, then one of scratch.
+ */
+#define GROUP_CACHE_SLOTS 4
+typedef struct {
+    int  block;      // -1 = empty slot
+    char *data;      // FS_COMPRESS_GROUP * FS_BLOCK_SIZE bytes
+} GroupCacheEntry;
+
+static GroupCacheEntry groupCache[GROUP_CACHE_SLOTS];
+static char           *groupCacheData = NULL;
+static int             groupCacheHand = 0;
+
+/*
+ * Dedup index (see DEDUPLICATION): content hash -> data block, open
+ * addressing with linear probing from slot hash & dedupMask, at most
+ * DEDUP_MAX_PROBE slots, dedupMask + 1 slots, under cacheMutex. dedupSlot[]
+ * is the slot naming each block (-1 = none), FS_NUM_BLOCKS entries.
+ */
+#define DEDUP_MAX_SLOTS (1 << 16)
+#define DEDUP_MAX_PROBE 64
+#define DEDUP_EMPTY     -1
+#define DEDUP_REMOVED   -2  // a probe goes on past it; an insert may reuse it
+typedef struct {
+    uint64_t hash;
+    int      block;  // or DEDUP_EMPTY, DEDUP_REMOVED
+} DedupEntry;
+
+static DedupEntry *dedupIndex   = NULL;
+static int        *dedupSlot    = NULL;
+static int         dedupMask    = 0;
+static int         dedupEntries = 0;  // blocks in the index: read without cacheMutex
+
+/*
+ * Journal state. Committed copies stay in journalFrozen[] until the next
+ * checkpoint writes them home; blocks freed in the meantime are revoked so
+ * recovery does not replay them over whatever reuses the block. Both hold
+ * at most one entry per block of the region.
+ */
+static int            journalHead    = 1;  // next free block in the region
+static int            journalSeq     = 1;  // sequence number of the next transaction
+static int            journalOps     = 0;  // operations in the running transaction
+static int            journalActive  = 0;  // operations started and not yet stopped
+static int            journalPending = 0;  // cache entries with pending set
+static int            journalCopies  = 0;  // most copies one transaction can carry in an empty journal
+static int           *journalRevokes = NULL;  // only frozen blocks are revoked
+static int            journalNumRevokes = 0;
+static JournalFrozen *journalFrozen  = NULL;
+static char          *journalFrozenData = NULL;  // their blocks, JOURNAL_BLOCKS * FS_BLOCK_SIZE bytes
+static int            journalNumFrozen  = 0;
+
+/* In-core inodes of open files, indexed by inode number (NULL = not open), FS_NUM_INODES entries */
+static InCoreInode **openInodes = NULL;
+
+/* Bumped whenever a pointer block changes; stale fd indirect caches reload */
+static unsigned int indirectGeneration = 0;
+
+/*
+ * Async submission queue. Request ids grow by one per submission and id %
+ * ASYNC_QUEUE_DEPTH is the request's slot, held until it is reaped; every
+ * id below asyncOldest has been reaped. asyncFdBusy[] marks fds with a
+ * request running, so the next one on that fd waits its turn.
+ */
+static AsyncRequest    asyncQueue[ASYNC_QUEUE_DEPTH];
+static int             asyncNextId  = 1;
+static int             asyncOldest  = 1;
+static int             asyncWorkers = 0;  // worker threads running
+static unsigned char   asyncFdBusy[MAX_OPEN_FILES];
+static pthread_mutex_t asyncMutex   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  asyncWork    = PTHREAD_COND_INITIALIZER;  // request queued or fd idle again
+static pthread_cond_t  asyncDone    = PTHREAD_COND_INITIALIZER;  // request finished
+static pthread_once_t  asyncOnce    = PTHREAD_ONCE_INIT;
+
+/* Read-ahead runs (pblk, len) queued for the async workers, under asyncMutex */
+static Extent          readAheadRuns[READAHEAD_QUEUE];
+static int             readAheadHead    = 0;
+static int             readAheadCount   = 0;
+static int             readAheadRunning = 0;  // runs being loaded by workers
+
 /* For FS_Sync (if used) */
 static char g_disk_path[256] = {0};
 
+/*
+ * Locks. Every call takes them in this order, so none can deadlock:
+ *   fd lock, journalTxLock, nameLock, openInodesMutex, inode lock, cacheMutex
+ * (dcacheMutex is taken under nameLock and nothing is locked inside it;
+ * bitmapLoadMutex may be taken under any of them and only reads the disk)
+ * The allocator takes no lock: see the per-thread pools.
+ * journalTxLock is held shared by each metadata-changing operation and
+ * exclusively by a commit, so a transaction never holds half an operation.
+ * cacheMutex is recursive: the journal and the in-core inode flush re-enter
+ * cache helpers while holding it. FS_Boot must not race with other calls.
+ */
+static pthread_rwlock_t journalTxLock   = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t nameLock        = PTHREAD_RWLOCK_INITIALIZER; // namespace: every directory
+static pthread_mutex_t  openInodesMutex = PTHREAD_MUTEX_INITIALIZER;  // openInodes[] and open counts
+static pthread_mutex_t  cacheMutex;     // block cache, journal state and every Disk_Write
+static pthread_once_t   cacheMutexOnce  = PTHREAD_ONCE_INIT;
+
 /* ------------------------- */
 /*      HELPER FUNCTIONS     */
 /* ------------------------- */
 
-/* Initialize Open File Table */
-static void initOFT(void) {
-    for (int i = 0; i < OPEN_FILE_TABLE_SIZE; i++) {
-        oft[i].used = 0;
-        oft[i].inodeIndex = -1;
-        oft[i].filePointer = 0;
-    }
+static void initCacheMutex(void) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&cacheMutex, &attr);
+    pthread_mutexattr_destroy(&attr);
 }
 
-/* Write both bitmaps back to disk */
-static void syncBitmapsToDisk(void) {
-    Disk_Write(INODE_BITMAP_INDEX, (char *)inodeBitmap);
-    Disk_Write(DATA_BITMAP_INDEX, (char *)dataBitmap);
+static void cacheLock(void) {
+    pthread_mutex_lock(&cacheMutex);
 }
 
-/* Compute the block and offset inside that block where a given inode lives */
-static void readInode(int inodeIndex, Inode *ino) {
-    int block   = INODE_TABLE_START + (inodeIndex / INODES_PER_BLOCK);
-    int offset  = (inodeIndex % INODES_PER_BLOCK) * (int)sizeof(Inode);
-
-    char buf[BLOCK_SIZE];
-    Disk_Read(block, buf);
-    memcpy(ino, buf + offset, sizeof(Inode));
+static void cacheUnlock(void) {
+    pthread_mutex_unlock(&cacheMutex);
 }
 
-static void writeInode(int inodeIndex, const Inode *ino) {
-    int block   = INODE_TABLE_START + (inodeIndex / INODES_PER_BLOCK);
-    int offset  = (inodeIndex % INODES_PER_BLOCK) * (int)sizeof(Inode);
-
-    char buf[BLOCK_SIZE];
-    Disk_Read(block, buf);
-    memcpy(buf + offset, ino, sizeof(Inode));
-    Disk_Write(block, buf);
+/* Table entry i of the Open File Table */
+static OpenFile *oftEntry(int i) {
+    OpenFile *chunk = __atomic_load_n(&oftChunks[i / OFT_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+    return &chunk[i % OFT_CHUNK_SIZE];
 }
 
-/* Allocate a free inode in the bitmap */
-static int allocateInode(void) {
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (inodeBitmap[i] == 0) {
-            inodeBitmap[i] = 1;
-            Disk_Write(INODE_BITMAP_INDEX, (char *)inodeBitmap);
-            return i;
+/* Initialize Open File Table: drop every fd and every in-core inode */
+static void initOFT(void) {
+    for (int c = 0; c < OFT_MAX_CHUNKS; c++) {
+        if (oftChunks[c] == NULL) continue;
+        for (int i = 0; i < OFT_CHUNK_SIZE && c * OFT_CHUNK_SIZE + i < oftCapacity; i++) {
+            pthread_mutex_destroy(&oftChunks[c][i].lock);
+        }
+        free(oftChunks[c]);
+        oftChunks[c] = NULL;
+    }
+    oftCapacity = 0;
+    oftFreeHead = OFT_HEAD_PACK(0, -1);
+    for (int i = 0; openInodes != NULL && i < FS_NUM_INODES; i++) {
+        if (openInodes[i] != NULL) {
+            pthread_rwlock_destroy(&openInodes[i]->lock);
         }
+        free(openInodes[i]);
+        openInodes[i] = NULL;
     }
-    return -1;  // no free inode
 }
 
-/* Free an inode in the bitmap */
-static void freeInode(int inodeIndex) {
-    if (inodeIndex < 0 || inodeIndex >= MAX_FILES) return;
-    inodeBitmap[inodeIndex] = 0;
-    Disk_Write(INODE_BITMAP_INDEX, (char *)inodeBitmap);
+/* Push the chain of free entries first ... last (already linked) on the free-list */
+static void oftPush(int first, OpenFile *last) {
+    uint64_t head = __atomic_load_n(&oftFreeHead, __ATOMIC_ACQUIRE);
+    uint64_t next;
+    do {
+        __atomic_store_n(&last->nextFree, OFT_HEAD_INDEX(head), __ATOMIC_RELAXED);
+        next = OFT_HEAD_PACK(OFT_HEAD_TAG(head) + 1, first);
+    } while (!__atomic_compare_exchange_n(&oftFreeHead, &head, next, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
 }
 
-/* Allocate a free data block in the bitmap (only from DATA_BLOCK_START onward) */
-static int allocateDataBlock(void) {
-    for (int i = DATA_BLOCK_START; i < NUM_BLOCKS; i++) {
-        if (dataBitmap[i] == 0) {
-            dataBitmap[i] = 1;
-            Disk_Write(DATA_BITMAP_INDEX, (char *)dataBitmap);
+/* Pop a free entry; -1 if the free-list is empty */
+static int oftPop(void) {
+    uint64_t head = __atomic_load_n(&oftFreeHead, __ATOMIC_ACQUIRE);
+    for (;;) {
+        int i = OFT_HEAD_INDEX(head);
+        if (i < 0) {
+            return -1;
+        }
+        // may read a stale link if i was popped meanwhile; the tag then fails the swap
+        int next = __atomic_load_n(&oftEntry(i)->nextFree, __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&oftFreeHead, &head, OFT_HEAD_PACK(OFT_HEAD_TAG(head) + 1, next),
+                                        1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
             return i;
         }
     }
-    return -1;  // no free space
 }
 
-/* Free a data block (mark bitmap 0) */
-static void freeDataBlock(int blockIndex) {
-    if (blockIndex < 0 || blockIndex >= NUM_BLOCKS) return;
-    dataBitmap[blockIndex] = 0;
-    Disk_Write(DATA_BITMAP_INDEX, (char *)dataBitmap);
+/* Add one chunk of free entries to the table; -1 if at MAX_OPEN_FILES or out of memory */
+static int growOFT(void) {
+    pthread_mutex_lock(&oftGrowMutex);
+    if (OFT_HEAD_INDEX(__atomic_load_n(&oftFreeHead, __ATOMIC_ACQUIRE)) >= 0) {
+        // another thread grew the table (or closed an fd) first
+        pthread_mutex_unlock(&oftGrowMutex);
+        return 0;
+    }
+    int room = MAX_OPEN_FILES - oftCapacity;
+    int n = room < OFT_CHUNK_SIZE ? room : OFT_CHUNK_SIZE;
+    // the entries, then each one's indirect-block copy
+    OpenFile *chunk = n > 0 ? calloc(1, OFT_CHUNK_SIZE * (sizeof(OpenFile) + FS_BLOCK_SIZE)) : NULL;
+    if (chunk == NULL) {
+        pthread_mutex_unlock(&oftGrowMutex);
+        return -1;
+    }
+
+    // link the new entries in ascending order, then publish the chunk and push them
+    int base = oftCapacity;
+    for (int i = 0; i < n; i++) {
+        chunk[i].inodeIndex = -1;
+        chunk[i].nextFree   = base + i + 1;
+        chunk[i].indPtrs    = (int *)((char *)(chunk + OFT_CHUNK_SIZE) + (size_t)i * FS_BLOCK_SIZE);
+        pthread_mutex_init(&chunk[i].lock, NULL);
+    }
+    __atomic_store_n(&oftChunks[base / OFT_CHUNK_SIZE], chunk, __ATOMIC_RELEASE);
+    __atomic_store_n(&oftCapacity, base + n, __ATOMIC_RELEASE);
+    oftPush(base, &chunk[n - 1]);
+
+    pthread_mutex_unlock(&oftGrowMutex);
+    return 0;
 }
 
-/* Linear search over inodes to find a filename */
-static int lookupFile(const char *name) {
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (inodeBitmap[i]) {
-            Inode ino;
-            readInode(i, &ino);
-            if (strcmp(ino.filename, name) == 0) {
-                return i;
-            }
+/* Pop a free table entry; -1 when MAX_OPEN_FILES are open */
+static int allocOFTEntry(void) {
+    for (;;) {
+        int i = oftPop();
+        if (i >= 0) {
+            return i;
+        }
+        if (growOFT() < 0) {
+            return -1;
         }
     }
-    return -1;
 }
 
-/* Convert user-facing fd to index in oft[] */
-static int fdToIndex(int fd) {
-    int idx = fd - FD_OFFSET;
-    if (idx < 0 || idx >= OPEN_FILE_TABLE_SIZE) return -1;
-    if (!oft[idx].used) return -1;
-    return idx;
+/* Push a table entry back on the free-list; the caller holds its lock, which this drops */
+static void releaseOFTEntry(int i) {
+    OpenFile *of = oftEntry(i);
+    __atomic_store_n(&of->used, 0, __ATOMIC_RELEASE);
+    of->inodeIndex = -1;
+    of->ip         = NULL;
+    pthread_mutex_unlock(&of->lock);
+    oftPush(i, of);
 }
 
 /* ------------------------- */
-/*        FS_Boot()          */
+/*      INSTRUMENTATION      */
 /* ------------------------- */
 
-int FS_Boot(char *path) {
-    printf("FS_Boot %s\n", path);
-
-    if (Disk_Init() == -1) {
-        printf("Disk_Init() failed\n");
-        return E_DISK_ERROR;
-    }
-
-    /* Remember the path for possible FS_Sync */
-    if (path != NULL) {
-        strncpy(g_disk_path, path, sizeof(g_disk_path) - 1);
-        g_disk_path[sizeof(g_disk_path) - 1] = '\0';
-    }
-
-    /* Compute layout based on inode size */
-    INODES_PER_BLOCK   = BLOCK_SIZE / (int)sizeof(Inode);
-    INODE_TABLE_BLOCKS = (MAX_FILES + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
-    INODE_TABLE_START  = 3;
-    DATA_BLOCK_START   = INODE_TABLE_START + INODE_TABLE_BLOCKS;
+/*
+ * Built with -DTINYFS_STATS, every thread counts into its own ThreadStats
+ * (plain loads and stores, no shared cache lines); FS_GetStats sums them.
+ * Blocks are never freed: one a thread leaves behind at exit is handed to
+ * the next new thread and keeps counting. Without TINYFS_STATS the STAT_*
+ * macros compile to nothing.
+ */
+#ifdef TINYFS_STATS
 
-    /* Try to load an existing disk image */
-    if (Disk_Load(path) == 0) {
-        char buf[BLOCK_SIZE];
-        Disk_Read(SUPERBLOCK_INDEX, buf);
+typedef struct ThreadStats {
+    FS_LatencyStats     ops[FS_STAT_OPS];
+    unsigned long       diskReads[FS_REGIONS];
+    unsigned long       diskWrites[FS_REGIONS];
+    unsigned long       lookups;
+    unsigned long       lookupEntries;
+    unsigned long       dcacheHits;
+    unsigned long       dcacheMisses;
+    int                 owned;   // a live thread counts here; under statsMutex
+    struct ThreadStats *next;    // every block ever made; the list is only pushed to
+} ThreadStats;
 
-        int magic = 0;
-        memcpy(&magic, buf, sizeof(int));
+static __thread ThreadStats *threadStats = NULL;
+static ThreadStats    *statsList  = NULL;
+static pthread_mutex_t statsMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t   statsKey;
+static pthread_once_t  statsKeyOnce = PTHREAD_ONCE_INIT;
 
-        if (magic != MAGIC_NUMBER) {
-            // not a valid TinyFS filesystem
-            return E_DISK_ERROR;
-        }
+/* pthread key destructor: the block goes to the next thread that needs one */
+static void statsThreadExit(void *arg) {
+    pthread_mutex_lock(&statsMutex);
+    ((ThreadStats *)arg)->owned = 0;
+    pthread_mutex_unlock(&statsMutex);
+}
 
-        // load bitmaps into memory
-        Disk_Read(INODE_BITMAP_INDEX, (char *)inodeBitmap);
-        Disk_Read(DATA_BITMAP_INDEX, (char *)dataBitmap);
+static void initStatsKey(void) {
+    pthread_key_create(&statsKey, statsThreadExit);
+}
 
-        initOFT();
-        return 0;
+/* Take over a block left by an exited thread, or make one */
+static ThreadStats *statsAttach(void) {
+    pthread_once(&statsKeyOnce, initStatsKey);
+    pthread_mutex_lock(&statsMutex);
+    ThreadStats *t = statsList;
+    while (t != NULL && t->owned) {
+        t = t->next;
     }
+    if (t == NULL && (t = calloc(1, sizeof(ThreadStats))) != NULL) {
+        t->next = statsList;
+        __atomic_store_n(&statsList, t, __ATOMIC_RELEASE);
+    }
+    if (t != NULL) {
+        t->owned = 1;
+    }
+    pthread_mutex_unlock(&statsMutex);
+    if (t != NULL) {
+        pthread_setspecific(statsKey, t);
+        threadStats = t;
+    }
+    return t;
+}
 
-    /* Otherwise: create a new filesystem */
+/* Only the owning thread writes a counter, so load + store suffices; readers sum racing copies */
+static void statAdd(unsigned long *counter, unsigned long n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
 
-    char buf[BLOCK_SIZE];
+static uint64_t statClock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
 
-    // superblock
-    memset(buf, 0, BLOCK_SIZE);
-    memcpy(buf, &MAGIC_NUMBER, sizeof(int));
-    Disk_Write(SUPERBLOCK_INDEX, buf);
+/* One call of op that started at t0 */
+static void statLatency(int op, uint64_t t0) {
+    ThreadStats *t = threadStats != NULL ? threadStats : statsAttach();
+    if (t == NULL) {
+        return;
+    }
+    uint64_t ns = statClock() - t0;
+    int bucket = 63 - __builtin_clzll(ns | 1);
+    FS_LatencyStats *l = &t->ops[op];
+    statAdd(&l->calls, 1);
+    statAdd(&l->totalNs, (unsigned long)ns);
+    statAdd(&l->buckets[bucket < FS_STAT_BUCKETS ? bucket : FS_STAT_BUCKETS - 1], 1);
+    if (ns > l->maxNs) {
+        __atomic_store_n(&l->maxNs, (unsigned long)ns, __ATOMIC_RELAXED);
+    }
+}
 
-    // inode bitmap (all free)
-    memset(inodeBitmap, 0, sizeof(inodeBitmap));
-    Disk_Write(INODE_BITMAP_INDEX, (char *)inodeBitmap);
+/* Which FS_REGION_* a disk block is in */
+static int diskRegion(int block) {
+    if (block == SUPERBLOCK_INDEX)  return FS_REGION_SUPERBLOCK;
+    if (block < JOURNAL_START)      return FS_REGION_BITMAP;
+    if (block < INODE_TABLE_START)  return FS_REGION_JOURNAL;
+    if (block < DATA_BLOCK_START)   return FS_REGION_INODE_TABLE;
+    return FS_REGION_DATA;
+}
 
-    // data bitmap (all free)
-    memset(dataBitmap, 0, sizeof(dataBitmap));
-    Disk_Write(DATA_BITMAP_INDEX, (char *)dataBitmap);
+#define STAT_ADD(field, n) do { \
+        ThreadStats *t_ = threadStats != NULL ? threadStats : statsAttach(); \
+        if (t_ != NULL) statAdd(&t_->field, (n)); \
+    } while (0)
 
-    // inode table blocks (zeroed)
-    for (int i = 0; i < INODE_TABLE_BLOCKS; i++) {
-        memset(buf, 0, BLOCK_SIZE);
-        Disk_Write(INODE_TABLE_START + i, buf);
-    }
+/* Return an int call's result, timed as op */
+#define STAT_TIMED(op, call) do { \
+        uint64_t t0_ = statClock(); \
+        int rc_ = (call); \
+        statLatency((op), t0_); \
+        return rc_; \
+    } while (0)
 
-    // data blocks (zeroed)
-    for (int b = DATA_BLOCK_START; b < NUM_BLOCKS; b++) {
-        memset(buf, 0, BLOCK_SIZE);
-        Disk_Write(b, buf);
-    }
+#else
 
-    initOFT();
+#define STAT_ADD(field, n)   ((void)0)
+#define STAT_TIMED(op, call) return (call)
 
-    // save freshly created disk image
-    if (Disk_Save(path) < 0) {
-        return E_DISK_ERROR;
-    }
+#endif
 
-    return 0;
+/* Disk_Read / Disk_Write, counted by region */
+static int diskRead(int block, char *buf) {
+    STAT_ADD(diskReads[diskRegion(block)], 1);
+    return Disk_Read(block, buf);
 }
 
-/* Optional helper: sync current in-memory disk to file */
-int FS_Sync(void) {
-    if (g_disk_path[0] == '\0') {
-        return E_DISK_ERROR;
-    }
-    if (Disk_Save(g_disk_path) < 0) {
-        return E_DISK_ERROR;
-    }
-    return 0;
+static int diskWrite(int block, char *buf) {
+    STAT_ADD(diskWrites[diskRegion(block)], 1);
+    return Disk_Write(block, buf);
 }
 
 /* ------------------------- */
-/*        File_Create()      */
+/*        BLOCK CACHE        */
 /* ------------------------- */
 
-int File_Create(char *file) {
-    if (file == NULL || strlen(file) == 0) {
-        // Treat empty name as error (could pick another error if header defines one)
-        return E_FILE_EXISTS; // or some generic error
-    }
+static void journalRevoke(int block);
 
-    // check if file already exists
-    if (lookupFile(file) != -1) {
-        return E_FILE_EXISTS;
-    }
+/*
+ * The cache helpers below expect cacheMutex held (cacheLock) unless noted;
+ * a CacheEntry pointer is only valid until it is dropped.
+ */
 
-    int inodeIndex = allocateInode();
-    if (inodeIndex < 0) {
-        return E_NO_SPACE;
+/* Free the overflow entries' blocks and shrink the cache back to CACHE_BLOCKS entries */
+static void cacheDropOverflow(void) {
+    for (int i = CACHE_BLOCKS; i < cacheEntries; i++) {
+        free(cache[i].data);
+    }
+    cacheEntries = cacheEntries < CACHE_BLOCKS ? cacheEntries : CACHE_BLOCKS;
+    if (cacheHand >= cacheEntries) {
+        cacheHand = 0;
     }
+}
 
-    Inode ino;
-    memset(&ino, 0, sizeof(Inode));
-    strncpy(ino.filename, file, MAX_FILENAME_LENGTH - 1);
-    ino.filename[MAX_FILENAME_LENGTH - 1] = '\0';
-    ino.size = 0;
-    for (int i = 0; i < NUM_DIRECT_POINTERS; i++) {
-        ino.dataBlocks[i] = -1;
+/* Drop every cached block without writing anything back */
+static void cacheReset(void) {
+    pthread_once(&cacheMutexOnce, initCacheMutex);
+    cacheDropOverflow();
+    for (int i = 0; i < cacheEntries; i++) {
+        cache[i].block      = -1;
+        cache[i].dirty      = 0;
+        cache[i].referenced = 0;
+        cache[i].meta       = 0;
+        cache[i].pending    = 0;
+    }
+    for (int b = 0; b < FS_NUM_BLOCKS; b++) {
+        cacheSlot[b] = -1;
+    }
+    cacheHand = 0;
+    memset(&cacheStats, 0, sizeof(cacheStats));
+    for (int i = 0; i < GROUP_CACHE_SLOTS; i++) {
+        groupCache[i].block = -1;
+    }
+    for (int i = 0; i <= dedupMask; i++) {
+        dedupIndex[i].block = DEDUP_EMPTY;
+    }
+    for (int b = 0; b < FS_NUM_BLOCKS; b++) {
+        dedupSlot[b] = -1;
     }
+    __atomic_store_n(&dedupEntries, 0, __ATOMIC_RELAXED);
+}
 
-    writeInode(inodeIndex, &ino);
-    return 0;
+/* Write a dirty entry back to its disk block */
+static void cacheWriteBack(CacheEntry *e) {
+    if (e->block >= 0 && e->dirty) {
+        diskWrite(e->block, e->data);
+        e->dirty = 0;
+        cacheStats.writebacks++;
+    }
 }
 
-/* ------------------------- */
-/*        File_Open()        */
-/* ------------------------- */
+/*
+ * Add an overflow entry for when every entry holds pending metadata. A
+ * commit cannot run here (the caller is inside an operation) and pending
+ * blocks must not reach their home blocks before it, so the cache grows.
+ * Entries move, but their blocks do not.
+ */
+static CacheEntry *cacheGrow(void) {
+    CacheEntry *grown = realloc(cache, (size_t)(cacheEntries + 1) * sizeof(CacheEntry));
+    char *data = malloc(FS_BLOCK_SIZE);
+    if (grown == NULL || data == NULL) {
+        abort();  // no memory for the block, and nowhere safe to put it
+    }
+    cache = grown;
+    CacheEntry *e = &cache[cacheEntries++];
+    memset(e, 0, sizeof(*e));
+    e->block = -1;
+    e->data  = data;
+    return e;
+}
 
-int File_Open(char *file) {
-    int inodeIndex = lookupFile(file);
-    if (inodeIndex < 0) {
-        return E_NO_SUCH_FILE;
+/*
+ * Pick a slot with the CLOCK hand, writing back its old contents if dirty.
+ * Uncommitted metadata must not reach its home block, so pending entries
+ * are skipped; if nothing else is left the cache grows instead.
+ */
+static CacheEntry *cacheEvict(void) {
+    if (journalPending >= cacheEntries) {
+        return cacheGrow();
     }
+    for (;;) {
+        CacheEntry *e = &cache[cacheHand];
+        cacheHand = (cacheHand + 1) % cacheEntries;
 
-    // find a free OFT entry
-    for (int i = 0; i < OPEN_FILE_TABLE_SIZE; i++) {
-        if (!oft[i].used) {
-            oft[i].used        = 1;
-            oft[i].inodeIndex  = inodeIndex;
-            oft[i].filePointer = 0;
-            return i + FD_OFFSET;  // user-facing fd
+        if (e->block < 0) {
+            return e;
+        }
+        if (e->pending) {
+            continue;
+        }
+        if (e->referenced) {
+            e->referenced = 0;
+            continue;
         }
-    }
 
-    return E_TOO_MANY_OPEN_FILES;
+        cacheWriteBack(e);
+        cacheSlot[e->block] = -1;
+        e->block = -1;
+        cacheStats.evictions++;
+        return e;
+    }
 }
 
-/* ------------------------- */
-/*        File_Read()        */
-/* ------------------------- */
+/*
+ * Return the cache entry for a disk block. If load is 0 the caller is about
+ * to overwrite the whole block, so a miss does not read it from disk.
+ */
+static CacheEntry *cacheGet(int block, int load) {
+    int slot = cacheSlot[block];
+    if (slot >= 0) {
+        cacheStats.hits++;
+        cache[slot].referenced = 1;
+        return &cache[slot];
+    }
 
-int File_Read(int fd, void *buffer, int size) {
-    if (size < 0 || buffer == NULL) {
-        return 0;
+    cacheStats.misses++;
+    CacheEntry *e = cacheEvict();
+    if (load) {
+        diskRead(block, e->data);
     }
+    e->block      = block;
+    e->dirty      = 0;
+    e->referenced = 1;
+    e->meta       = 0;
+    e->pending    = 0;
+    cacheSlot[block] = (int)(e - cache);
+    return e;
+}
 
-    int idx = fdToIndex(fd);
-    if (idx < 0) {
-        return E_BAD_FD;
+/* Mark a cached metadata block changed: it joins the running transaction */
+static void cacheDirtyMeta(CacheEntry *e) {
+    if (!e->pending) {
+        e->pending = 1;
+        journalPending++;
     }
+    e->meta  = 1;
+    e->dirty = 1;
+}
 
-    OpenFile *of = &oft[idx];
-    Inode ino;
-    readInode(of->inodeIndex, &ino);
+/* Copy part of a block out of the cache (takes the lock itself) */
+static void cacheCopyOut(int block, int offset, void *buf, int len) {
+    cacheLock();
+    memcpy(buf, cacheGet(block, 1)->data + offset, len);
+    cacheUnlock();
+}
 
-    int fp = of->filePointer;
-    if (fp >= ino.size) {
-        return 0; // EOF
-    }
+/* Copy a whole block out of the cache (takes the lock itself) */
+static void cacheRead(int block, char *buf) {
+    cacheCopyOut(block, 0, buf, FS_BLOCK_SIZE);
+}
 
-    int bytesToRead = size;
-    if (fp + bytesToRead > ino.size) {
-        bytesToRead = ino.size - fp;
+/*
+ * Full-block transfers between the disk and a caller's buffer. A cached copy
+ * is used if there is one; otherwise the block moves straight between the
+ * disk and buf, without a bounce buffer and without filling the cache.
+ * Both take the lock themselves. An uncached read runs outside it: the
+ * caller's inode lock keeps writers of the block away, so reads of
+ * different blocks proceed in parallel.
+ */
+static void cacheReadDirect(int block, char *buf) {
+    cacheLock();
+    int slot = cacheSlot[block];
+    if (slot >= 0) {
+        cacheStats.hits++;
+        cache[slot].referenced = 1;
+        memcpy(buf, cache[slot].data, FS_BLOCK_SIZE);
+        cacheUnlock();
+        return;
     }
+    cacheStats.misses++;
+    cacheUnlock();
+    diskRead(block, buf);
+}
 
-    int copied = 0;
+static void cacheWriteDirect(int block, const char *buf) {
+    cacheLock();
+    int slot = cacheSlot[block];
+    if (slot >= 0) {
+        cacheStats.hits++;
+        cache[slot].referenced = 1;
+        memcpy(cache[slot].data, buf, FS_BLOCK_SIZE);
+        cache[slot].dirty = 1;
+    } else {
+        cacheStats.misses++;
+        diskWrite(block, (char *)buf);
+    }
+    cacheUnlock();
+}
 
-    while (copied < bytesToRead) {
-        int blockIndex = fp / BLOCK_SIZE;
-        if (blockIndex >= NUM_DIRECT_POINTERS) {
-            break; // beyond max file size
+/* Forget a block whose contents no longer matter (e.g. it was freed); takes the lock */
+static void cacheDiscard(int block) {
+    cacheLock();
+    int slot = cacheSlot[block];
+    if (slot >= 0) {
+        if (cache[slot].pending) {
+            journalPending--;
+        }
+        cache[slot].block   = -1;
+        cache[slot].dirty   = 0;
+        cache[slot].pending = 0;
+        cacheSlot[block]    = -1;
+    }
+    for (int i = 0; i < GROUP_CACHE_SLOTS; i++) {
+        if (groupCache[i].block == block) {
+            groupCache[i].block = -1;  // a compressed group's first block
         }
+    }
+    journalRevoke(block);
+    cacheUnlock();
+}
 
-        int diskBlock = ino.dataBlocks[blockIndex];
-        if (diskBlock < 0) {
-            break; // hole / not allocated
+/* Take block out of the dedup index. cacheMutex held */
+static void dedupRemove(int block) {
+    int slot = dedupSlot[block];
+    if (slot < 0) {
+        return;
+    }
+    dedupIndex[slot].block = DEDUP_REMOVED;
+    dedupSlot[block]       = -1;
+    __atomic_sub_fetch(&dedupEntries, 1, __ATOMIC_RELAXED);
+    // removed slots just before an empty one end no probe: empty them too
+    if (dedupIndex[(slot + 1) & dedupMask].block == DEDUP_EMPTY) {
+        while (dedupIndex[slot].block == DEDUP_REMOVED) {
+            dedupIndex[slot].block = DEDUP_EMPTY;
+            slot = (slot - 1) & dedupMask;
         }
+    }
+}
 
-        char blockBuf[BLOCK_SIZE];
-        Disk_Read(diskBlock, blockBuf);
+/* Take block out of the dedup index: its contents are about to change, or it is being freed */
+static void dedupForget(int block) {
+    cacheLock();
+    dedupRemove(block);
+    cacheUnlock();
+}
 
-        int blockOffset = fp % BLOCK_SIZE;
-        int chunk = BLOCK_SIZE - blockOffset;
-        if (chunk > (bytesToRead - copied)) {
-            chunk = bytesToRead - copied;
-        }
+/*
+ * Load a block into the cache ahead of use (takes the lock itself). It
+ * enters unreferenced, so CLOCK reclaims it first if the reader never
+ * comes. Counted as a read-ahead, not a miss.
+ */
+static void cachePrefetch(int block) {
+    cacheLock();
+    if (block >= 0 && block < FS_NUM_BLOCKS && cacheSlot[block] < 0) {
+        CacheEntry *e = cacheEvict();
+        diskRead(block, e->data);
+        e->block      = block;
+        e->dirty      = 0;
+        e->referenced = 0;
+        e->meta       = 0;
+        e->pending    = 0;
+        cacheSlot[block] = (int)(e - cache);
+        cacheStats.readaheads++;
+    }
+    cacheUnlock();
+}
 
-        memcpy((char *)buffer + copied, blockBuf + blockOffset, chunk);
+static int compareCacheBlock(const void *a, const void *b) {
+    return cache[*(const int *)a].block - cache[*(const int *)b].block;
+}
 
-        fp      += chunk;
-        copied  += chunk;
+/*
+ * After a commit nothing is pending: the overflow entries' blocks are
+ * written back (a metadata block as committed) and the cache shrinks back
+ * to CACHE_BLOCKS entries.
+ */
+static void cacheShrink(void) {
+    if (journalPending > 0) {
+        return;
+    }
+    for (int i = CACHE_BLOCKS; i < cacheEntries; i++) {
+        CacheEntry *e = &cache[i];
+        cacheWriteBack(e);
+        if (e->block >= 0) {
+            cacheSlot[e->block] = -1;
+        }
     }
+    cacheDropOverflow();
+}
 
-    of->filePointer = fp;
-    return copied;
+/*
+ * Write every dirty data block back to disk in ascending block order.
+ * Metadata reaches its home blocks only through the journal. Takes the lock.
+ */
+static void cacheFlushData(void) {
+    cacheLock();
+    int dirty[cacheEntries];
+    int n = 0;
+    for (int i = 0; i < cacheEntries; i++) {
+        if (cache[i].block >= 0 && cache[i].dirty && !cache[i].meta) {
+            dirty[n++] = i;
+        }
+    }
+    qsort(dirty, n, sizeof(int), compareCacheBlock);
+    for (int i = 0; i < n; i++) {
+        cacheWriteBack(&cache[dirty[i]]);
+    }
+    cacheUnlock();
 }
 
-/* ------------------------- */
-/*        File_Write()       */
-/* ------------------------- */
+/*
+ * Copy the region block of an in-memory bitmap (nWords words, stored from
+ * block start on) that holds word w into its cached copy, a word at a time.
+ * Only that block is touched, however large the bitmap.
+ */
+static void syncBitmapToCache(int start, const uint64_t *bitmap, int nWords, int w) {
+    int first = w - w % BITMAP_WORDS_PER_BLOCK;
+    int last  = first + BITMAP_WORDS_PER_BLOCK < nWords ? first + BITMAP_WORDS_PER_BLOCK : nWords;
 
-int File_Write(int fd, void *buffer, int size) {
-    if (size < 0 || buffer == NULL) {
-        return 0;
+    cacheLock();
+    CacheEntry *e = cacheGet(start + w / BITMAP_WORDS_PER_BLOCK, 0);
+    memset(e->data, 0, FS_BLOCK_SIZE);
+    for (int i = first; i < last; i++) {
+        uint64_t word = __atomic_load_n(&bitmap[i], __ATOMIC_ACQUIRE);
+        memcpy(e->data + (i - first) * sizeof(uint64_t), &word, sizeof(word));
     }
+    cacheDirtyMeta(e);
+    cacheUnlock();
+}
 
-    int idx = fdToIndex(fd);
-    if (idx < 0) {
-        return E_BAD_FD;
+/* Load an in-memory bitmap of nWords words from its region of blocks */
+static void loadBitmap(int start, uint64_t *bitmap, int nWords) {
+    char buf[FS_BLOCK_SIZE];
+    for (int w = 0; w < nWords; w += BITMAP_WORDS_PER_BLOCK) {
+        int n = nWords - w < BITMAP_WORDS_PER_BLOCK ? nWords - w : BITMAP_WORDS_PER_BLOCK;
+        diskRead(start + w / BITMAP_WORDS_PER_BLOCK, buf);
+        memcpy(bitmap + w, buf, n * sizeof(uint64_t));
     }
+}
 
-    OpenFile *of = &oft[idx];
-    Inode ino;
-    readInode(of->inodeIndex, &ino);
+/* The inode and data bitmap blocks holding word w */
+static void syncInodeBitmap(int w) {
+    syncBitmapToCache(INODE_BITMAP_START, inodeBitmap, BITMAP_WORDS(FS_NUM_INODES), w);
+}
 
-    int fp = of->filePointer;
-    int written = 0;
+static void syncDataBitmapWord(int w) {
+    syncBitmapToCache(DATA_BITMAP_START, dataBitmap, BITMAP_WORDS(FS_NUM_BLOCKS), w);
+}
 
-    while (written < size) {
-        int blockIndex = fp / BLOCK_SIZE;
-        if (blockIndex >= NUM_DIRECT_POINTERS) {
-            // would exceed maximum file size
-            return E_FILE_TOO_BIG;
-        }
+/* The reference count block holding block's count, copied into its cached copy */
+static void syncRefCount(int block) {
+    int first = block - block % FS_BLOCK_SIZE;
+    int n     = FS_NUM_BLOCKS - first < FS_BLOCK_SIZE ? FS_NUM_BLOCKS - first : FS_BLOCK_SIZE;
 
-        // allocate block if needed
-        if (ino.dataBlocks[blockIndex] < 0) {
-            int newBlock = allocateDataBlock();
-            if (newBlock < 0) {
-                return E_NO_SPACE;
-            }
+    cacheLock();
+    CacheEntry *e = cacheGet(REFCOUNT_START + block / FS_BLOCK_SIZE, 0);
+    memset(e->data, 0, FS_BLOCK_SIZE);
+    for (int i = 0; i < n; i++) {
+        e->data[i] = (char)__atomic_load_n(&blockRefs[first + i], __ATOMIC_RELAXED);
+    }
+    cacheDirtyMeta(e);
+    cacheUnlock();
+}
+
+static int bmap(OpenFile *of, const Inode *ino, int lblk);
+
+/* Compute the block and offset inside that block where a given inode lives */
+static void readInode(int inodeIndex, Inode *ino) {
+    int block   = readOnly ? bmap(NULL, &snapshotTable, inodeIndex / INODES_PER_BLOCK)
+                           : INODE_TABLE_START + (inodeIndex / INODES_PER_BLOCK);
+    int offset  = (inodeIndex % INODES_PER_BLOCK) * (int)sizeof(Inode);
+
+    cacheCopyOut(block, offset, ino, sizeof(Inode));
+}
+
+static void writeInode(int inodeIndex, const Inode *ino) {
+    int block   = INODE_TABLE_START + (inodeIndex / INODES_PER_BLOCK);
+    int offset  = (inodeIndex % INODES_PER_BLOCK) * (int)sizeof(Inode);
+
+    cacheLock();
+    CacheEntry *e = cacheGet(block, 1);
+    memcpy(e->data + offset, ino, sizeof(Inode));
+    cacheDirtyMeta(e);
+    cacheUnlock();
+}
+
+/* ------------------------- */
+/*     METADATA JOURNAL      */
+/* ------------------------- */
+
+static void flushOpenInodes(void);
+static void readAheadDrain(void);
+static void releaseHeldBlocks(void);
+
+/* FNV-1a over a descriptor and the copies it introduces */
+static unsigned int journalChecksum(unsigned int h, const char *data, int len) {
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void journalWriteHeader(void) {
+    char buf[FS_BLOCK_SIZE];
+    JournalRecord hdr = { JOURNAL_MAGIC, journalSeq, 0 };
+    memset(buf, 0, FS_BLOCK_SIZE);
+    memcpy(buf, &hdr, sizeof(hdr));
+    diskWrite(JOURNAL_START, buf);
+}
+
+static int journalFindFrozen(int block) {
+    for (int i = 0; i < journalNumFrozen; i++) {
+        if (journalFrozen[i].block == block) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Drop a block's frozen copy: the checkpoint will not write it home */
+static void journalForget(int block) {
+    int i = journalFindFrozen(block);
+    if (i < 0) {
+        return;
+    }
+    char *data = journalFrozen[i].data;  // the copies stay with their slots
+    journalFrozen[i] = journalFrozen[--journalNumFrozen];
+    journalFrozen[journalNumFrozen].data = data;
+}
+
+/*
+ * A freed block must not be replayed from transactions already in the
+ * journal: the next transaction carries a revoke for it. Until that commits
+ * the committed metadata still refers to the block, so a checkpoint in the
+ * meantime writes its frozen copy home as usual; the commit drops it.
+ */
+static void journalRevoke(int block) {
+    if (journalFindFrozen(block) < 0) {
+        return;
+    }
+    for (int i = 0; i < journalNumRevokes; i++) {
+        if (journalRevokes[i] == block) {
+            return;
+        }
+    }
+    journalRevokes[journalNumRevokes++] = block;
+}
+
+/*
+ * Write every committed metadata block to its home location and empty the
+ * journal. Cached copies that were not changed again are clean afterwards.
+ */
+static void journalCheckpoint(void) {
+    for (int i = 0; i < journalNumFrozen; i++) {
+        int block = journalFrozen[i].block;
+        diskWrite(block, journalFrozen[i].data);
+
+        int slot = cacheSlot[block];
+        if (slot >= 0 && !cache[slot].pending) {
+            cache[slot].dirty = 0;
+        }
+    }
+    journalNumFrozen  = 0;
+    journalNumRevokes = 0;
+    journalHead       = 1;
+    journalWriteHeader();
+}
+
+/* Descriptor blocks a transaction listing items block numbers (copies and revokes) takes */
+static int journalDescriptors(int items, int blockSize) {
+    int slots = JOURNAL_DESC_SLOTS(blockSize);
+    return items > slots ? (items + slots - 1) / slots : 1;
+}
+
+/*
+ * Append the group as one transaction at the head: n cache entries plus
+ * the pending revokes, listed by a chain of descriptors (each followed by
+ * the copies it lists) and closed by a single commit record. Room for all
+ * of it is made before the first block is written.
+ */
+static void journalAppend(const int *slots, int n) {
+    if (journalHead + journalDescriptors(n + journalNumRevokes, FS_BLOCK_SIZE) + n + 1 > JOURNAL_BLOCKS) {
+        journalCheckpoint();  // nothing frozen is left to revoke either
+    }
+    int items = n + journalNumRevokes;
+    if (journalHead + journalDescriptors(items, FS_BLOCK_SIZE) + n + 1 > JOURNAL_BLOCKS) {
+        // journalStart keeps a group within journalCopies, so this is a bug; never write past the region
+        readOnly = 1;
+        return;
+    }
+
+    char buf[FS_BLOCK_SIZE];
+    JournalDescriptor *d = (JournalDescriptor *)buf;
+    unsigned int sum = 2166136261u;
+    int at = journalHead, i = 0;
+    do {
+        int take = items - i < JOURNAL_DESC_SLOTS(FS_BLOCK_SIZE) ? items - i : JOURNAL_DESC_SLOTS(FS_BLOCK_SIZE);
+        memset(buf, 0, FS_BLOCK_SIZE);
+        d->magic       = JOURNAL_DESC_MAGIC;
+        d->seq         = journalSeq;
+        d->count       = i < n ? (n - i < take ? n - i : take) : 0;
+        d->revokeCount = take - d->count;
+        for (int k = 0; k < take; k++) {
+            d->blocks[k] = i + k < n ? cache[slots[i + k]].block : journalRevokes[i + k - n];
+        }
+        sum = journalChecksum(sum, buf, FS_BLOCK_SIZE);
+        diskWrite(JOURNAL_START + at, buf);
+        for (int k = 0; k < d->count; k++) {
+            CacheEntry *e = &cache[slots[i + k]];
+            sum = journalChecksum(sum, e->data, FS_BLOCK_SIZE);
+            diskWrite(JOURNAL_START + at + 1 + k, e->data);
+        }
+        at += 1 + d->count;
+        i  += take;
+    } while (i < items);
+
+    JournalRecord commit = { JOURNAL_COMMIT_MAGIC, journalSeq, sum };
+    memset(buf, 0, FS_BLOCK_SIZE);
+    memcpy(buf, &commit, sizeof(commit));
+    diskWrite(JOURNAL_START + at, buf);
+
+    // the transaction is durable: its revoked blocks are gone, its copies kept for the checkpoint
+    for (int r = 0; r < journalNumRevokes; r++) {
+        journalForget(journalRevokes[r]);
+    }
+    for (int k = 0; k < n; k++) {
+        CacheEntry *e = &cache[slots[k]];
+        int f = journalFindFrozen(e->block);
+        if (f < 0) {
+            f = journalNumFrozen++;
+            journalFrozen[f].block = e->block;
+        }
+        memcpy(journalFrozen[f].data, e->data, FS_BLOCK_SIZE);
+        e->pending = 0;
+        journalPending--;
+    }
+    journalNumRevokes = 0;
+    journalHead = at + 1;
+    journalSeq++;
+}
+
+/* Bring the free-space and sharing counters in the cached superblock up to date; cacheMutex held */
+static void superblockSyncCounts(void) {
+    CacheEntry *e = cacheGet(SUPERBLOCK_INDEX, 1);
+    Superblock sb;
+    memcpy(&sb, e->data, sizeof(sb));
+    int inodes = __atomic_load_n(&freeInodeCount, __ATOMIC_RELAXED);
+    int blocks = __atomic_load_n(&freeBlockCount, __ATOMIC_RELAXED);
+    int shared = __atomic_load_n(&sharedRefs, __ATOMIC_RELAXED);
+    if (sb.freeInodes != inodes || sb.freeBlocks != blocks || sb.sharedRefs != shared) {
+        sb.freeInodes = inodes;
+        sb.freeBlocks = blocks;
+        sb.sharedRefs = shared;
+        memcpy(e->data, &sb, sizeof(sb));
+        cacheDirtyMeta(e);
+    }
+}
+
+/*
+ * Group commit: write the metadata changed by every operation since the
+ * last commit to the journal in one sequential run, as one transaction
+ * (journalStart keeps the group within what that can carry). Data blocks
+ * are flushed first, so committed metadata never points at blocks that were
+ * not written. Blocks freed since the last commit are free on disk once it
+ * is done, and reusable from then on. journalCommitLocked is the same with
+ * journalTxLock already held for write.
+ */
+static void journalCommitLocked(void) {
+    flushOpenInodes();
+
+    cacheLock();
+    journalOps = 0;
+    if (journalPending > 0) {
+        superblockSyncCounts();
+    }
+
+    int slots[cacheEntries];
+    int n = 0;
+    for (int i = 0; i < cacheEntries; i++) {
+        if (cache[i].block >= 0 && cache[i].pending) {
+            slots[n++] = i;
+        }
+    }
+    if (n > 0 || journalNumRevokes > 0) {
+        qsort(slots, n, sizeof(int), compareCacheBlock);
+        cacheFlushData();
+        journalAppend(slots, n);
+    }
+    cacheShrink();
+    cacheUnlock();
+    releaseHeldBlocks();
+}
+
+static void journalCommit(void) {
+    pthread_rwlock_wrlock(&journalTxLock);
+    journalCommitLocked();
+    pthread_rwlock_unlock(&journalTxLock);
+}
+
+/*
+ * Start of a metadata-changing operation: it joins the running transaction
+ * if that has room left for whatever it and the operations still running
+ * may change, JOURNAL_OP_BLOCKS each besides the blocks in front of the
+ * journal (counted whole, as the budget). Otherwise the transaction is
+ * committed first.
+ */
+static void journalStart(void) {
+    for (;;) {
+        pthread_rwlock_rdlock(&journalTxLock);
+        cacheLock();
+        int room = journalPending + (journalActive + 1) * JOURNAL_OP_BLOCKS <= journalCopies - JOURNAL_START ||
+                   readOnly;
+        journalActive += room;
+        cacheUnlock();
+        if (room) {
+            return;
+        }
+        pthread_rwlock_unlock(&journalTxLock);
+        journalCommit();
+    }
+}
+
+/* End of one: commit once enough operations have piled up */
+static void journalStop(void) {
+    pthread_rwlock_unlock(&journalTxLock);
+
+    cacheLock();
+    journalActive--;
+    if (batchDepth == 0) {
+        journalOps++;  // a batch is counted once, when it ends
+    }
+    int full = journalOps >= JOURNAL_GROUP_OPS || journalPending >= JOURNAL_TX_BLOCKS;
+    cacheUnlock();
+    if (full) {
+        journalCommit();
+    }
+}
+
+/*
+ * Between the pieces of a long operation on ip: stop and start again, so
+ * that a commit can run in between. Inode write lock held, and so again on
+ * return; the pieces done so far reach the inode table with that commit.
+ */
+static void journalRestart(InCoreInode *ip) {
+    ip->dirty = 1;
+    pthread_rwlock_unlock(&ip->lock);
+    journalStop();
+    journalStart();
+    pthread_rwlock_wrlock(&ip->lock);
+}
+
+/* Where the piece of a long operation that starts at byte fp ends, if before end */
+static int journalPieceEnd(int fp, int end) {
+    long long piece = (long long)JOURNAL_PIECE_BLOCKS * FS_BLOCK_SIZE;
+    long long next  = (fp / piece + 1) * piece;
+    return next < end ? (int)next : end;
+}
+
+/*
+ * Length in blocks of the transaction seq at offset off of the region if it
+ * is complete - its descriptors, their copies and the commit record all
+ * there, the checksum right - or -1.
+ */
+static int journalReadTx(int off, int seq) {
+    char buf[FS_BLOCK_SIZE];
+    JournalDescriptor *d = (JournalDescriptor *)buf;
+    unsigned int sum = 2166136261u;
+    int at = off;
+    for (;;) {
+        if (at >= JOURNAL_BLOCKS) {
+            return -1;
+        }
+        diskRead(JOURNAL_START + at, buf);
+        if (d->magic != JOURNAL_DESC_MAGIC || d->seq != seq) {
+            break;  // the commit record, if the transaction is complete
+        }
+        int count = d->count;
+        if (count < 0 || d->revokeCount < 0 || count + d->revokeCount > JOURNAL_DESC_SLOTS(FS_BLOCK_SIZE) ||
+            at + 1 + count >= JOURNAL_BLOCKS) {
+            return -1;
+        }
+        sum = journalChecksum(sum, buf, FS_BLOCK_SIZE);
+        for (int i = 0; i < count; i++) {
+            diskRead(JOURNAL_START + at + 1 + i, buf);
+            sum = journalChecksum(sum, buf, FS_BLOCK_SIZE);
+        }
+        at += 1 + count;
+    }
+    JournalRecord commit;
+    memcpy(&commit, buf, sizeof(commit));
+    if (at == off || commit.magic != JOURNAL_COMMIT_MAGIC || commit.seq != seq || commit.checksum != sum) {
+        return -1;
+    }
+    return at + 1 - off;
+}
+
+/*
+ * Mount-time redo: replay every complete transaction in the journal, in
+ * order, except blocks a later transaction revoked. A torn final
+ * transaction fails its checksum and is ignored. The journal is empty after.
+ */
+static void journalRecover(void) {
+    int *revokedAt = calloc(FS_NUM_BLOCKS, sizeof(int));
+    char buf[FS_BLOCK_SIZE];
+    char desc[FS_BLOCK_SIZE];
+    JournalDescriptor *d = (JournalDescriptor *)desc;
+    JournalRecord hdr;
+
+    journalNumFrozen  = 0;
+    journalNumRevokes = 0;
+    journalPending    = 0;
+    journalOps        = 0;
+    journalHead       = 1;
+
+    diskRead(JOURNAL_START, buf);
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (hdr.magic != JOURNAL_MAGIC || revokedAt == NULL) {
+        journalSeq = 1;
+        journalWriteHeader();
+        free(revokedAt);
+        return;
+    }
+
+    // pass 1: find the committed transactions and the last revoke of each block
+    int seq = hdr.seq, off = 1, len;
+    while (off < JOURNAL_BLOCKS && (len = journalReadTx(off, seq)) > 0) {
+        for (int at = off; at < off + len - 1; at += 1 + d->count) {
+            diskRead(JOURNAL_START + at, desc);
+            for (int i = 0; i < d->revokeCount; i++) {
+                int b = d->blocks[d->count + i];
+                if (b >= 0 && b < FS_NUM_BLOCKS) {
+                    revokedAt[b] = seq;
+                }
+            }
+        }
+        off += len;
+        seq++;
+    }
+    int end = off;
+
+    // pass 2: replay, descriptor by descriptor up to each commit record
+    seq = hdr.seq;
+    for (off = 1; off < end; off++, seq++) {
+        for (diskRead(JOURNAL_START + off, desc); d->magic == JOURNAL_DESC_MAGIC;
+             off += 1 + d->count, diskRead(JOURNAL_START + off, desc)) {
+            for (int i = 0; i < d->count; i++) {
+                int b = d->blocks[i];
+                if (b < 0 || b >= FS_NUM_BLOCKS || revokedAt[b] > seq) {
+                    continue;
+                }
+                diskRead(JOURNAL_START + off + 1 + i, buf);
+                diskWrite(b, buf);
+            }
+        }
+    }
+
+    journalSeq = seq;
+    journalWriteHeader();
+    free(revokedAt);
+}
+
+/* ------------------------- */
+/*      PACKED BITMAPS       */
+/* ------------------------- */
+
+static int bitmapTest(const uint64_t *map, int bit) {
+    return (int)((__atomic_load_n(&map[bit / 64], __ATOMIC_RELAXED) >> (bit % 64)) & 1);
+}
+
+/* Bits of word w that stand for entries in [lo, hi) */
+static uint64_t bitmapWordMask(int w, int lo, int hi) {
+    int first = w * 64, last = first + 64;
+    if (lo > first) first = lo;
+    if (hi < last)  last  = hi;
+    if (first >= last) return 0;
+    int n = last - first;
+    uint64_t ones = n == 64 ? ~(uint64_t)0 : ((uint64_t)1 << n) - 1;
+    return ones << (first % 64);
+}
+
+/* Clear bits of map in [lo, hi) */
+static int bitmapCountFree(const uint64_t *map, int lo, int hi) {
+    int n = 0;
+    for (int w = lo / 64; w * 64 < hi; w++) {
+        n += __builtin_popcountll(~map[w] & bitmapWordMask(w, lo, hi));
+    }
+    return n;
+}
+
+/*
+ * Claim up to batch free bits of word w (lowest first) with a single
+ * compare-and-swap; valid masks out bits past the ends. Returns the bits
+ * claimed, 0 if the word has none free.
+ */
+static uint64_t bitmapClaim(uint64_t *map, int w, uint64_t valid, int batch) {
+    uint64_t old = __atomic_load_n(&map[w], __ATOMIC_RELAXED);
+    for (;;) {
+        uint64_t freeBits = ~old & valid;
+        uint64_t take = 0;
+        for (int i = 0; i < batch && freeBits; i++) {
+            take     |= freeBits & -freeBits;
+            freeBits &= freeBits - 1;
+        }
+        if (take == 0) {
+            return 0;
+        }
+        if (__atomic_compare_exchange_n(&map[w], &old, old | take, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return take;
+        }
+    }
+}
+
+/* Claim from the first word at or after *hint (wrapping) with free bits; stores the word */
+static uint64_t bitmapClaimNext(uint64_t *map, int *hint, int lo, int hi, int batch, int *word) {
+    int loWord = lo / 64, nWords = BITMAP_WORDS(hi) - loWord;
+    int start = __atomic_load_n(hint, __ATOMIC_RELAXED);
+    if (start < loWord || start >= loWord + nWords) start = loWord;
+
+    for (int k = 0; k < nWords; k++) {
+        int w = loWord + (start - loWord + k) % nWords;
+        uint64_t got = bitmapClaim(map, w, bitmapWordMask(w, lo, hi), batch);
+        if (got) {
+            __atomic_store_n(hint, w + 1, __ATOMIC_RELAXED);
+            *word = w;
+            return got;
+        }
+    }
+    return 0;
+}
+
+/* ------------------------- */
+/*      IN-CORE INODES       */
+/* ------------------------- */
+
+/* Pin the shared in-core inode of inodeIndex, loading it on first open */
+static InCoreInode *inodeGet(int inodeIndex) {
+    pthread_mutex_lock(&openInodesMutex);
+    InCoreInode *ip = openInodes[inodeIndex];
+    if (ip == NULL) {
+        ip = malloc(sizeof(InCoreInode));
+        if (ip == NULL) {
+            pthread_mutex_unlock(&openInodesMutex);
+            return NULL;
+        }
+        ip->inodeIndex = inodeIndex;
+        ip->openCount  = 0;
+        ip->dirty      = 0;
+        ip->writtenLo  = INT_MAX;
+        ip->writtenHi  = -1;
+        pthread_rwlock_init(&ip->lock, NULL);
+        readInode(inodeIndex, &ip->ino);
+        openInodes[inodeIndex] = ip;
+    }
+    ip->openCount++;
+    pthread_mutex_unlock(&openInodesMutex);
+    return ip;
+}
+
+/* Write a dirty in-core inode back to the inode table (via the block cache) */
+static void inodeFlush(InCoreInode *ip) {
+    if (ip->dirty) {
+        writeInode(ip->inodeIndex, &ip->ino);
+        ip->dirty = 0;
+    }
+}
+
+/* Flush and unpin; the last fd to let go frees the in-core copy */
+static void inodePut(InCoreInode *ip) {
+    pthread_mutex_lock(&openInodesMutex);
+    pthread_rwlock_wrlock(&ip->lock);
+    inodeFlush(ip);
+    pthread_rwlock_unlock(&ip->lock);
+    if (--ip->openCount == 0) {
+        openInodes[ip->inodeIndex] = NULL;
+        pthread_rwlock_destroy(&ip->lock);
+        free(ip);
+    }
+    pthread_mutex_unlock(&openInodesMutex);
+}
+
+/*
+ * Flush every open file's in-core inode. Only a commit calls this: it holds
+ * journalTxLock exclusively, so no writer is changing an in-core inode.
+ */
+static void flushOpenInodes(void) {
+    pthread_mutex_lock(&openInodesMutex);
+    for (int i = 0; i < FS_NUM_INODES; i++) {
+        if (openInodes[i] != NULL) {
+            inodeFlush(openInodes[i]);
+        }
+    }
+    pthread_mutex_unlock(&openInodesMutex);
+}
+
+/*
+ * Read both bitmaps in on first use after a mount, and the reference counts
+ * if any block is shared. Until then nothing can have changed them, so their
+ * disk blocks are current.
+ */
+static void bitmapsEnsure(void) {
+    if (__atomic_load_n(&bitmapsLoaded, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    pthread_mutex_lock(&bitmapLoadMutex);
+    if (!bitmapsLoaded) {
+        loadBitmap(INODE_BITMAP_START, inodeBitmap, BITMAP_WORDS(FS_NUM_INODES));
+        loadBitmap(DATA_BITMAP_START, dataBitmap, BITMAP_WORDS(FS_NUM_BLOCKS));
+        memcpy(inodeClaimed, inodeBitmap, BITMAP_WORDS(FS_NUM_INODES) * sizeof(uint64_t));
+        memcpy(dataClaimed, dataBitmap, BITMAP_WORDS(FS_NUM_BLOCKS) * sizeof(uint64_t));
+        int shared = 0;
+        for (int b = 0; (sharedRefs > 0 || snapshotCount > 0) && b < FS_NUM_BLOCKS; b += FS_BLOCK_SIZE) {
+            char buf[FS_BLOCK_SIZE];
+            diskRead(REFCOUNT_START + b / FS_BLOCK_SIZE, buf);
+            memcpy(blockRefs + b, buf, FS_NUM_BLOCKS - b < FS_BLOCK_SIZE ? FS_NUM_BLOCKS - b : FS_BLOCK_SIZE);
+            for (int i = b; i < FS_NUM_BLOCKS && i < b + FS_BLOCK_SIZE; i++) shared += blockRefs[i];
+        }
+        __atomic_store_n(&sharedRefs, shared, __ATOMIC_RELAXED);
+        // recount rather than trust the superblock: a crash may have left it a commit behind
+        __atomic_store_n(&freeInodeCount, bitmapCountFree(inodeBitmap, 0, FS_NUM_INODES), __ATOMIC_RELAXED);
+        __atomic_store_n(&freeBlockCount, bitmapCountFree(dataBitmap, DATA_BLOCK_START, FS_NUM_BLOCKS), __ATOMIC_RELAXED);
+        __atomic_store_n(&bitmapsLoaded, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&bitmapLoadMutex);
+}
+
+/* Start allocating from freshly loaded bitmaps; every pool reserved before is void */
+static void resetAllocator(void) {
+    inodeAllocHint = 0;
+    dataAllocHint  = DATA_BLOCK_START / 64;
+    __atomic_add_fetch(&poolBootEpoch, 1, __ATOMIC_RELEASE);
+}
+
+/* Drop (keep = 0) or hand back whatever a pool has reserved */
+static void poolReturn(AllocPool *p, int keep) {
+    if (keep && p->blockMask) {
+        __atomic_and_fetch(&dataClaimed[p->blockWord], ~p->blockMask, __ATOMIC_RELEASE);
+    }
+    if (keep && p->inodeMask) {
+        __atomic_and_fetch(&inodeClaimed[p->inodeWord], ~p->inodeMask, __ATOMIC_RELEASE);
+    }
+    p->blockMask = 0;
+    p->inodeMask = 0;
+}
+
+/* pthread key destructor: a thread's reservations go back when it exits */
+static void poolThreadExit(void *arg) {
+    AllocPool *p = arg;
+    if (p->boot == __atomic_load_n(&poolBootEpoch, __ATOMIC_ACQUIRE)) {
+        poolReturn(p, 1);
+    }
+}
+
+static void initPoolKey(void) {
+    pthread_key_create(&poolKey, poolThreadExit);
+}
+
+/*
+ * The calling thread's pool. Reservations from before the last FS_Boot
+ * refer to old bitmaps and are dropped; after an FS_Sync (or another
+ * thread running dry) they are handed back before anything new is taken.
+ */
+static AllocPool *poolSelf(void) {
+    AllocPool *p = &threadPool;
+    if (!p->registered) {
+        pthread_once(&poolKeyOnce, initPoolKey);
+        pthread_setspecific(poolKey, p);
+        p->registered = 1;
+    }
+    unsigned int boot  = __atomic_load_n(&poolBootEpoch, __ATOMIC_ACQUIRE);
+    unsigned int epoch = __atomic_load_n(&poolEpoch, __ATOMIC_ACQUIRE);
+    if (p->boot != boot) {
+        poolReturn(p, 0);
+        p->nFreed = 0;
+        p->boot   = boot;
+        p->epoch  = epoch;
+    } else if (p->epoch != epoch) {
+        poolReturn(p, 1);
+        p->epoch = epoch;
+    }
+    return p;
+}
+
+/* Ask every thread to hand back its unused reservations at its next allocation */
+static void poolRecall(void) {
+    __atomic_add_fetch(&poolEpoch, 1, __ATOMIC_RELEASE);
+}
+
+/* Allocate a free inode from the thread's pool, refilling it from the bitmap */
+static int allocateInode(void) {
+    bitmapsEnsure();
+    if (__atomic_load_n(&freeInodeCount, __ATOMIC_RELAXED) == 0) {
+        return -1;  // full: no need to look
+    }
+    AllocPool *p = poolSelf();
+    if (p->inodeMask == 0) {
+        p->inodeMask = bitmapClaimNext(inodeClaimed, &inodeAllocHint, 0, FS_NUM_INODES,
+                                       INODE_POOL_BATCH, &p->inodeWord);
+        if (p->inodeMask == 0) {
+            poolRecall();
+            return -1;  // no free inode (other threads may still hold a few)
+        }
+    }
+    int bit = __builtin_ctzll(p->inodeMask);
+    p->inodeMask &= p->inodeMask - 1;
+
+    int i = p->inodeWord * 64 + bit;
+    __atomic_or_fetch(&inodeBitmap[p->inodeWord], (uint64_t)1 << bit, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&freeInodeCount, 1, __ATOMIC_RELAXED);
+    syncInodeBitmap(p->inodeWord);
+    return i;
+}
+
+/* Free an inode in the bitmap */
+static void freeInode(int inodeIndex) {
+    if (inodeIndex < 0 || inodeIndex >= FS_NUM_INODES) return;
+    bitmapsEnsure();
+    uint64_t bit = (uint64_t)1 << (inodeIndex % 64);
+    if (__atomic_fetch_and(&inodeBitmap[inodeIndex / 64], ~bit, __ATOMIC_RELEASE) & bit) {
+        __atomic_add_fetch(&freeInodeCount, 1, __ATOMIC_RELAXED);
+    }
+    syncInodeBitmap(inodeIndex / 64);
+    __atomic_and_fetch(&inodeClaimed[inodeIndex / 64], ~bit, __ATOMIC_RELEASE);
+}
+
+/*
+ * Reserve a run of up to want contiguous data blocks, from the calling
+ * thread's pool. The pool is one word of the data bitmap claimed with a
+ * single atomic operation, so a run never crosses a 64-block boundary. A
+ * free goal block (typically just past the file's last block) is used first
+ * so appends stay adjacent: the pool switches to the goal's word if it can.
+ * Returns the first block and stores the run length in *got, or -1 if full.
+ */
+static int allocateDataExtent(int goal, int want, int *got) {
+    bitmapsEnsure();
+    if (__atomic_load_n(&freeBlockCount, __ATOMIC_RELAXED) == 0) {
+        return -1;  // full: no need to look
+    }
+    AllocPool *p = poolSelf();
+    int start = -1;
+
+    if (goal >= DATA_BLOCK_START && goal < FS_NUM_BLOCKS) {
+        int w = goal / 64;
+        uint64_t bit = (uint64_t)1 << (goal % 64);
+        if (!(p->blockWord == w && (p->blockMask & bit)) && !bitmapTest(dataClaimed, goal)) {
+            poolReturn(p, 1);
+            p->blockMask = bitmapClaim(dataClaimed, w, bitmapWordMask(w, DATA_BLOCK_START, FS_NUM_BLOCKS), 64);
+            p->blockWord = w;
+        }
+        if (p->blockWord == w && (p->blockMask & bit)) {
+            start = goal;
+        }
+    }
+    if (start < 0) {
+        if (p->blockMask == 0) {
+            p->blockMask = bitmapClaimNext(dataClaimed, &dataAllocHint, DATA_BLOCK_START, FS_NUM_BLOCKS,
+                                           64, &p->blockWord);
+            if (p->blockMask == 0) {
+                poolRecall();
+                return -1;  // no free space (other threads may still hold some)
+            }
+        }
+        start = p->blockWord * 64 + __builtin_ctzll(p->blockMask);
+    }
+
+    // take the run of reserved blocks from start
+    int off = start % 64, len = 0;
+    uint64_t run = 0;
+    while (len < want && off + len < 64 && (p->blockMask >> (off + len) & 1)) {
+        run |= (uint64_t)1 << (off + len);
+        len++;
+    }
+    p->blockMask &= ~run;
+    __atomic_or_fetch(&dataBitmap[p->blockWord], run, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&freeBlockCount, len, __ATOMIC_RELAXED);
+    syncDataBitmapWord(p->blockWord);
+
+    *got = len;
+    return start;
+}
+
+static int compareInt(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * Clear the batched frees in the bitmap, one atomic operation per word,
+ * and write each data bitmap block they touched to its cached copy. The
+ * blocks stay claimed, held for the next commit (dataHeld).
+ */
+static void flushFreedBlocks(AllocPool *p) {
+    qsort(p->freed, p->nFreed, sizeof(int), compareInt);
+    for (int i = 0; i < p->nFreed; ) {
+        int w = p->freed[i] / 64;
+        uint64_t mask = 0;
+        for (; i < p->nFreed && p->freed[i] / 64 == w; i++) {
+            mask |= (uint64_t)1 << (p->freed[i] % 64);
+        }
+        uint64_t was = __atomic_fetch_and(&dataBitmap[w], ~mask, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&freeBlockCount, __builtin_popcountll(was & mask), __ATOMIC_RELAXED);
+        uint64_t held = __atomic_fetch_or(&dataHeld[w], was & mask, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&dataHeldCount, __builtin_popcountll(was & mask & ~held), __ATOMIC_RELAXED);
+        // the batch's last word in this bitmap block: write the block out
+        if (i == p->nFreed || p->freed[i] / 64 / BITMAP_WORDS_PER_BLOCK != w / BITMAP_WORDS_PER_BLOCK) {
+            syncDataBitmapWord(w);
+        }
+    }
+    p->nFreed = 0;
+}
+
+/*
+ * Reference counts: dropped by an inode that has the block (under its lock
+ * and cacheMutex), taken by a deduplicated write (under cacheMutex) or by
+ * FS_Snapshot / FS_SnapshotDelete (with the journal locked). refAdd is -1
+ * if the count is at its limit.
+ */
+static int refAdd(int block) {
+    if (__atomic_load_n(&blockRefs[block], __ATOMIC_RELAXED) == UCHAR_MAX) {
+        return -1;
+    }
+    __atomic_add_fetch(&blockRefs[block], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sharedRefs, 1, __ATOMIC_RELAXED);
+    syncRefCount(block);
+    return 0;
+}
+
+/* Drop one extra reference to block; 0 if it had none, so dropping it frees it */
+static int refDrop(int block) {
+    if (__atomic_load_n(&blockRefs[block], __ATOMIC_RELAXED) == 0) {
+        return 0;
+    }
+    __atomic_sub_fetch(&blockRefs[block], 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&sharedRefs, 1, __ATOMIC_RELAXED);
+    syncRefCount(block);
+    return 1;
+}
+
+/* Queue a data block to be freed; it is not reusable before the commit after the next syncDataBitmap */
+static void releaseDataBlock(int blockIndex) {
+    if (blockIndex < DATA_BLOCK_START || blockIndex >= FS_NUM_BLOCKS) return;  // also block 0 of a compressed group
+    bitmapsEnsure();
+    // out of the dedup index first, so no new reference can be taken while it goes
+    cacheLock();
+    dedupForget(blockIndex);
+    int shared = refDrop(blockIndex);
+    cacheUnlock();
+    if (shared) {
+        return;  // a snapshot or another file still has it: only the reference goes
+    }
+    AllocPool *p = poolSelf();
+    if (p->nFreed == POOL_FREE_BATCH) {
+        flushFreedBlocks(p);
+    }
+    p->freed[p->nFreed++] = blockIndex;
+    cacheDiscard(blockIndex);
+}
+
+/* Apply a batch of releaseDataBlock calls and write the data bitmap blocks they changed */
+static void syncDataBitmap(void) {
+    flushFreedBlocks(poolSelf());
+}
+
+/* After a commit: the blocks it freed can be handed out again; journalTxLock held for write */
+static void releaseHeldBlocks(void) {
+    if (__atomic_load_n(&dataHeldCount, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+    for (int w = 0; w < BITMAP_WORDS(FS_NUM_BLOCKS); w++) {
+        if (dataHeld[w]) {
+            __atomic_and_fetch(&dataClaimed[w], ~dataHeld[w], __ATOMIC_RELEASE);
+            dataHeld[w] = 0;
+        }
+    }
+    __atomic_store_n(&dataHeldCount, 0, __ATOMIC_RELAXED);
+}
+
+/* Free a run of data blocks with a single bitmap update */
+static void freeDataRun(int start, int len) {
+    for (int i = 0; i < len; i++) {
+        releaseDataBlock(start + i);
+    }
+    syncDataBitmap();
+}
+
+/* ------------------------- */
+/*      BLOCK MAPPING        */
+/* ------------------------- */
+
+/*
+ * Inline data: a small file's bytes are kept in the inode, over the block
+ * pointers (INLINE_DATA_SIZE bytes). It costs no data block and no bitmap
+ * update, and reading it is just the inode read. The file moves to real
+ * blocks (inlineSpill) the first time it outgrows the space.
+ */
+#define INLINE_DATA_SIZE ((int)(sizeof(Inode) - offsetof(Inode, dataBlocks)))
+
+static char *inlineData(const Inode *ino) {
+    return (char *)ino->dataBlocks;
+}
+
+/*
+ * Read entry index of pointer block. When an fd is given, its cached copy of
+ * the last indirect block it touched is used (and refilled on a miss), so
+ * sequential I/O does not copy the same pointer block for every chunk.
+ */
+static int readPointer(OpenFile *of, int block, int index) {
+    if (of == NULL) {
+        int ptr;
+        cacheCopyOut(block, index * (int)sizeof(int), &ptr, sizeof(int));
+        return ptr;
+    }
+    unsigned int gen = __atomic_load_n(&indirectGeneration, __ATOMIC_ACQUIRE);
+    if (of->indBlock != block || of->indGen != gen) {
+        cacheRead(block, (char *)of->indPtrs);
+        of->indBlock = block;
+        of->indGen   = gen;
+    }
+    return of->indPtrs[index];
+}
+
+/* Store entry index of pointer block, keeping the writer's fd cache current */
+static void writePointer(OpenFile *of, int block, int index, int ptr) {
+    cacheLock();
+    CacheEntry *e = cacheGet(block, 1);
+    memcpy(e->data + index * (int)sizeof(int), &ptr, sizeof(int));
+    cacheDirtyMeta(e);
+    cacheUnlock();
+
+    unsigned int gen = __atomic_add_fetch(&indirectGeneration, 1, __ATOMIC_RELEASE);
+    if (of != NULL && of->indBlock == block) {
+        of->indPtrs[index] = ptr;
+        of->indGen = gen;
+    }
+}
+
+/* Allocate a pointer block with every entry set to -1 (unmapped) */
+static int allocatePointerBlock(void) {
+    int got = 0;
+    int block = allocateDataExtent(-1, 1, &got);
+    if (block < 0) {
+        return -1;
+    }
+    cacheLock();
+    CacheEntry *e = cacheGet(block, 0);
+    memset(e->data, 0xFF, FS_BLOCK_SIZE);
+    cacheDirtyMeta(e);
+    cacheUnlock();
+    __atomic_add_fetch(&indirectGeneration, 1, __ATOMIC_RELEASE);
+    return block;
+}
+
+/* Map file block lblk to its disk block; -1 if unallocated */
+static int bmap(OpenFile *of, const Inode *ino, int lblk) {
+    if (lblk < NUM_DIRECT_POINTERS) {
+        return ino->dataBlocks[lblk];
+    }
+    lblk -= NUM_DIRECT_POINTERS;
+
+    if (lblk < PTRS_PER_BLOCK) {
+        if (ino->indirectBlock < 0) return -1;
+        return readPointer(of, ino->indirectBlock, lblk);
+    }
+    lblk -= PTRS_PER_BLOCK;
+
+    if (lblk >= PTRS_PER_BLOCK * PTRS_PER_BLOCK || ino->doubleIndirectBlock < 0) {
+        return -1;
+    }
+    int ind = readPointer(NULL, ino->doubleIndirectBlock, lblk / PTRS_PER_BLOCK);
+    if (ind < 0) return -1;
+    return readPointer(of, ind, lblk % PTRS_PER_BLOCK);
+}
+
+/* Point file block lblk at disk block pblk, allocating pointer blocks as needed */
+static int bmapSet(OpenFile *of, Inode *ino, int lblk, int pblk) {
+    if (lblk < NUM_DIRECT_POINTERS) {
+        ino->dataBlocks[lblk] = pblk;
+        return 0;
+    }
+    lblk -= NUM_DIRECT_POINTERS;
+
+    if (lblk < PTRS_PER_BLOCK) {
+        if (ino->indirectBlock < 0) {
+            if ((ino->indirectBlock = allocatePointerBlock()) < 0) return E_NO_SPACE;
+        }
+        writePointer(of, ino->indirectBlock, lblk, pblk);
+        return 0;
+    }
+    lblk -= PTRS_PER_BLOCK;
+
+    if (ino->doubleIndirectBlock < 0) {
+        if ((ino->doubleIndirectBlock = allocatePointerBlock()) < 0) return E_NO_SPACE;
+    }
+    int ind = readPointer(NULL, ino->doubleIndirectBlock, lblk / PTRS_PER_BLOCK);
+    if (ind < 0) {
+        if ((ind = allocatePointerBlock()) < 0) return E_NO_SPACE;
+        writePointer(NULL, ino->doubleIndirectBlock, lblk / PTRS_PER_BLOCK, ind);
+    }
+    writePointer(of, ind, lblk % PTRS_PER_BLOCK, pblk);
+    return 0;
+}
+
+/* Release every block of a pointer block at the given depth (1 = indirect) */
+static void releasePointerBlock(int block, int depth) {
+    int ptrs[PTRS_PER_BLOCK];
+    cacheRead(block, (char *)ptrs);
+    for (int i = 0; i < PTRS_PER_BLOCK; i++) {
+        if (ptrs[i] < 0) continue;
+        if (depth > 1) {
+            releasePointerBlock(ptrs[i], depth - 1);
+        } else {
+            releaseDataBlock(PTR_BLOCK(ptrs[i]));
+        }
+    }
+    releaseDataBlock(block);
+}
+
+/* Free every data and pointer block an inode owns */
+static void freeInodeBlocks(Inode *ino) {
+    if (ino->flags & INODE_INLINE) {
+        return;  // nothing outside the inode
+    }
+    for (int i = 0; i < NUM_DIRECT_POINTERS; i++) {
+        if (ino->dataBlocks[i] >= 0) {
+            releaseDataBlock(PTR_BLOCK(ino->dataBlocks[i]));
+        }
+        ino->dataBlocks[i] = -1;
+    }
+    if (ino->indirectBlock >= 0) {
+        releasePointerBlock(ino->indirectBlock, 1);
+        ino->indirectBlock = -1;
+    }
+    if (ino->doubleIndirectBlock >= 0) {
+        releasePointerBlock(ino->doubleIndirectBlock, 2);
+        ino->doubleIndirectBlock = -1;
+    }
+    __atomic_add_fetch(&indirectGeneration, 1, __ATOMIC_RELEASE);
+    syncDataBitmap();
+}
+
+/*
+ * Give every unallocated block in [first, last] of an inode a data block,
+ * reserving contiguous runs (continuing from the block before each gap when
+ * possible). New pointers carry flags (0 or PTR_UNWRITTEN). The runs reserved
+ * here are returned in *runs when runs is non-NULL (malloc'd, caller frees).
+ * All-or-nothing: on E_NO_SPACE every data block reserved here is released
+ * again; pointer blocks already hooked into the inode are kept.
+ */
+static int reserveBlocks(OpenFile *of, Inode *ino, int first, int last, int flags,
+                         Extent **runs, int *nRuns) {
+    Extent *list = NULL;
+    int n = 0, cap = 0;
+
+    int lblk = first;
+    while (lblk <= last) {
+        if (bmap(of, ino, lblk) >= 0) {
+            lblk++;
+            continue;
+        }
+
+        // length of this gap
+        int want = 1;
+        while (lblk + want <= last && bmap(of, ino, lblk + want) < 0) want++;
+
+        int prev  = lblk > 0 ? bmap(of, ino, lblk - 1) : -1;
+        int got   = 0;
+        int start = allocateDataExtent(prev >= 0 ? PTR_BLOCK(prev) + 1 : -1, want, &got);
+        if (start < 0) goto fail;
+
+        if (n == cap) {
+            cap = cap ? cap * 2 : 4;
+            Extent *grown = realloc(list, cap * sizeof(Extent));
+            if (grown == NULL) {
+                freeDataRun(start, got);
+                goto fail;
+            }
+            list = grown;
+        }
+        list[n].lblk = lblk;
+        list[n].pblk = start;
+        list[n].len  = 0;
+        n++;
+
+        for (int k = 0; k < got; k++) {
+            if (bmapSet(of, ino, lblk + k, (start + k) | flags) < 0) {
+                freeDataRun(start + k, got - k);
+                goto fail;
+            }
+            list[n - 1].len++;
+        }
+        lblk += got;
+    }
+
+    if (runs != NULL) {
+        *runs  = list;
+        *nRuns = n;
+    } else {
+        free(list);
+    }
+    return 0;
+
+fail:
+    for (int r = 0; r < n; r++) {
+        for (int k = 0; k < list[r].len; k++) {
+            bmapSet(of, ino, list[r].lblk + k, -1);
+        }
+        freeDataRun(list[r].pblk, list[r].len);
+    }
+    free(list);
+    return E_NO_SPACE;
+}
+
+/* ------------------------- */
+/*         DIRECTORY         */
+/* ------------------------- */
+
+/*
+ * A directory is a file of DirEntry records that never cross a block
+ * boundary. A new entry takes the slack after the first entry with room
+ * (splitting it off); removing one folds it into the entry before it.
+ *
+ * A directory starts out as a single linear block. When that fills, it
+ * becomes indexed (htree-style): block 0 turns into the index root and the
+ * entries move to leaf blocks partitioned by name hash, so a lookup is a
+ * binary search per index level plus one leaf scan. A full leaf is split at
+ * its median hash into a new leaf, and its index block gets an entry for
+ * it; a full index block is split in half the same way, up the path. A full
+ * root moves its entries down into a new interior block and the index gets
+ * a level deeper, so a directory grows until blocks or inodes run out.
+ * Leaves and index blocks are not merged when they empty out.
+ *
+ * Directory blocks are metadata and go through the journal like the inode
+ * table. Changes are made with nameLock held for writing.
+ */
+
+/* FNV-1a hash of a name of len bytes */
+static unsigned int hashName(const char *name, int len) {
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static DirEntry *dirEntryAt(char *block, int off) {
+    return (DirEntry *)(block + off);
+}
+
+/* Next entry's offset, or FS_BLOCK_SIZE once past the last one (or a damaged length) */
+static int dirNext(char *block, int off) {
+    int len = dirEntryAt(block, off)->recLen;
+    return len < DIRENT_SIZE(0) || off + len > FS_BLOCK_SIZE ? FS_BLOCK_SIZE : off + len;
+}
+
+static void dirFill(DirEntry *d, int inodeIndex, int type, const char *name, int len) {
+    d->inode   = inodeIndex;
+    d->nameLen = (unsigned char)len;
+    d->type    = (unsigned char)type;
+    memcpy(d->name, name, len);
+}
+
+/* An empty leaf: one unused entry spanning the block */
+static void dirLeafInit(char *block) {
+    memset(block, 0, FS_BLOCK_SIZE);
+    dirEntryAt(block, 0)->inode  = -1;
+    dirEntryAt(block, 0)->recLen = FS_BLOCK_SIZE;
+}
+
+/* Put an entry into a leaf block's slack; -1 if no gap is big enough */
+static int dirLeafInsert(char *block, int inodeIndex, int type, const char *name, int len) {
+    int need = DIRENT_SIZE(len);
+    for (int off = 0; off < FS_BLOCK_SIZE; off = dirNext(block, off)) {
+        DirEntry *d = dirEntryAt(block, off);
+        int used = d->inode >= 0 ? DIRENT_SIZE(d->nameLen) : 0;
+        if (d->recLen - used < need) {
+            continue;
+        }
+        if (used > 0) {
+            // split the slack off the live entry
+            DirEntry *fresh = dirEntryAt(block, off + used);
+            fresh->recLen = (unsigned short)(d->recLen - used);
+            d->recLen     = (unsigned short)used;
+            d = fresh;
+        }
+        dirFill(d, inodeIndex, type, name, len);
+        return 0;
+    }
+    return -1;
+}
+
+/* Offset of name's entry in a leaf block, -1 if absent; *prev gets the one before it (-1 = first) */
+static int dirLeafFind(char *block, const char *name, int len, int *prev) {
+    int last = -1;
+    for (int off = 0; off < FS_BLOCK_SIZE; off = dirNext(block, off)) {
+        DirEntry *d = dirEntryAt(block, off);
+        STAT_ADD(lookupEntries, 1);
+        if (d->inode >= 0 && d->nameLen == len && memcmp(d->name, name, len) == 0) {
+            if (prev != NULL) *prev = last;
+            return off;
+        }
+        last = off;
+    }
+    return -1;
+}
+
+/* Replace a directory block's contents (metadata, journaled) */
+static void dirWriteBlock(int pblk, const char *buf) {
+    cacheLock();
+    CacheEntry *e = cacheGet(pblk, 0);
+    memcpy(e->data, buf, FS_BLOCK_SIZE);
+    cacheDirtyMeta(e);
+    cacheUnlock();
+}
+
+/* Grow a directory by one block, allocated next to its last one; returns it, -1 if out of space */
+static int dirAppendBlock(int dirIndex, Inode *dir) {
+    int nblk = dir->size / FS_BLOCK_SIZE;
+    int goal = nblk > 0 ? bmap(NULL, dir, nblk - 1) + 1 : -1;
+    int got  = 0;
+    int pblk = allocateDataExtent(goal, 1, &got);
+    if (pblk < 0) {
+        return -1;
+    }
+    if (bmapSet(NULL, dir, nblk, pblk) < 0) {
+        freeDataRun(pblk, 1);
+        return -1;
+    }
+    dir->size += FS_BLOCK_SIZE;
+    writeInode(dirIndex, dir);
+    return pblk;
+}
+
+/*
+ * Leaf block that holds (or would hold) names hashing to h. path[] gets the
+ * index blocks walked from the root down and *depth how many there are.
+ */
+static int dirLeafFor(const Inode *dir, unsigned int h, DirIndexPos *path, int *depth) {
+    int lblk = 0, d = 0, levels;
+    cacheLock();
+    do {
+        DirIndexNode *node = (DirIndexNode *)cacheGet(bmap(NULL, dir, lblk), 1)->data;
+        int lo = 0, hi = node->count - 1;
+        while (lo < hi) {
+            int mid = (lo + hi + 1) / 2;
+            if (node->entries[mid].hash <= h) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        path[d].lblk = lblk;
+        path[d].slot = lo;
+        d++;
+        lblk   = node->entries[lo].lblk;
+        levels = node->levels;
+    } while (levels > 0 && d < DIR_INDEX_LEVELS);
+    cacheUnlock();
+    *depth = d;
+    return lblk;
+}
+
+/* Blocks a lookup of hash h must scan: its leaf if indexed, else every block */
+static void dirScanRange(const Inode *dir, unsigned int h, int *first, int *last) {
+    DirIndexPos path[DIR_INDEX_LEVELS];
+    int depth;
+    if (dir->flags & INODE_INDEXED) {
+        *first = *last = dirLeafFor(dir, h, path, &depth);
+    } else {
+        *first = 0;
+        *last  = dir->size / FS_BLOCK_SIZE - 1;
+    }
+}
+
+/* Look name up in a directory on disk; its inode (type in *type) or -1 */
+static int dirFind(const Inode *dir, const char *name, int *type) {
+    int len = (int)strlen(name);
+    int first, last;
+    dirScanRange(dir, hashName(name, len), &first, &last);
+    STAT_ADD(lookups, 1);
+
+    for (int lblk = first; lblk <= last; lblk++) {
+        cacheLock();
+        CacheEntry *e = cacheGet(bmap(NULL, dir, lblk), 1);
+        int off = dirLeafFind(e->data, name, len, NULL);
+        if (off >= 0) {
+            DirEntry *d = dirEntryAt(e->data, off);
+            int inodeIndex = d->inode;
+            *type = d->type;
+            cacheUnlock();
+            return inodeIndex;
+        }
+        cacheUnlock();
+    }
+    return -1;
+}
+
+/* Try to add an entry to directory block lblk; -1 if it has no room */
+static int dirInsertInto(const Inode *dir, int lblk, int inodeIndex, int type, const char *name, int len) {
+    cacheLock();
+    CacheEntry *e = cacheGet(bmap(NULL, dir, lblk), 1);
+    int rc = dirLeafInsert(e->data, inodeIndex, type, name, len);
+    if (rc == 0) {
+        cacheDirtyMeta(e);
+    }
+    cacheUnlock();
+    return rc;
+}
+
+/* Turn a full linear directory into an indexed one: its block moves to leaf 1 */
+static int dirMakeIndexed(int dirIndex, Inode *dir) {
+    char buf[FS_BLOCK_SIZE];
+    cacheRead(bmap(NULL, dir, 0), buf);
+    int pblk = dirAppendBlock(dirIndex, dir);
+    if (pblk < 0) {
+        return E_NO_SPACE;
+    }
+    dirWriteBlock(pblk, buf);
+
+    memset(buf, 0, FS_BLOCK_SIZE);
+    DirIndexNode *root = (DirIndexNode *)buf;
+    root->magic           = DIR_INDEX_MAGIC;
+    root->count           = 1;
+    root->levels          = 0;
+    root->entries[0].hash = 0;
+    root->entries[0].lblk = 1;
+    dirWriteBlock(bmap(NULL, dir, 0), buf);
+
+    dir->flags |= INODE_INDEXED;
+    writeInode(dirIndex, dir);
+    return 0;
+}
+
+/* Live entries of a leaf, sorted by hash when splitting it */
+typedef struct {
+    unsigned int hash;
+    int          off;
+} DirSortEntry;
+
+static int compareDirSort(const void *a, const void *b) {
+    unsigned int x = ((const DirSortEntry *)a)->hash, y = ((const DirSortEntry *)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+/* Pack entries ent[from..to) of leaf src into out */
+static void dirLeafPack(char *out, char *src, const DirSortEntry *ent, int from, int to) {
+    dirLeafInit(out);
+    int off = 0;
+    for (int i = from; i < to; i++) {
+        DirEntry *s = dirEntryAt(src, ent[i].off);
+        DirEntry *d = dirEntryAt(out, off);
+        int size = DIRENT_SIZE(s->nameLen);
+        dirFill(d, s->inode, s->type, s->name, s->nameLen);
+        d->recLen = (unsigned short)(i == to - 1 ? FS_BLOCK_SIZE - off : size);
+        off += size;
+    }
+}
+
+/* Insert child entry e after the entry at slot of an index block */
+static void dirIndexInsertAt(DirIndexNode *node, int slot, DirIndexEntry e) {
+    memmove(&node->entries[slot + 2], &node->entries[slot + 1],
+            (node->count - slot - 1) * sizeof(DirIndexEntry));
+    node->entries[slot + 1] = e;
+    node->count++;
+}
+
+/*
+ * Add child entry e after path[level] in the index, splitting full index
+ * blocks on the way up. spare[] holds directory blocks appended beforehand,
+ * one per index block this can split or push down (see dirSplitLeaf).
+ */
+static void dirIndexAdd(Inode *dir, DirIndexPos *path, int depth, int level, DirIndexEntry e, const int *spare) {
+    char buf[FS_BLOCK_SIZE];
+    cacheRead(bmap(NULL, dir, path[level].lblk), buf);
+    DirIndexNode *node = (DirIndexNode *)buf;
+    int slot = path[level].slot;
+    if (node->count < DIR_INDEX_MAX) {
+        dirIndexInsertAt(node, slot, e);
+        dirWriteBlock(bmap(NULL, dir, path[level].lblk), buf);
+        return;
+    }
+
+    if (level == 0) {
+        // a full root: its entries move down into a new block, one level deeper
+        char rootBuf[FS_BLOCK_SIZE];
+        DirIndexNode *root = (DirIndexNode *)rootBuf;
+        memset(rootBuf, 0, FS_BLOCK_SIZE);
+        root->magic           = DIR_INDEX_MAGIC;
+        root->count           = 1;
+        root->levels          = (unsigned short)(node->levels + 1);
+        root->entries[0].hash = 0;
+        root->entries[0].lblk = *spare;
+        node->magic = DIR_NODE_MAGIC;
+        dirWriteBlock(bmap(NULL, dir, *spare), buf);
+        dirWriteBlock(bmap(NULL, dir, 0), rootBuf);
+
+        memmove(path + 1, path, depth * sizeof(DirIndexPos));
+        path[0].lblk = 0;
+        path[0].slot = 0;
+        path[1].lblk = *spare;
+        dirIndexAdd(dir, path, depth + 1, 1, e, spare + 1);
+        return;
+    }
+
+    // split in half: the upper half moves to a new block, which the parent gets an entry for
+    char upperBuf[FS_BLOCK_SIZE];
+    DirIndexNode *upper = (DirIndexNode *)upperBuf;
+    int k = node->count / 2;
+    memset(upperBuf, 0, FS_BLOCK_SIZE);
+    upper->magic  = DIR_NODE_MAGIC;
+    upper->levels = node->levels;
+    upper->count  = (unsigned short)(node->count - k);
+    memcpy(upper->entries, node->entries + k, upper->count * sizeof(DirIndexEntry));
+    node->count = (unsigned short)k;
+    if (slot < k) {
+        dirIndexInsertAt(node, slot, e);
+    } else {
+        dirIndexInsertAt(upper, slot - k, e);
+    }
+    dirWriteBlock(bmap(NULL, dir, path[level].lblk), buf);
+    dirWriteBlock(bmap(NULL, dir, *spare), upperBuf);
+
+    DirIndexEntry up = { upper->entries[0].hash, *spare };
+    dirIndexAdd(dir, path, depth, level - 1, up, spare + 1);
+}
+
+/*
+ * Split leaf lblk (reached through path) at its median hash into a new
+ * leaf. Every block the index needs for it is appended first, so nothing
+ * changes unless the whole split can be made.
+ */
+static int dirSplitLeaf(int dirIndex, Inode *dir, int lblk, DirIndexPos *path, int depth) {
+    char leaf[FS_BLOCK_SIZE], lower[FS_BLOCK_SIZE], upper[FS_BLOCK_SIZE];
+    DirSortEntry ent[FS_BLOCK_SIZE / DIRENT_SIZE(1)];
+
+    cacheRead(bmap(NULL, dir, lblk), leaf);
+    int n = 0;
+    for (int off = 0; off < FS_BLOCK_SIZE; off = dirNext(leaf, off)) {
+        DirEntry *d = dirEntryAt(leaf, off);
+        if (d->inode >= 0) {
+            ent[n].hash = hashName(d->name, d->nameLen);
+            ent[n].off  = off;
+            n++;
+        }
+    }
+    qsort(ent, n, sizeof(DirSortEntry), compareDirSort);
+
+    // split near the middle, never between two equal hashes
+    int k = n / 2;
+    while (k > 0 && k < n && ent[k].hash == ent[k - 1].hash) k++;
+    if (k >= n) {
+        for (k = n / 2; k > 0 && ent[k].hash == ent[k - 1].hash; k--) {}
+    }
+    if (k == 0) {
+        return E_NO_SPACE;
+    }
+
+    // the new leaf, plus a block for each full index block up the path (and the root's push-down)
+    int need = 1;
+    for (int level = depth - 1; level >= 0; level--) {
+        DirIndexNode node;
+        cacheCopyOut(bmap(NULL, dir, path[level].lblk), 0, &node, sizeof(node));
+        if (node.count < DIR_INDEX_MAX) {
+            break;
+        }
+        need += level == 0 ? 2 : 1;
+    }
+    if (need > 1 + depth && depth == DIR_INDEX_LEVELS) {
+        return E_NO_SPACE;  // the index is as deep as it goes
+    }
+    int spare[2 * DIR_INDEX_LEVELS + 1];
+    for (int i = 0; i < need; i++) {
+        int pblk = dirAppendBlock(dirIndex, dir);
+        if (pblk < 0) {
+            return E_NO_SPACE;  // the blocks appended so far stay, as empty leaves
+        }
+        dirLeafInit(lower);
+        dirWriteBlock(pblk, lower);
+        spare[i] = dir->size / FS_BLOCK_SIZE - 1;
+    }
+
+    dirLeafPack(lower, leaf, ent, 0, k);
+    dirLeafPack(upper, leaf, ent, k, n);
+    dirWriteBlock(bmap(NULL, dir, lblk), lower);
+    dirWriteBlock(bmap(NULL, dir, spare[0]), upper);
+
+    DirIndexEntry e = { ent[k].hash, spare[0] };
+    dirIndexAdd(dir, path, depth, depth - 1, e, spare + 1);
+    return 0;
+}
+
+/* Add name -> inodeIndex to a directory; E_NO_SPACE if it cannot grow */
+static int dirInsert(int dirIndex, Inode *dir, int inodeIndex, int type, const char *name) {
+    int len = (int)strlen(name);
+
+    if (!(dir->flags & INODE_INDEXED)) {
+        if (dir->size == 0) {
+            char buf[FS_BLOCK_SIZE];
+            int pblk = dirAppendBlock(dirIndex, dir);
+            if (pblk < 0) {
+                return E_NO_SPACE;
+            }
+            dirLeafInit(buf);
+            dirWriteBlock(pblk, buf);
+        }
+        if (dirInsertInto(dir, 0, inodeIndex, type, name, len) == 0) {
+            return 0;
+        }
+        if (dirMakeIndexed(dirIndex, dir) < 0) {
+            return E_NO_SPACE;
+        }
+    }
+
+    // split the target leaf until the entry fits
+    unsigned int h = hashName(name, len);
+    for (;;) {
+        DirIndexPos path[DIR_INDEX_LEVELS + 1];
+        int depth;
+        int lblk = dirLeafFor(dir, h, path, &depth);
+        if (dirInsertInto(dir, lblk, inodeIndex, type, name, len) == 0) {
+            return 0;
+        }
+        if (dirSplitLeaf(dirIndex, dir, lblk, path, depth) < 0) {
+            return E_NO_SPACE;
+        }
+    }
+}
+
+/* Drop name's entry from a directory */
+static void dirRemove(const Inode *dir, const char *name) {
+    int len = (int)strlen(name);
+    int first, last;
+    dirScanRange(dir, hashName(name, len), &first, &last);
+
+    for (int lblk = first; lblk <= last; lblk++) {
+        cacheLock();
+        CacheEntry *e = cacheGet(bmap(NULL, dir, lblk), 1);
+        int prev = -1;
+        int off  = dirLeafFind(e->data, name, len, &prev);
+        if (off >= 0) {
+            DirEntry *d = dirEntryAt(e->data, off);
+            if (prev >= 0) {
+                DirEntry *p = dirEntryAt(e->data, prev);
+                p->recLen = (unsigned short)(p->recLen + d->recLen);
+            } else {
+                d->inode = -1;  // first entry of the block: keep it as free space
+            }
+            cacheDirtyMeta(e);
+            cacheUnlock();
+            return;
+        }
+        cacheUnlock();
+    }
+}
+
+/* 1 if a directory has no entries left */
+static int dirIsEmpty(const Inode *dir) {
+    char buf[FS_BLOCK_SIZE];
+    int first = dir->flags & INODE_INDEXED ? 1 : 0;
+    for (int lblk = first; lblk < dir->size / FS_BLOCK_SIZE; lblk++) {
+        cacheRead(bmap(NULL, dir, lblk), buf);
+        if (((DirIndexNode *)buf)->magic == DIR_NODE_MAGIC) {
+            continue;  // an interior index block
+        }
+        for (int off = 0; off < FS_BLOCK_SIZE; off = dirNext(buf, off)) {
+            if (dirEntryAt(buf, off)->inode >= 0) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* An empty directory inode: no blocks until its first entry */
+static void initDirInode(Inode *dir) {
+    memset(dir, 0, sizeof(Inode));
+    dir->flags = INODE_DIR;
+    for (int i = 0; i < NUM_DIRECT_POINTERS; i++) {
+        dir->dataBlocks[i] = -1;
+    }
+    dir->indirectBlock       = -1;
+    dir->doubleIndirectBlock = -1;
+}
+
+/* ------------------------- */
+/*   DENTRY CACHE / PATHS    */
+/* ------------------------- */
+
+static Dentry *dcacheSet(int dir, unsigned int h) {
+    return dcache[(h ^ (unsigned int)dir * 2654435761u) & (DCACHE_SETS - 1)];
+}
+
+static void dcacheReset(void) {
+    pthread_mutex_lock(&dcacheMutex);
+    for (int s = 0; s < DCACHE_SETS; s++) {
+        for (int w = 0; w < DCACHE_WAYS; w++) {
+            dcache[s][w].inode = -1;
+        }
+    }
+    pthread_mutex_unlock(&dcacheMutex);
+}
+
+/* The way holding (dir, name), or NULL; dcacheMutex held */
+static Dentry *dcacheFind(Dentry *set, int dir, const char *name, unsigned int h) {
+    for (int w = 0; w < DCACHE_WAYS; w++) {
+        Dentry *d = &set[w];
+        if (d->inode >= 0 && d->dir == dir && d->hash == h && strcmp(d->name, name) == 0) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+/* Remember (dir, name) -> inodeIndex, replacing the set's least recently used way */
+static void dcacheInsert(int dir, const char *name, int inodeIndex, int type) {
+    unsigned int h = hashName(name, (int)strlen(name));
+    Dentry *set = dcacheSet(dir, h);
+
+    pthread_mutex_lock(&dcacheMutex);
+    Dentry *victim = dcacheFind(set, dir, name, h);
+    for (int w = 0; victim == NULL && w < DCACHE_WAYS; w++) {
+        if (set[w].inode < 0) victim = &set[w];
+    }
+    if (victim == NULL) {
+        victim = &set[0];
+        for (int w = 1; w < DCACHE_WAYS; w++) {
+            if (set[w].stamp < victim->stamp) victim = &set[w];
+        }
+    }
+    victim->dir   = dir;
+    victim->inode = inodeIndex;
+    victim->type  = type;
+    victim->hash  = h;
+    victim->stamp = ++dcacheClock;
+    strncpy(victim->name, name, MAX_FILENAME_LENGTH - 1);
+    victim->name[MAX_FILENAME_LENGTH - 1] = '\0';
+    pthread_mutex_unlock(&dcacheMutex);
+}
+
+static void dcacheRemove(int dir, const char *name) {
+    unsigned int h = hashName(name, (int)strlen(name));
+    pthread_mutex_lock(&dcacheMutex);
+    Dentry *d = dcacheFind(dcacheSet(dir, h), dir, name, h);
+    if (d != NULL) {
+        d->inode = -1;
+    }
+    pthread_mutex_unlock(&dcacheMutex);
+}
+
+/* Resolve name in directory dir through the dentry cache; its inode or -1 */
+static int dirLookup(int dir, const char *name, int *type) {
+    unsigned int h = hashName(name, (int)strlen(name));
+
+    pthread_mutex_lock(&dcacheMutex);
+    Dentry *d = dcacheFind(dcacheSet(dir, h), dir, name, h);
+    if (d != NULL) {
+        int inodeIndex = d->inode;
+        *type    = d->type;
+        d->stamp = ++dcacheClock;
+        pthread_mutex_unlock(&dcacheMutex);
+        STAT_ADD(dcacheHits, 1);
+        return inodeIndex;
+    }
+    pthread_mutex_unlock(&dcacheMutex);
+    STAT_ADD(dcacheMisses, 1);
+
+    Inode dirIno;
+    readInode(dir, &dirIno);
+    int inodeIndex = dirFind(&dirIno, name, type);
+    if (inodeIndex >= 0) {
+        dcacheInsert(dir, name, inodeIndex, *type);
+    }
+    return inodeIndex;
+}
+
+/*
+ * Walk path down to the directory holding its last component: *dir gets
+ * that directory's inode number and leaf the component (cut to
+ * MAX_FILENAME_LENGTH - 1 bytes; empty for the root itself). Components are
+ * separated by '/'; leading and repeated slashes are ignored. nameLock held.
+ */
+static int pathWalk(const char *path, int *dir, char *leaf) {
+    int cur = ROOT_INODE;
+    leaf[0] = '\0';
+
+    for (const char *p = path; ; ) {
+        while (*p == '/') p++;
+        if (*p == '\0') break;
+        const char *end = p;
+        while (*end != '\0' && *end != '/') end++;
+
+        if (leaf[0] != '\0') {
+            // the previous component is a directory on the way
+            int type = 0;
+            int child = dirLookup(cur, leaf, &type);
+            if (child < 0) {
+                return E_NO_SUCH_FILE;
+            }
+            if (type != DIRENT_DIR) {
+                return E_NOT_A_DIRECTORY;
+            }
+            cur = child;
+        }
+        int len = (int)(end - p) < MAX_FILENAME_LENGTH - 1 ? (int)(end - p) : MAX_FILENAME_LENGTH - 1;
+        memcpy(leaf, p, len);
+        leaf[len] = '\0';
+        p = end;
+    }
+    *dir = cur;
+    return 0;
+}
+
+/* Convert user-facing fd to its Open File Table entry; NULL if not open */
+static OpenFile *fdToFile(int fd) {
+    int idx = fd - FD_OFFSET;
+    if (idx < 0 || idx >= __atomic_load_n(&oftCapacity, __ATOMIC_ACQUIRE)) return NULL;
+    OpenFile *of = oftEntry(idx);
+    if (!__atomic_load_n(&of->used, __ATOMIC_ACQUIRE)) return NULL;
+    return of;
+}
+
+/* fdToFile, returning the entry locked; NULL if not open (or closed while waiting) */
+static OpenFile *fdLock(int fd) {
+    OpenFile *of = fdToFile(fd);
+    if (of == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&of->lock);
+    if (!of->used) {
+        pthread_mutex_unlock(&of->lock);
+        return NULL;
+    }
+    return of;
+}
+
+static void fdUnlock(OpenFile *of) {
+    pthread_mutex_unlock(&of->lock);
+}
+
+/* ------------------------- */
+/*         GEOMETRY          */
+/* ------------------------- */
+
+/* Most copies one transaction can carry in an empty journal of journalBlocks blocks */
+static int journalCapacity(int journalBlocks, int blockSize) {
+    int copies = journalBlocks - 3;  // header, a descriptor, the commit record
+    while (copies > 0 && 2 + journalDescriptors(copies, blockSize) + copies > journalBlocks) {
+        copies--;
+    }
+    return copies;
+}
+
+/*
+ * Journal blocks for a file system whose blocks in front of the journal
+ * number front: a group commit may change all of those, plus
+ * JOURNAL_OP_BLOCKS for each operation in it. Larger disks let more
+ * operations share a commit, up to JOURNAL_GROUP_OPS.
+ */
+static int journalSize(int front, int numBlocks, int blockSize) {
+    int ops = numBlocks / 1024;
+    ops = ops < 2 ? 2 : ops > JOURNAL_GROUP_OPS ? JOURNAL_GROUP_OPS : ops;
+    int copies = front + ops * JOURNAL_OP_BLOCKS;
+    int blocks = 2 + journalDescriptors(copies, blockSize) + copies;
+    return blocks > JOURNAL_MIN_BLOCKS ? blocks : JOURNAL_MIN_BLOCKS;
+}
+
+/*
+ * Lay out a new file system of numBlocks blocks of blockSize bytes with
+ * numInodes inodes: each region follows the one before, the bitmaps as
+ * many blocks as their bits take. -1 if that geometry cannot hold one.
+ */
+static int layoutChoose(Superblock *sb, int blockSize, int numBlocks, int numInodes) {
+    if (blockSize < MIN_BLOCK_SIZE || blockSize > MAX_BLOCK_SIZE || (blockSize & (blockSize - 1)) != 0 ||
+        numBlocks <= 0 || numBlocks >= PTR_COMPRESSED || numInodes <= ROOT_INODE || numInodes >= PTR_UNWRITTEN) {
+        return -1;
+    }
+#ifdef TINYFS_BLOCK_SIZE
+    if (blockSize != TINYFS_BLOCK_SIZE) {
+        return -1;
+    }
+#endif
+    int bitsPerBlock = blockSize * 8;
+    int inodesPerBlock = blockSize / (int)sizeof(Inode);
+
+    memset(sb, 0, sizeof(*sb));
+    sb->magic             = MAGIC_NUMBER;
+    sb->blockSize         = blockSize;
+    sb->numBlocks         = numBlocks;
+    sb->numInodes         = numInodes;
+    sb->inodeBitmapStart  = SUPERBLOCK_INDEX + 1;
+    sb->inodeBitmapBlocks = (numInodes - 1) / bitsPerBlock + 1;
+    sb->dataBitmapStart   = sb->inodeBitmapStart + sb->inodeBitmapBlocks;
+    sb->dataBitmapBlocks  = (numBlocks - 1) / bitsPerBlock + 1;
+    sb->refCountStart     = sb->dataBitmapStart + sb->dataBitmapBlocks;
+    sb->refCountBlocks    = (numBlocks - 1) / blockSize + 1;
+    sb->journalStart      = sb->refCountStart + sb->refCountBlocks;
+    sb->journalBlocks     = journalSize(sb->journalStart, numBlocks, blockSize);
+    sb->inodeTableStart   = sb->journalStart + sb->journalBlocks;
+    sb->inodeTableBlocks  = (numInodes - 1) / inodesPerBlock + 1;
+    if ((long long)sb->inodeTableStart + sb->inodeTableBlocks >= numBlocks) {
+        return -1;  // no room left for data
+    }
+    sb->dataStart         = sb->inodeTableStart + sb->inodeTableBlocks;
+    sb->freeInodes        = numInodes - 1;  // all but the root directory
+    sb->freeBlocks        = numBlocks - sb->dataStart;
+    return 0;
+}
+
+/* Region [start, start + len) follows *next and has at least need blocks; advances *next */
+static int layoutRegion(int start, int len, int need, long long *next) {
+    if (start < *next || len < need) {
+        return -1;
+    }
+    *next = (long long)start + len;
+    return 0;
+}
+
+/*
+ * Mount-time layout: check that a superblock's regions are in order, hold
+ * what its geometry needs and fit on the disk, then set the geometry and
+ * layout variables and size every table that depends on them. -1 (nothing
+ * changed) if the superblock is not usable.
+ */
+static int layoutMount(const Superblock *sb) {
+    Superblock fresh;
+    if (sb->magic != MAGIC_NUMBER || layoutChoose(&fresh, sb->blockSize, sb->numBlocks, sb->numInodes) < 0) {
+        return -1;
+    }
+    long long next = SUPERBLOCK_INDEX + 1;
+    if (layoutRegion(sb->inodeBitmapStart, sb->inodeBitmapBlocks, fresh.inodeBitmapBlocks, &next) < 0 ||
+        layoutRegion(sb->dataBitmapStart, sb->dataBitmapBlocks, fresh.dataBitmapBlocks, &next) < 0 ||
+        (sb->refCountBlocks != 0 &&   // none: an image from before snapshots
+         layoutRegion(sb->refCountStart, sb->refCountBlocks, fresh.refCountBlocks, &next) < 0) ||
+        layoutRegion(sb->journalStart, sb->journalBlocks, fresh.journalBlocks, &next) < 0 ||
+        journalCapacity(sb->journalBlocks, sb->blockSize) - sb->journalStart < JOURNAL_OP_BLOCKS ||
+        layoutRegion(sb->inodeTableStart, sb->inodeTableBlocks, fresh.inodeTableBlocks, &next) < 0 ||
+        sb->dataStart < next || sb->dataStart >= sb->numBlocks) {
+        return -1;
+    }
+
+    size_t inodeWords = BITMAP_WORDS((size_t)sb->numInodes), dataWords = BITMAP_WORDS((size_t)sb->numBlocks);
+    uint64_t *ib = calloc(inodeWords, sizeof(uint64_t)), *ic = calloc(inodeWords, sizeof(uint64_t));
+    uint64_t *db = calloc(dataWords, sizeof(uint64_t)),  *dc = calloc(dataWords, sizeof(uint64_t));
+    uint64_t *dh = calloc(dataWords, sizeof(uint64_t));
+    unsigned char *refs = calloc((size_t)sb->numBlocks, 1);
+    int *slots = malloc((size_t)sb->numBlocks * sizeof(int));
+    InCoreInode **open = calloc((size_t)sb->numInodes, sizeof(InCoreInode *));
+    CacheEntry *centries = calloc(CACHE_BLOCKS, sizeof(CacheEntry));
+    char *cdata = malloc((size_t)CACHE_BLOCKS * sb->blockSize);
+    JournalFrozen *frozen = malloc((size_t)sb->journalBlocks * sizeof(JournalFrozen));
+    int *revokes = malloc((size_t)sb->journalBlocks * sizeof(int));
+    char *fdata = malloc((size_t)sb->journalBlocks * sb->blockSize);
+    char *gdata = malloc((size_t)(GROUP_CACHE_SLOTS + 1) * FS_COMPRESS_GROUP * sb->blockSize);
+    int dslots = 1;
+    while (dslots < sb->numBlocks && dslots < DEDUP_MAX_SLOTS) dslots *= 2;
+    DedupEntry *didx = malloc((size_t)dslots * sizeof(DedupEntry));
+    int *dslot = malloc((size_t)sb->numBlocks * sizeof(int));
+    if (!ib || !ic || !db || !dc || !dh || !refs || !slots || !open || !centries || !cdata || !frozen ||
+        !revokes || !fdata || !gdata || !didx || !dslot) {
+        free(ib); free(ic); free(db); free(dc); free(dh); free(refs); free(slots); free(open);
+        free(centries); free(cdata); free(frozen); free(revokes); free(fdata); free(gdata);
+        free(didx); free(dslot);
+        return -1;
+    }
+    cacheDropOverflow();
+    free(inodeBitmap);  free(inodeClaimed);  free(dataBitmap);  free(dataClaimed);
+    free(cacheSlot);    free(openInodes);    free(cache);       free(cacheData);
+    free(journalFrozen); free(journalRevokes); free(journalFrozenData);
+    free(dataHeld);     free(blockRefs);     free(groupCacheData);
+    free(dedupIndex);   free(dedupSlot);
+    inodeBitmap = ib;   inodeClaimed = ic;   dataBitmap = db;   dataClaimed = dc;
+    cacheSlot = slots;  openInodes = open;   cache = centries;  cacheData = cdata;
+    journalFrozen = frozen; journalRevokes = revokes; journalFrozenData = fdata;
+    dataHeld = dh;      blockRefs = refs;    groupCacheData = gdata;
+    dedupIndex = didx;  dedupSlot = dslot;   dedupMask = dslots - 1;
+    dataHeldCount = 0;
+    cacheEntries = CACHE_BLOCKS;
+    for (int i = 0; i < CACHE_BLOCKS; i++) {
+        cache[i].data = cacheData + (size_t)i * sb->blockSize;
+    }
+    for (int i = 0; i < GROUP_CACHE_SLOTS; i++) {
+        groupCache[i].data = groupCacheData + (size_t)i * FS_COMPRESS_GROUP * sb->blockSize;
+    }
+    for (int i = 0; i < sb->journalBlocks; i++) {
+        journalFrozen[i].data = journalFrozenData + (size_t)i * sb->blockSize;
+    }
+
+#ifndef TINYFS_BLOCK_SIZE
+    fsBlockSize         = sb->blockSize;
+#endif
+    FS_NUM_BLOCKS       = sb->numBlocks;
+    FS_NUM_INODES       = sb->numInodes;
+    INODE_BITMAP_START  = sb->inodeBitmapStart;
+    INODE_BITMAP_BLOCKS = sb->inodeBitmapBlocks;
+    DATA_BITMAP_START   = sb->dataBitmapStart;
+    DATA_BITMAP_BLOCKS  = sb->dataBitmapBlocks;
+    REFCOUNT_START      = sb->refCountStart;
+    REFCOUNT_BLOCKS     = sb->refCountBlocks;
+    JOURNAL_START       = sb->journalStart;
+    JOURNAL_BLOCKS      = sb->journalBlocks;
+    journalCopies       = journalCapacity(JOURNAL_BLOCKS, FS_BLOCK_SIZE);
+    INODES_PER_BLOCK    = FS_BLOCK_SIZE / (int)sizeof(Inode);
+    INODE_TABLE_START   = sb->inodeTableStart;
+    INODE_TABLE_BLOCKS  = sb->inodeTableBlocks;
+    DATA_BLOCK_START    = sb->dataStart;
+
+    // what the block pointers reach, kept within an int offset
+    long long maxBlocks = NUM_DIRECT_POINTERS + PTRS_PER_BLOCK + (long long)PTRS_PER_BLOCK * PTRS_PER_BLOCK;
+    long long maxBytes  = maxBlocks * FS_BLOCK_SIZE;
+    FS_MAX_FILE_SIZE = maxBytes < INT_MAX ? (int)maxBytes : INT_MAX / FS_BLOCK_SIZE * FS_BLOCK_SIZE;
+    return 0;
+}
+
+/* ------------------------- */
+/*        FS_Boot()          */
+/* ------------------------- */
+
+/* Take the free-space counters saved in sb; they stand in until the bitmaps are read (which recounts) */
+static void loadFreeCounts(const Superblock *sb) {
+    freeInodeCount = sb->freeInodes >= 0 && sb->freeInodes < sb->numInodes ? sb->freeInodes : 0;
+    freeBlockCount = sb->freeBlocks >= 0 && sb->freeBlocks <= sb->numBlocks - sb->dataStart ? sb->freeBlocks : 0;
+}
+
+/* How many snapshots sb records */
+static int snapshotsIn(const Superblock *sb) {
+    int n = 0;
+    for (int i = 0; i < FS_MAX_SNAPSHOTS; i++) {
+        n += sb->snapshots[i].id > 0;
+    }
+    return n;
+}
+
+/* Common start of FS_Boot and FS_Format: quiesce, forget every fd, fresh default disk */
+static int bootBegin(char *path) {
+    readAheadDrain();
+    initOFT();
+    readOnly = 0;
+    if (Disk_Init() == -1) {
+        printf("Disk_Init() failed\n");
+        return E_DISK_ERROR;
+    }
+
+    /* Remember the path for possible FS_Sync */
+    if (path != NULL) {
+        strncpy(g_disk_path, path, sizeof(g_disk_path) - 1);
+        g_disk_path[sizeof(g_disk_path) - 1] = '\0';
+    }
+    return 0;
+}
+
+/* Mount the image just loaded: geometry and layout from its superblock */
+static int mountDisk(void) {
+    // the superblock fits the first MIN_BLOCK_SIZE bytes, whatever the disk's block size
+    char buf[BLOCK_SIZE];
+    diskRead(SUPERBLOCK_INDEX, buf);
+
+    Superblock sb;
+    memcpy(&sb, buf, sizeof(sb));
+    if (sb.magic != MAGIC_NUMBER) {
+        // not a valid TinyFS filesystem
+        return E_DISK_ERROR;
+    }
+    if (sb.blockSize != Disk_BlockSize() && Disk_SetBlockSize(sb.blockSize) < 0) {
+        return E_DISK_ERROR;
+    }
+    if (Disk_NumBlocks() != sb.numBlocks || layoutMount(&sb) < 0) {
+        return E_DISK_ERROR;
+    }
+    cacheReset();
+
+    // finish whatever metadata the last run committed but never checkpointed
+    journalRecover();
+
+    // the superblock's counters may just have come home from the journal
+    char block[FS_BLOCK_SIZE];
+    diskRead(SUPERBLOCK_INDEX, block);
+    memcpy(&sb, block, sizeof(sb));
+    loadFreeCounts(&sb);
+    snapshotCount = snapshotsIn(&sb);
+    sharedRefs    = sb.refCountBlocks > 0 && sb.sharedRefs > 0 ? sb.sharedRefs : 0;
+
+    // the bitmaps stay on disk until the first allocation or free
+    bitmapsLoaded = 0;
+    resetAllocator();
+
+    dcacheReset();
+    return 0;
+}
+
+/* Create a new filesystem of the given geometry on a fresh disk and save it to path */
+static int formatDisk(char *path, int blockSize, int numBlocks, int numInodes) {
+    Superblock sb;
+    if (layoutChoose(&sb, blockSize, numBlocks, numInodes) < 0 ||
+        Disk_Create(blockSize, numBlocks) < 0 || layoutMount(&sb) < 0) {
+        return E_DISK_ERROR;
+    }
+    loadFreeCounts(&sb);
+    snapshotCount = 0;
+    sharedRefs    = 0;
+    cacheReset();
+
+    char buf[FS_BLOCK_SIZE];
+
+    // superblock
+    memset(buf, 0, FS_BLOCK_SIZE);
+    memcpy(buf, &sb, sizeof(sb));
+    diskWrite(SUPERBLOCK_INDEX, buf);
+
+    /*
+     * The new disk reads as zeros, which is already an empty bitmap, an
+     * unused inode and a clean journal block: only the blocks that differ
+     * from that are written, and the image is saved sparse.
+     */
+
+    // both bitmaps (all free but the root directory's inode)
+    inodeBitmap[ROOT_INODE / 64] |= (uint64_t)1 << (ROOT_INODE % 64);
+    inodeClaimed[ROOT_INODE / 64] = inodeBitmap[ROOT_INODE / 64];
+    bitmapsLoaded = 1;
+    resetAllocator();
+
+    // empty journal, then the inode bitmap through it to its home block
+    journalSeq = 1;
+    journalRecover();
+    syncInodeBitmap(ROOT_INODE / 64);
+    journalCommit();
+    journalCheckpoint();
+
+    // the inode table block with the empty root directory
+    Inode root;
+    initDirInode(&root);
+    memset(buf, 0, FS_BLOCK_SIZE);
+    memcpy(buf + (ROOT_INODE % INODES_PER_BLOCK) * (int)sizeof(Inode), &root, sizeof(Inode));
+    diskWrite(INODE_TABLE_START + ROOT_INODE / INODES_PER_BLOCK, buf);
+
+    dcacheReset();
+
+    // save freshly created disk image
+    if (Disk_SyncDirty(path) < 0) {
+        return E_DISK_ERROR;
+    }
+
+    return 0;
+}
+
+int FS_Boot(char *path) {
+    printf("FS_Boot %s\n", path);
+
+    if (bootBegin(path) < 0) {
+        return E_DISK_ERROR;
+    }
+
+    /* Try to load an existing disk image */
+    if (Disk_Load(path) == 0) {
+        return mountDisk();
+    }
+
+    /* Otherwise: create a new filesystem of the default geometry */
+    return formatDisk(path, BLOCK_SIZE, NUM_BLOCKS, DEFAULT_NUM_INODES);
+}
+
+int FS_Format(char *path, const FS_Geometry *geometry) {
+    printf("FS_Format %s\n", path);
+
+    if (bootBegin(path) < 0) {
+        return E_DISK_ERROR;
+    }
+    FS_Geometry g = { 0, 0, 0 };
+    if (geometry != NULL) {
+        g = *geometry;
+    }
+    return formatDisk(path, g.blockSize > 0 ? g.blockSize : BLOCK_SIZE,
+                      g.numBlocks > 0 ? g.numBlocks : NUM_BLOCKS,
+                      g.numInodes > 0 ? g.numInodes : DEFAULT_NUM_INODES);
+}
+
+/*
+ * Sync current in-memory disk to file: commit the running transaction and
+ * write out only blocks changed since the last sync. Metadata stays in the
+ * journal until a later checkpoint; mounting replays it.
+ */
+static int syncAll(void) {
+    if (g_disk_path[0] == '\0') {
+        return E_DISK_ERROR;
+    }
+    journalCommit();
+
+    // unused reservations go back: this thread's now, the others' at their next allocation
+    poolReturn(poolSelf(), 1);
+    poolRecall();
+
+    cacheLock();
+    cacheFlushData();
+    int rc = Disk_SyncDirty(g_disk_path);
+    cacheUnlock();
+    return rc < 0 ? E_DISK_ERROR : 0;
+}
+
+int FS_Sync(void) {
+    STAT_TIMED(FS_STAT_SYNC, syncAll());
+}
+
+/* ------------------------- */
+/*   File_Create/Dir_Create  */
+/* ------------------------- */
+
+/* Create an empty file or directory (type DIRENT_*) at path */
+static int createNode(char *path, int type) {
+    if (path == NULL) {
+        return E_FILE_EXISTS;  // same as an empty name
+    }
+    if (readOnly) {
+        return E_READ_ONLY;
+    }
+
+    journalStart();
+    pthread_rwlock_wrlock(&nameLock);
+
+    int dir, childType;
+    char name[MAX_FILENAME_LENGTH];
+    int rc = pathWalk(path, &dir, name);
+    if (rc == 0 && (name[0] == '\0' || dirLookup(dir, name, &childType) >= 0)) {
+        rc = E_FILE_EXISTS;  // the root, or the name is taken
+    }
+    int inodeIndex = rc < 0 ? rc : allocateInode();
+    if (inodeIndex < 0) {
+        pthread_rwlock_unlock(&nameLock);
+        journalStop();
+        return rc < 0 ? rc : E_NO_SPACE;
+    }
+
+    Inode dirIno;
+    readInode(dir, &dirIno);
+    if (dirInsert(dir, &dirIno, inodeIndex, type, name) < 0) {
+        freeInode(inodeIndex);
+        pthread_rwlock_unlock(&nameLock);
+        journalStop();
+        return E_NO_SPACE;
+    }
+
+    Inode ino;
+    if (type == DIRENT_DIR) {
+        initDirInode(&ino);
+    } else {
+        memset(&ino, 0, sizeof(Inode));
+        ino.size  = 0;
+        ino.flags = INODE_INLINE;  // empty inline file; the pointers are only set up when it spills
+    }
+
+    writeInode(inodeIndex, &ino);
+    dcacheInsert(dir, name, inodeIndex, type);
+    pthread_rwlock_unlock(&nameLock);
+    journalStop();
+    return 0;
+}
+
+int File_Create(char *file) {
+    STAT_TIMED(FS_STAT_CREATE, createNode(file, DIRENT_FILE));
+}
+
+int Dir_Create(char *path) {
+    return createNode(path, DIRENT_DIR);
+}
+
+/* ------------------------- */
+/*        File_Open()        */
+/* ------------------------- */
+
+static int openFile(char *file) {
+    if (file == NULL) {
+        return E_NO_SUCH_FILE;
+    }
+
+    // the name lock keeps File_Delete out until the inode is pinned
+    pthread_rwlock_rdlock(&nameLock);
+    int dir, type = DIRENT_DIR;
+    char name[MAX_FILENAME_LENGTH];
+    int inodeIndex = pathWalk(file, &dir, name);
+    if (inodeIndex == 0) {
+        inodeIndex = name[0] == '\0' ? ROOT_INODE : dirLookup(dir, name, &type);
+        if (inodeIndex < 0) {
+            inodeIndex = E_NO_SUCH_FILE;
+        } else if (type == DIRENT_DIR) {
+            inodeIndex = E_IS_A_DIRECTORY;
+        }
+    }
+    if (inodeIndex < 0) {
+        pthread_rwlock_unlock(&nameLock);
+        return inodeIndex;
+    }
+
+    // take a free OFT entry
+    int i = allocOFTEntry();
+    if (i < 0) {
+        pthread_rwlock_unlock(&nameLock);
+        return E_TOO_MANY_OPEN_FILES;
+    }
+    OpenFile *of = oftEntry(i);
+
+    InCoreInode *ip = inodeGet(inodeIndex);
+    pthread_rwlock_unlock(&nameLock);
+    if (ip == NULL) {
+        pthread_mutex_lock(&of->lock);
+        releaseOFTEntry(i);
+        return E_NO_SPACE;
+    }
+
+    // nobody can reach the entry before used is set
+    of->inodeIndex  = inodeIndex;
+    of->filePointer = 0;
+    of->indBlock    = -1;
+    of->raNext      = 0;
+    of->raWindow    = 0;
+    of->raAhead     = 0;
+    of->ip          = ip;
+    __atomic_store_n(&of->used, 1, __ATOMIC_RELEASE);
+    return i + FD_OFFSET;  // user-facing fd
+}
+
+int File_Open(char *file) {
+    STAT_TIMED(FS_STAT_OPEN, openFile(file));
+}
+
+/* ------------------------- */
+/*        COMPRESSION        */
+/* ------------------------- */
+
+/*
+ * A file with INODE_COMPRESS keeps its full groups of FS_COMPRESS_GROUP
+ * blocks compressed. On close, each group written since the last pass is
+ * run through lzCompress and, if that saves a block, the compressed bytes
+ * (a GroupHeader first) replace the group's blocks: its first pointers now
+ * list the blocks holding them, in order, and the rest are block 0, all
+ * with PTR_COMPRESSED. Every block still has exactly one pointer, so
+ * freeing, snapshots and reference counts work on them unchanged. A read
+ * decompresses the whole group once, into the group cache; a write into a
+ * group first turns it back into plain blocks (groupExpand), to be
+ * compressed again on close.
+ *
+ * The codec is byte-oriented LZ77 in the style of LZ4, for speed: each
+ * sequence is a token (literal count and match length - LZ_MIN_MATCH in its
+ * two nibbles, 15 = continued in following bytes, 255 = more still), the
+ * literals, then a 2-byte offset back to the match and the rest of its
+ * length. The last sequence is literals only.
+ */
+
+#define LZ_MIN_MATCH  4
+#define LZ_HASH_BITS  12
+#define LZ_MAX_OFFSET 0xFFFF
+
+/* Start of a compressed group's first block */
+typedef struct {
+    int bytes;       // compressed bytes after the header
+} GroupHeader;
+
+static int lzPutLength(unsigned char *dst, int cap, int *op, int len) {
+    for (; len >= 255; len -= 255) {
+        if (*op >= cap) return -1;
+        dst[(*op)++] = 255;
+    }
+    if (*op >= cap) return -1;
+    dst[(*op)++] = (unsigned char)len;
+    return 0;
+}
+
+/* Append lit literals, then a match of match bytes off back (none if match is 0); -1 past cap */
+static int lzSequence(unsigned char *dst, int cap, int *op, const unsigned char *lits, int lit, int off, int match) {
+    int m = match > 0 ? match - LZ_MIN_MATCH : 0;
+    if (*op >= cap) return -1;
+    dst[(*op)++] = (unsigned char)((lit < 15 ? lit : 15) << 4 | (m < 15 ? m : 15));
+    if (lit >= 15 && lzPutLength(dst, cap, op, lit - 15) < 0) return -1;
+    if (lit > cap - *op) return -1;
+    memcpy(dst + *op, lits, lit);
+    *op += lit;
+    if (match > 0) {
+        if (cap - *op < 2) return -1;
+        dst[(*op)++] = (unsigned char)off;
+        dst[(*op)++] = (unsigned char)(off >> 8);
+        if (m >= 15 && lzPutLength(dst, cap, op, m - 15) < 0) return -1;
+    }
+    return 0;
+}
+
+/* Compress n bytes of src into up to cap bytes of dst; the compressed size, -1 if it does not fit */
+static int lzCompress(const unsigned char *src, int n, unsigned char *dst, int cap) {
+    int table[1 << LZ_HASH_BITS];  // last position of each hashed 4-byte sequence
+    for (int i = 0; i < (1 << LZ_HASH_BITS); i++) table[i] = -1;
+
+    int ip = 0, anchor = 0, op = 0;
+    while (ip + LZ_MIN_MATCH <= n) {
+        uint32_t seq;
+        memcpy(&seq, src + ip, sizeof(seq));
+        int h   = (int)((seq * 2654435761u) >> (32 - LZ_HASH_BITS));
+        int ref = table[h];
+        table[h] = ip;
+        if (ref < 0 || ip - ref > LZ_MAX_OFFSET || memcmp(src + ref, src + ip, LZ_MIN_MATCH) != 0) {
+            ip++;
+            continue;
+        }
+        int len = LZ_MIN_MATCH;
+        while (ip + len < n && src[ref + len] == src[ip + len]) len++;
+        if (lzSequence(dst, cap, &op, src + anchor, ip - anchor, ip - ref, len) < 0) return -1;
+        ip    += len;
+        anchor = ip;
+    }
+    if (lzSequence(dst, cap, &op, src + anchor, n - anchor, 0, 0) < 0) return -1;
+    return op;
+}
+
+static int lzGetLength(const unsigned char *src, int n, int *ip, int *len) {
+    int b;
+    do {
+        if (*ip >= n) return -1;
+        b = src[(*ip)++];
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+/* Decompress n bytes of src into up to cap bytes of dst; the size, -1 if src is malformed */
+static int lzDecompress(const unsigned char *src, int n, unsigned char *dst, int cap) {
+    int ip = 0, op = 0;
+    while (ip < n) {
+        int token = src[ip++];
+        int lit   = token >> 4;
+        if (lit == 15 && lzGetLength(src, n, &ip, &lit) < 0) return -1;
+        if (lit > n - ip || lit > cap - op) return -1;
+        memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == n) {
+            break;  // the last sequence
+        }
+        if (n - ip < 2) return -1;
+        int off = src[ip] | src[ip + 1] << 8;
+        ip += 2;
+        int len = token & 15;
+        if (len == 15 && lzGetLength(src, n, &ip, &len) < 0) return -1;
+        len += LZ_MIN_MATCH;
+        if (off == 0 || off > op || len > cap - op) return -1;
+        for (int i = 0; i < len; i++, op++) {
+            dst[op] = dst[op - off];  // byte by byte: the match may overlap what it writes
+        }
+    }
+    return op;
+}
+
+/*
+ * The compressed group holding file block lblk, decompressed: a pointer
+ * into the group cache, good until cacheMutex is dropped; NULL if the
+ * group does not decompress. cacheMutex held.
+ */
+static char *groupLoad(OpenFile *of, const Inode *ino, int lblk) {
+    int first = lblk - lblk % FS_COMPRESS_GROUP;
+    int head  = PTR_BLOCK(bmap(of, ino, first));
+    for (int i = 0; i < GROUP_CACHE_SLOTS; i++) {
+        if (groupCache[i].block == head) {
+            return groupCache[i].data;
+        }
+    }
+
+    GroupCacheEntry *g = &groupCache[groupCacheHand];
+    groupCacheHand = (groupCacheHand + 1) % GROUP_CACHE_SLOTS;
+    g->block = -1;
+    char *packed = groupCacheData + (size_t)GROUP_CACHE_SLOTS * FS_COMPRESS_GROUP * FS_BLOCK_SIZE;
+    int n = 0;
+    for (; n < FS_COMPRESS_GROUP; n++) {
+        int p = bmap(of, ino, first + n);
+        if (p < 0 || !(p & PTR_COMPRESSED) || PTR_BLOCK(p) == 0) break;
+        cacheRead(PTR_BLOCK(p), packed + n * FS_BLOCK_SIZE);
+    }
+    GroupHeader h;
+    memcpy(&h, packed, sizeof(h));
+    int avail = n * FS_BLOCK_SIZE - (int)sizeof(h);
+    if (n == 0 || h.bytes < 0 || h.bytes > avail ||
+        lzDecompress((unsigned char *)packed + sizeof(h), h.bytes, (unsigned char *)g->data,
+                     FS_COMPRESS_GROUP * FS_BLOCK_SIZE) != FS_COMPRESS_GROUP * FS_BLOCK_SIZE) {
+        return NULL;
+    }
+    g->block = head;
+    return g->data;
+}
+
+/* Reserve n data blocks into blocks[], in runs from goal on where possible; all or none */
+static int allocateBlocks(int goal, int n, int *blocks) {
+    int have = 0;
+    while (have < n) {
+        int got = 0;
+        int start = allocateDataExtent(goal, n - have, &got);
+        if (start < 0) {
+            for (int i = 0; i < have; i++) releaseDataBlock(blocks[i]);
+            syncDataBitmap();
+            return -1;
+        }
+        for (int k = 0; k < got; k++) blocks[have++] = start + k;
+        goal = start + got;
+    }
+    return 0;
+}
+
+/* Turn each compressed group [fp, fp + size) touches back into plain blocks; inode write lock held */
+static int groupExpand(OpenFile *of, Inode *ino, int fp, int size) {
+    if (size <= 0) {
+        return 0;
+    }
+    int last = (fp + size - 1) / FS_BLOCK_SIZE;
+    for (int first = fp / FS_BLOCK_SIZE / FS_COMPRESS_GROUP * FS_COMPRESS_GROUP; first <= last;
+         first += FS_COMPRESS_GROUP) {
+        int p = bmap(of, ino, first);
+        if (p < 0 || !(p & PTR_COMPRESSED)) {
+            continue;
+        }
+        int prev = first > 0 ? bmap(of, ino, first - 1) : -1;
+        int blocks[FS_COMPRESS_GROUP];
+        if (allocateBlocks(prev >= 0 ? PTR_BLOCK(prev) + 1 : -1, FS_COMPRESS_GROUP, blocks) < 0) {
+            return E_NO_SPACE;
+        }
+        cacheLock();
+        char *data = groupLoad(of, ino, first);
+        for (int i = 0; i < FS_COMPRESS_GROUP && data != NULL; i++) {
+            CacheEntry *e = cacheGet(blocks[i], 0);
+            memcpy(e->data, data + i * FS_BLOCK_SIZE, FS_BLOCK_SIZE);
+            e->dirty = 1;
+        }
+        cacheUnlock();
+        if (data == NULL) {
+            for (int i = 0; i < FS_COMPRESS_GROUP; i++) releaseDataBlock(blocks[i]);
+            syncDataBitmap();
+            return E_NO_SPACE;  // unreadable: leave it as it is
+        }
+        for (int i = 0; i < FS_COMPRESS_GROUP; i++) {
+            int old = bmap(of, ino, first + i);
+            bmapSet(of, ino, first + i, blocks[i]);
+            releaseDataBlock(PTR_BLOCK(old));
+        }
+        syncDataBitmap();
+    }
+    return 0;
+}
+
+/*
+ * Compress the group starting at file block first if all its blocks are
+ * written, plain blocks and the result saves at least one; plain and
+ * packed are a group's worth of scratch each. Inode write lock held.
+ */
+static void groupCompress(OpenFile *of, Inode *ino, int first, char *plain, char *packed) {
+    int ptrs[FS_COMPRESS_GROUP];
+    for (int i = 0; i < FS_COMPRESS_GROUP; i++) {
+        ptrs[i] = bmap(of, ino, first + i);
+        if (ptrs[i] < 0 || (ptrs[i] & (PTR_UNWRITTEN | PTR_COMPRESSED))) {
+            return;
+        }
+    }
+    for (int i = 0; i < FS_COMPRESS_GROUP; i++) {
+        cacheRead(ptrs[i], plain + i * FS_BLOCK_SIZE);
+    }
+    GroupHeader h;
+    h.bytes = lzCompress((unsigned char *)plain, FS_COMPRESS_GROUP * FS_BLOCK_SIZE, (unsigned char *)packed + sizeof(h),
+                         (FS_COMPRESS_GROUP - 1) * FS_BLOCK_SIZE - (int)sizeof(h));
+    if (h.bytes < 0) {
+        return;  // would not save a block
+    }
+    memcpy(packed, &h, sizeof(h));
+    int n = ((int)sizeof(h) + h.bytes + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    memset(packed + sizeof(h) + h.bytes, 0, n * FS_BLOCK_SIZE - sizeof(h) - h.bytes);
+    int blocks[FS_COMPRESS_GROUP];
+    if (allocateBlocks(-1, n, blocks) < 0) {
+        return;
+    }
+
+    // the compressed blocks are data: written before the commit that points at them
+    cacheLock();
+    for (int i = 0; i < n; i++) {
+        CacheEntry *e = cacheGet(blocks[i], 0);
+        memcpy(e->data, packed + i * FS_BLOCK_SIZE, FS_BLOCK_SIZE);
+        e->dirty = 1;
+    }
+    cacheUnlock();
+    for (int i = 0; i < FS_COMPRESS_GROUP; i++) {
+        bmapSet(of, ino, first + i, PTR_COMPRESSED | (i < n ? blocks[i] : 0));
+        releaseDataBlock(ptrs[i]);
+    }
+}
+
+/*
+ * On close: compress the full groups written since the last pass. Inode
+ * write lock held inside an operation, restarted between pieces of the pass.
+ */
+static void fileCompress(OpenFile *of, InCoreInode *ip) {
+    Inode *ino = &ip->ino;
+    int lo = ip->writtenLo, hi = ip->writtenHi;
+    ip->writtenLo = INT_MAX;
+    ip->writtenHi = -1;
+    if (!(ino->flags & INODE_COMPRESS) || (ino->flags & INODE_INLINE) || lo > hi) {
+        return;
+    }
+    int groups = ino->size / FS_BLOCK_SIZE / FS_COMPRESS_GROUP;  // wholly inside the file
+    if (lo / FS_COMPRESS_GROUP >= groups) {
+        return;
+    }
+    char *scratch = malloc((size_t)2 * FS_COMPRESS_GROUP * FS_BLOCK_SIZE);
+    if (scratch == NULL) {
+        return;  // stays uncompressed
+    }
+    int first = lo / FS_COMPRESS_GROUP;
+    for (int g = first; g <= hi / FS_COMPRESS_GROUP && g < groups; g++) {
+        // a piece of the pass per journal operation
+        if (g > first && g * FS_COMPRESS_GROUP % JOURNAL_PIECE_BLOCKS < FS_COMPRESS_GROUP) {
+            syncDataBitmap();
+            journalRestart(ip);
+            groups = ino->size / FS_BLOCK_SIZE / FS_COMPRESS_GROUP;
+        }
+        groupCompress(of, ino, g * FS_COMPRESS_GROUP, scratch, scratch + FS_COMPRESS_GROUP * FS_BLOCK_SIZE);
+    }
+    free(scratch);
+    syncDataBitmap();
+    ip->dirty = 1;
+}
+
+int File_SetCompression(int fd, int on) {
+    if (readOnly) {
+        return fdToFile(fd) == NULL ? E_BAD_FD : E_READ_ONLY;
+    }
+    OpenFile *of = fdLock(fd);
+    if (of == NULL) {
+        return E_BAD_FD;
+    }
+    journalStart();
+    pthread_rwlock_wrlock(&of->ip->lock);
+    if (on) {
+        of->ip->ino.flags |= INODE_COMPRESS;
+    } else {
+        of->ip->ino.flags &= ~INODE_COMPRESS;
+    }
+    of->ip->dirty = 1;
+    pthread_rwlock_unlock(&of->ip->lock);
+    journalStop();
+    fdUnlock(of);
+    return 0;
+}
+
+/* ------------------------- */
+/*       DEDUPLICATION       */
+/* ------------------------- */
+
+/*
+ * A file with INODE_DEDUP looks up each whole block it writes in the dedup
+ * index by a hash of its contents. If a block with the same contents is in
+ * the index, the file's pointer goes to that block and its reference count
+ * goes up: no block is used and nothing is written. Otherwise the block is
+ * written and entered in the index. A hit is only taken after the contents
+ * compare equal, so a hash collision costs a read, nothing more. Blocks
+ * whose hashes share a slot probe on to the next ones, so every indexed
+ * block stays findable; only when the DEDUP_MAX_PROBE slots from a block's
+ * home are all taken (the index is near full) does a block go unindexed.
+ *
+ * The index lives in memory, filled by this mount's writes; what is shared
+ * is kept by the reference counts on disk. An entry goes as soon as its
+ * block is freed or about to be written in place (dedupForgetRange, before
+ * the write checks for sharing), so a block is never shared once its owner
+ * is changing it. Freeing is the same: releaseDataBlock drops the entry
+ * before it looks at the count.
+ */
+
+/* Fast 64-bit hash of a block, a word at a time */
+static uint64_t blockHash(const char *data) {
+    uint64_t h = 0x9e3779b97f4a7c15ull;
+    for (int i = 0; i < FS_BLOCK_SIZE; i += (int)sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, data + i, sizeof(w));
+        h = (h ^ w) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+/* Before a write in place: no block of [fp, fp + size) can be shared through the index any more */
+static void dedupForgetRange(OpenFile *of, Inode *ino, int fp, int size) {
+    if (__atomic_load_n(&dedupEntries, __ATOMIC_RELAXED) == 0 || size <= 0) {
+        return;
+    }
+    int last = (fp + size - 1) / FS_BLOCK_SIZE;
+    for (int lblk = fp / FS_BLOCK_SIZE; lblk <= last; lblk++) {
+        int p = bmap(of, ino, lblk);
+        if (p >= 0) {
+            dedupForget(PTR_BLOCK(p));
+        }
+    }
+}
+
+/*
+ * Write a whole block of a dedup file to file block lblk, now mapped to
+ * block: onto an existing block with the same contents if the index has
+ * one (block is given back), else into block, entered in the index in the
+ * first free slot of the probe. Entries are never pushed out; if the probe
+ * finds no free slot the block is written but not indexed.
+ * Inode write lock held.
+ */
+static void dedupWrite(OpenFile *of, Inode *ino, int lblk, int block, const char *data) {
+    uint64_t h = blockHash(data);
+    cacheLock();
+    dedupRemove(block);
+    int home = (int)(h & (uint64_t)dedupMask);
+    int freeSlot = -1;
+    for (int i = 0; i < DEDUP_MAX_PROBE && i <= dedupMask; i++) {
+        int slot = (home + i) & dedupMask;
+        DedupEntry *d = &dedupIndex[slot];
+        if (d->block < 0) {
+            if (freeSlot < 0) {
+                freeSlot = slot;
+            }
+            if (d->block == DEDUP_EMPTY) {
+                break;  // the end of the probe
+            }
+            continue;
+        }
+        if (REFCOUNT_BLOCKS > 0 && d->hash == h) {
+            char buf[FS_BLOCK_SIZE];
+            cacheRead(d->block, buf);
+            if (memcmp(buf, data, FS_BLOCK_SIZE) == 0 && refAdd(d->block) == 0) {
+                int shared = d->block;
+                cacheUnlock();
+                bmapSet(of, ino, lblk, shared);
+                releaseDataBlock(block);
+                syncDataBitmap();
+                return;
+            }
+        }
+    }
+    cacheWriteDirect(block, data);
+    if (freeSlot >= 0) {
+        dedupIndex[freeSlot].hash  = h;
+        dedupIndex[freeSlot].block = block;
+        dedupSlot[block] = freeSlot;
+        __atomic_add_fetch(&dedupEntries, 1, __ATOMIC_RELAXED);
+    }
+    cacheUnlock();
+}
+
+int File_SetDedup(int fd, int on) {
+    if (readOnly) {
+        return fdToFile(fd) == NULL ? E_BAD_FD : E_READ_ONLY;
+    }
+    OpenFile *of = fdLock(fd);
+    if (of == NULL) {
+        return E_BAD_FD;
+    }
+    journalStart();
+    pthread_rwlock_wrlock(&of->ip->lock);
+    if (on) {
+        of->ip->ino.flags |= INODE_DEDUP;
+    } else {
+        of->ip->ino.flags &= ~INODE_DEDUP;
+    }
+    of->ip->dirty = 1;
+    pthread_rwlock_unlock(&of->ip->lock);
+    journalStop();
+    fdUnlock(of);
+    return 0;
+}
+
+/* ------------------------- */
+/*        File_Read()        */
+/* ------------------------- */
+
+/*
+ * Copy up to size bytes at file offset fp into buffer, stopping at EOF;
+ * holes read as zeros. E_DISK_ERROR if a compressed group in the span does
+ * not decompress. Inode lock held.
+ */
+static int readSpan(OpenFile *of, const Inode *ino, int fp, char *buffer, int size) {
+    int bytesToRead = size;
+    if (fp >= ino->size) {
+        bytesToRead = 0; // EOF
+    } else if (fp + bytesToRead > ino->size) {
+        bytesToRead = ino->size - fp;
+    }
+
+    if (ino->flags & INODE_INLINE) {
+        memcpy(buffer, inlineData(ino) + fp, bytesToRead);
+        return bytesToRead;
+    }
+
+    int copied = 0;
+
+    while (copied < bytesToRead) {
+        int diskBlock = bmap(of, ino, fp / FS_BLOCK_SIZE);
+
+        int blockOffset = fp % FS_BLOCK_SIZE;
+        int chunk = FS_BLOCK_SIZE - blockOffset;
+        if (chunk > (bytesToRead - copied)) {
+            chunk = bytesToRead - copied;
+        }
+
+        if (diskBlock < 0) {
+            // a hole: never written, no block, no disk access
+            memset(buffer + copied, 0, chunk);
+        } else if (diskBlock & PTR_COMPRESSED) {
+            // out of the decompressed group
+            cacheLock();
+            char *group = groupLoad(of, ino, fp / FS_BLOCK_SIZE);
+            if (group == NULL) {
+                cacheUnlock();
+                return E_DISK_ERROR;
+            }
+            memcpy(buffer + copied, group + fp / FS_BLOCK_SIZE % FS_COMPRESS_GROUP * FS_BLOCK_SIZE + blockOffset, chunk);
+            cacheUnlock();
+        } else if (diskBlock & PTR_UNWRITTEN) {
+            // reserved but never written: zeros, no disk access
+            memset(buffer + copied, 0, chunk);
+        } else if (chunk == FS_BLOCK_SIZE) {
+            // whole aligned block: straight into the caller's buffer
+            cacheReadDirect(diskBlock, buffer + copied);
+        } else {
+            cacheCopyOut(diskBlock, blockOffset, buffer + copied, chunk);
+        }
+
+        fp      += chunk;
+        copied  += chunk;
+    }
+    return copied;
+}
+
+static void readAheadQueue(int pblk, int len);
+
+/*
+ * Sequential read detection for one fd. A read starting where the last one
+ * ended opens a window of READAHEAD_MIN blocks past it, queued for the
+ * async workers to pull into the cache. Each time the reader comes within
+ * half a window of the prefetched end the window doubles, up to
+ * READAHEAD_MAX, and the next stretch is queued. Any other read closes the
+ * window. Caller holds the fd lock and the inode lock.
+ */
+static void readAhead(OpenFile *of, const Inode *ino, int fp, int len) {
+    if (len <= 0 || (ino->flags & INODE_INLINE)) {
+        return;
+    }
+    int sequential = fp == of->raNext;
+    of->raNext = fp + len;
+    if (!sequential) {
+        of->raWindow = 0;
+        return;
+    }
+
+    int last = (fp + len - 1) / FS_BLOCK_SIZE;
+    if (of->raWindow == 0) {
+        of->raWindow = READAHEAD_MIN;
+        of->raAhead  = last + 1;
+    } else if (last + of->raWindow / 2 < of->raAhead) {
+        return;  // still well inside the prefetched stretch
+    } else if (of->raWindow < READAHEAD_MAX) {
+        of->raWindow = of->raWindow * 2 < READAHEAD_MAX ? of->raWindow * 2 : READAHEAD_MAX;
+    }
+
+    int from = of->raAhead > last + 1 ? of->raAhead : last + 1;
+    int to   = last + 1 + of->raWindow;
+    int nblk = (ino->size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    if (to > nblk) {
+        to = nblk;
+    }
+
+    // queue the mapped blocks as runs of adjacent disk blocks; holes and unwritten ones read as zeros
+    int runStart = -1, runLen = 0;
+    for (int lblk = from; lblk < to; lblk++) {
+        int p = bmap(of, ino, lblk);
+        int onDisk = p >= 0 && !(p & PTR_UNWRITTEN) && PTR_BLOCK(p) != 0;
+        if (onDisk && runLen > 0 && PTR_BLOCK(p) == runStart + runLen) {
+            runLen++;
+            continue;
+        }
+        if (runLen > 0) {
+            readAheadQueue(runStart, runLen);
+        }
+        runStart = PTR_BLOCK(p);
+        runLen   = onDisk ? 1 : 0;
+    }
+    if (runLen > 0) {
+        readAheadQueue(runStart, runLen);
+    }
+    if (to > of->raAhead) {
+        of->raAhead = to;
+    }
+}
+
+/* aligned: File_ReadBlocks, the file pointer must sit on a block boundary (checked under the fd lock) */
+static int readFile(int fd, void *buffer, int size, int aligned) {
+    if (size < 0 || buffer == NULL) {
+        return 0;
+    }
+
+    OpenFile *of = fdLock(fd);
+    if (of == NULL) {
+        return E_BAD_FD;
+    }
+    if (aligned && of->filePointer % FS_BLOCK_SIZE != 0) {
+        fdUnlock(of);
+        return E_BAD_ALIGNMENT;
+    }
+    // shared: readers of the same file run in parallel
+    pthread_rwlock_rdlock(&of->ip->lock);
+
+    int copied = readSpan(of, &of->ip->ino, of->filePointer, buffer, size);
+    if (copied < 0) {
+        pthread_rwlock_unlock(&of->ip->lock);
+        fdUnlock(of);
+        return copied;
+    }
+    readAhead(of, &of->ip->ino, of->filePointer, copied);
+
+    of->filePointer += copied;
+    pthread_rwlock_unlock(&of->ip->lock);
+    fdUnlock(of);
+    return copied;
+}
+
+int File_Read(int fd, void *buffer, int size) {
+    STAT_TIMED(FS_STAT_READ, readFile(fd, buffer, size, 0));
+}
+
+/* ------------------------- */
+/*        File_Write()       */
+/* ------------------------- */
+
+/*
+ * Blocks reserved by one write call, so the pieces it writes know which
+ * blocks have no old contents. start is the call's first byte: in a fresh
+ * block only the piece holding it (or starting the block) builds the block
+ * from zeros, later pieces of the same call merge into it. A write that
+ * still fits an inline file goes into the inode and reserves nothing.
+ */
+typedef struct {
+    int     start;
+    int     inlined; // 1 = the span is written into the inline data
+    Extent *fresh;
+    int     nFresh;
+    int     next;    // first extent not yet behind the write
+} WriteSpan;
+
+static int inlineSpill(OpenFile *of, Inode *ino);
+
+/*
+ * Copy on write: give each block of [fp, fp + size) that a snapshot or
+ * another file shares a block of its own before the write lands, carrying
+ * over the old contents unless the write covers the whole block. The
+ * others keep the old one.
+ * All-or-nothing: the new blocks are all reserved before any is mapped.
+ */
+static int unshareRange(OpenFile *of, Inode *ino, int fp, int size) {
+    if (__atomic_load_n(&sharedRefs, __ATOMIC_RELAXED) == 0) {
+        return 0;  // nothing is shared
+    }
+    bitmapsEnsure();
+    int first = fp / FS_BLOCK_SIZE, last = (fp + size - 1) / FS_BLOCK_SIZE;
+    int *fresh = malloc((last - first + 1) * sizeof(int));
+    if (fresh == NULL) {
+        return E_NO_SPACE;
+    }
+    int prev = first > 0 ? bmap(of, ino, first - 1) : -1;
+    for (int lblk = first; lblk <= last; lblk++) {
+        int ptr = bmap(of, ino, lblk);
+        fresh[lblk - first] = -1;
+        if (ptr >= 0 && __atomic_load_n(&blockRefs[PTR_BLOCK(ptr)], __ATOMIC_RELAXED) > 0) {
+            int got = 0;
+            fresh[lblk - first] = allocateDataExtent(prev >= 0 ? PTR_BLOCK(prev) + 1 : -1, 1, &got);
+            if (fresh[lblk - first] < 0) {
+                for (int i = first; i < lblk; i++) {
+                    if (fresh[i - first] >= 0) freeDataRun(fresh[i - first], 1);
+                }
+                free(fresh);
+                return E_NO_SPACE;
+            }
+            ptr = fresh[lblk - first];
+        }
+        prev = ptr;
+    }
+
+    char buf[FS_BLOCK_SIZE];
+    for (int lblk = first; lblk <= last; lblk++) {
+        if (fresh[lblk - first] < 0) continue;
+        int ptr = bmap(of, ino, lblk);
+        int covered = lblk * FS_BLOCK_SIZE >= fp && (lblk + 1) * FS_BLOCK_SIZE <= fp + size;
+        if (!covered && !(ptr & PTR_UNWRITTEN)) {
+            cacheRead(PTR_BLOCK(ptr), buf);
+            cacheLock();
+            CacheEntry *e = cacheGet(fresh[lblk - first], 0);
+            memcpy(e->data, buf, FS_BLOCK_SIZE);
+            e->dirty = 1;
+            cacheUnlock();
+        }
+        bmapSet(of, ino, lblk, fresh[lblk - first] | (ptr & PTR_UNWRITTEN));
+        releaseDataBlock(PTR_BLOCK(ptr));
+    }
+    syncDataBitmap();
+    free(fresh);
+    return 0;
+}
+
+/*
+ * Sparse files: a block never written has no pointer (a hole) and reads as
+ * zeros. Seeking past the end and writing leaves the blocks in between as
+ * holes, and a File_Write of whole blocks of zeros onto holes does not
+ * reserve them at all, so a file that is mostly zeros costs little more
+ * than its pointer blocks. Zeros written over a block that is already
+ * there are written as usual.
+ */
+
+/* 1 if the block at data is all zeros: 64 bytes a step, with SSE2/AVX2 or NEON where the target has them */
+static int blockIsZero(const char *data) {
+    int i = 0;
+#if defined(__AVX2__)
+    for (; i + 64 <= FS_BLOCK_SIZE; i += 64) {
+        __m256i v = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(data + i)),
+                                    _mm256_loadu_si256((const __m256i *)(data + i + 32)));
+        if (!_mm256_testz_si256(v, v)) return 0;
+    }
+#elif defined(__SSE2__)
+    for (; i + 64 <= FS_BLOCK_SIZE; i += 64) {
+        __m128i v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *)(data + i)),
+                                              _mm_loadu_si128((const __m128i *)(data + i + 16))),
+                                 _mm_or_si128(_mm_loadu_si128((const __m128i *)(data + i + 32)),
+                                              _mm_loadu_si128((const __m128i *)(data + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff) return 0;
+    }
+#elif defined(__ARM_NEON)
+    const uint8_t *u = (const uint8_t *)data;
+    for (; i + 64 <= FS_BLOCK_SIZE; i += 64) {
+        uint64x2_t v = vreinterpretq_u64_u8(vorrq_u8(vorrq_u8(vld1q_u8(u + i), vld1q_u8(u + i + 16)),
+                                                     vorrq_u8(vld1q_u8(u + i + 32), vld1q_u8(u + i + 48))));
+        if ((vgetq_lane_u64(v, 0) | vgetq_lane_u64(v, 1)) != 0) return 0;
+    }
+#endif
+    for (; i + 8 <= FS_BLOCK_SIZE; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, sizeof(w));
+        if (w != 0) return 0;
+    }
+    for (; i < FS_BLOCK_SIZE; i++) {
+        if (data[i] != 0) return 0;
+    }
+    return 1;
+}
+
+/* 1 if a write of data at [fp, fp + size) leaves file block lblk a hole: unmapped and written whole with zeros */
+static int writeLeavesHole(OpenFile *of, const Inode *ino, int fp, int size, const char *data, int lblk) {
+    long long start = (long long)lblk * FS_BLOCK_SIZE;
+    return start >= fp && start + FS_BLOCK_SIZE <= (long long)fp + size && bmap(of, ino, lblk) < 0 &&
+           blockIsZero(data + (start - fp));
+}
+
+/* Unmap and free the runs a write span reserved */
+static void unreserveBlocks(OpenFile *of, Inode *ino, Extent *runs, int nRuns) {
+    for (int i = 0; i < nRuns; i++) {
+        for (int k = 0; k < runs[i].len; k++) {
+            bmapSet(of, ino, runs[i].lblk + k, -1);
+        }
+        freeDataRun(runs[i].pblk, runs[i].len);
+    }
+}
+
+/*
+ * reserveBlocks for a write of size bytes at fp. With the data (NULL: not
+ * known yet) the holes it writes zeros to whole are left out and stay holes.
+ * All-or-nothing like reserveBlocks; the runs go to *runs (caller frees).
+ */
+static int reserveWrite(OpenFile *of, Inode *ino, int fp, int size, const char *data, Extent **runs, int *nRuns) {
+    int first = fp / FS_BLOCK_SIZE, last = (fp + size - 1) / FS_BLOCK_SIZE;
+    if (data == NULL) {
+        return reserveBlocks(of, ino, first, last, 0, runs, nRuns);
+    }
+    Extent *list = NULL;
+    int n = 0;
+    for (int lblk = first; lblk <= last; ) {
+        // the stretch up to the next hole that stays one
+        int end = lblk;
+        while (end <= last && !writeLeavesHole(of, ino, fp, size, data, end)) end++;
+        if (end > lblk) {
+            Extent *part;
+            int nPart;
+            if (reserveBlocks(of, ino, lblk, end - 1, 0, &part, &nPart) < 0) {
+                unreserveBlocks(of, ino, list, n);
+                free(list);
+                return E_NO_SPACE;
+            }
+            if (nPart > 0) {
+                Extent *grown = realloc(list, (n + nPart) * sizeof(Extent));
+                if (grown == NULL) {
+                    unreserveBlocks(of, ino, part, nPart);
+                    unreserveBlocks(of, ino, list, n);
+                    free(part);
+                    free(list);
+                    return E_NO_SPACE;
+                }
+                list = grown;
+                memcpy(list + n, part, nPart * sizeof(Extent));
+                n += nPart;
+            }
+            free(part);
+        }
+        lblk = end + 1;
+    }
+    *runs  = list;
+    *nRuns = n;
+    return 0;
+}
+
+/*
+ * Reserve the blocks for size bytes at fp and start a write span; data is
+ * what will be written, or NULL if not known yet. Inode write lock held.
+ */
+static int writeSpanBegin(OpenFile *of, Inode *ino, int fp, int size, const char *data, WriteSpan *w) {
+    w->start   = fp;
+    w->inlined = 0;
+    w->fresh   = NULL;
+    w->nFresh  = 0;
+    w->next    = 0;
+    if (ino->flags & INODE_INLINE) {
+        if (fp + size <= INLINE_DATA_SIZE) {
+            if (fp > ino->size) {
+                memset(inlineData(ino) + ino->size, 0, fp - ino->size);  // past the end: zeros up to fp
+            }
+            w->inlined = 1;
+            return 0;
+        }
+        if (inlineSpill(of, ino) < 0) {
+            return E_NO_SPACE;
+        }
+    }
+    if (groupExpand(of, ino, fp, size) < 0) {
+        return E_NO_SPACE;
+    }
+    dedupForgetRange(of, ino, fp, size);
+    int rc = reserveWrite(of, ino, fp, size, data, &w->fresh, &w->nFresh);
+    if (rc == 0 && unshareRange(of, ino, fp, size) < 0) {
+        // give back what was just reserved: the write does not happen
+        unreserveBlocks(of, ino, w->fresh, w->nFresh);
+        free(w->fresh);
+        w->fresh  = NULL;
+        w->nFresh = 0;
+        rc = E_NO_SPACE;
+    }
+    return rc;
+}
+
+/* Write size bytes at fp, all inside the span's reserved blocks; returns the new offset */
+static int writeSpan(OpenFile *of, Inode *ino, WriteSpan *w, int fp, const char *buffer, int size) {
+    if (w->inlined) {
+        memcpy(inlineData(ino) + fp, buffer, size);
+        return fp + size;
+    }
+
+    int written = 0;
+
+    while (written < size) {
+        int blockIndex = fp / FS_BLOCK_SIZE;
+        int diskBlock  = bmap(of, ino, blockIndex);
+
+        int blockOffset = fp % FS_BLOCK_SIZE;
+        int chunk = FS_BLOCK_SIZE - blockOffset;
+        if (chunk > (size - written)) {
+            chunk = size - written;
+        }
+
+        // a hole left by reserveWrite, or zeros into an unwritten block: nothing to write
+        if (diskBlock < 0 ||
+            ((diskBlock & PTR_UNWRITTEN) && chunk == FS_BLOCK_SIZE && blockIsZero(buffer + written))) {
+            fp      += chunk;
+            written += chunk;
+            continue;
+        }
+
+        // a block reserved by this write or an unwritten extent has no old contents
+        while (w->next < w->nFresh && blockIndex >= w->fresh[w->next].lblk + w->fresh[w->next].len) w->next++;
+        int isNew = (w->next < w->nFresh && blockIndex >= w->fresh[w->next].lblk) || (diskBlock & PTR_UNWRITTEN);
+        if (diskBlock & PTR_UNWRITTEN) {
+            diskBlock = PTR_BLOCK(diskBlock);
+            bmapSet(of, ino, blockIndex, diskBlock);
+        }
+        if (blockOffset != 0 && fp != w->start) {
+            isNew = 0;  // an earlier piece of this call already built the block
+        }
+
+        if (chunk == FS_BLOCK_SIZE && (ino->flags & INODE_DEDUP)) {
+            dedupWrite(of, ino, blockIndex, diskBlock, buffer + written);
+        } else if (chunk == FS_BLOCK_SIZE) {
+            // whole aligned block: no need to read the old contents
+            cacheWriteDirect(diskBlock, (char *)buffer + written);
+        } else if (isNew) {
+            // build the new block once: the data plus zeros for the bytes it doesn't cover
+            cacheLock();
+            CacheEntry *e = cacheGet(diskBlock, 0);
+            memset(e->data, 0, blockOffset);
+            memcpy(e->data + blockOffset, buffer + written, chunk);
+            memset(e->data + blockOffset + chunk, 0, FS_BLOCK_SIZE - blockOffset - chunk);
+            e->dirty = 1;
+            cacheUnlock();
+        } else {
+            cacheLock();
+            CacheEntry *e = cacheGet(diskBlock, 1);
+            memcpy(e->data + blockOffset, buffer + written, chunk);
+            e->dirty = 1;
+            cacheUnlock();
+        }
+
+        fp      += chunk;
+        written += chunk;
+    }
+    return fp;
+}
+
+/*
+ * Move an inline file's data out to a real block, leaving a regular inode
+ * with the same size (no-op for a regular one). On E_NO_SPACE the file
+ * stays inline, unchanged.
+ */
+static int inlineSpill(OpenFile *of, Inode *ino) {
+    if (!(ino->flags & INODE_INLINE)) {
+        return 0;
+    }
+    char data[sizeof(Inode)];
+    int  n   = ino->size;
+    int  cap = INLINE_DATA_SIZE;
+    memcpy(data, inlineData(ino), cap);
+
+    memset(inlineData(ino), 0, cap);
+    for (int i = 0; i < NUM_DIRECT_POINTERS; i++) {
+        ino->dataBlocks[i] = -1;
+    }
+    ino->indirectBlock       = -1;
+    ino->doubleIndirectBlock = -1;
+    ino->flags &= ~INODE_INLINE;
+    if (n == 0) {
+        return 0;
+    }
+
+    WriteSpan w;
+    if (writeSpanBegin(of, ino, 0, n, data, &w) < 0) {
+        memcpy(inlineData(ino), data, cap);
+        ino->flags |= INODE_INLINE;
+        return E_NO_SPACE;
+    }
+    writeSpan(of, ino, &w, 0, data, n);
+    free(w.fresh);
+    return 0;
+}
+
+/*
+ * writeSpanBegin for a File_Write: if it runs out of space while blocks
+ * freed in the running transaction are held, commit and try once more.
+ * Inode write lock held inside an operation, and so again on return.
+ */
+static int writeSpanReserve(OpenFile *of, int fp, int size, const char *data, WriteSpan *w) {
+    if (writeSpanBegin(of, &of->ip->ino, fp, size, data, w) == 0) {
+        return 0;
+    }
+    if (__atomic_load_n(&dataHeldCount, __ATOMIC_RELAXED) == 0) {
+        return E_NO_SPACE;
+    }
+    of->ip->dirty = 1;  // keeps any pointer blocks hooked in
+    pthread_rwlock_unlock(&of->ip->lock);
+    journalStop();
+    journalCommit();
+    journalStart();
+    pthread_rwlock_wrlock(&of->ip->lock);
+    return writeSpanBegin(of, &of->ip->ino, fp, size, data, w);
+}
+
+/* Finish a span that ended at offset end: grow the file and mark the inode dirty */
+static void writeSpanEnd(OpenFile *of, Inode *ino, WriteSpan *w, int end) {
+    free(w->fresh);
+    if (end > ino->size) {
+        ino->size = end;
+    }
+    if (end > w->start && !w->inlined) {
+        // for the compression pass on close
+        int lo = w->start / FS_BLOCK_SIZE, hi = (end - 1) / FS_BLOCK_SIZE;
+        of->ip->writtenLo = lo < of->ip->writtenLo ? lo : of->ip->writtenLo;
+        of->ip->writtenHi = hi > of->ip->writtenHi ? hi : of->ip->writtenHi;
+    }
+    // in-core inode reaches the inode table on close or commit
+    of->ip->dirty = 1;
+}
+
+/* aligned: as for readFile, File_WriteBlocks */
+static int writeFile(int fd, void *buffer, int size, int aligned) {
+    if (size < 0 || buffer == NULL) {
+        return 0;
+    }
+    if (readOnly) {
+        return fdToFile(fd) == NULL ? E_BAD_FD : E_READ_ONLY;
+    }
+
+    OpenFile *of = fdLock(fd);
+    if (of == NULL) {
+        return E_BAD_FD;
+    }
+    if (aligned && of->filePointer % FS_BLOCK_SIZE != 0) {
+        fdUnlock(of);
+        return E_BAD_ALIGNMENT;
+    }
+
+    int fp = of->filePointer;
+
+    if (size == 0 || size > FS_MAX_FILE_SIZE - fp) {
+        // nothing to do, or would exceed maximum file size
+        fdUnlock(of);
+        return size == 0 ? 0 : E_FILE_TOO_BIG;
+    }
+
+    journalStart();
+    pthread_rwlock_wrlock(&of->ip->lock);
+    Inode *ino = &of->ip->ino;
+
+    // a piece at a time, each reserving all the blocks it needs up front, as contiguous runs
+    int start = fp, end = fp + size;
+    while (fp < end) {
+        if (fp > start) {
+            journalRestart(of->ip);
+        }
+        int n = journalPieceEnd(fp, end) - fp;
+        WriteSpan w;
+        if (writeSpanReserve(of, fp, n, (char *)buffer + (fp - start), &w) < 0) {
+            of->ip->dirty = 1;  // keeps any pointer blocks hooked in
+            break;
+        }
+        fp = writeSpan(of, ino, &w, fp, (char *)buffer + (fp - start), n);
+        writeSpanEnd(of, ino, &w, fp);
+    }
+
+    pthread_rwlock_unlock(&of->ip->lock);
+    journalStop();
+
+    of->filePointer = fp;
+    fdUnlock(of);
+    return fp > start ? fp - start : E_NO_SPACE;
+}
+
+int File_Write(int fd, void *buffer, int size) {
+    STAT_TIMED(FS_STAT_WRITE, writeFile(fd, buffer, size, 0));
+}
+
+/* ------------------------- */
+/*   File_Readv/Writev()     */
+/* ------------------------- */
+
+/*
+ * Scatter/gather: the iovecs are transferred back to back at the file
+ * pointer as one call - one fd and inode lock, one block reservation and
+ * one inode update for the whole array. Return values match File_Read and
+ * File_Write for a buffer of the total length.
+ */
+static long long iovTotal(const FS_IoVec *iov, int iovcnt) {
+    long long total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].len < 0 || (iov[i].len > 0 && iov[i].base == NULL)) {
+            return -1;
+        }
+        total += iov[i].len;
+    }
+    return total;
+}
+
+int File_Readv(int fd, const FS_IoVec *iov, int iovcnt) {
+    if (iov == NULL || iovcnt < 0 || iovTotal(iov, iovcnt) < 0) {
+        return 0;
+    }
+
+    OpenFile *of = fdLock(fd);
+    if (of == NULL) {
+        return E_BAD_FD;
+    }
+    pthread_rwlock_rdlock(&of->ip->lock);
+    Inode *ino = &of->ip->ino;
+
+    int copied = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        int n = readSpan(of, ino, of->filePointer + copied, iov[i].base, iov[i].len);
+        if (n < 0) {
+            pthread_rwlock_unlock(&of->ip->lock);
+            fdUnlock(of);
+            return n;  // the file pointer stays put
+        }
+        copied += n;
+        if (n < iov[i].len) {
+            break;  // EOF
+        }
+    }
+    readAhead(of, ino, of->filePointer, copied);
+
+    of->filePointer += copied;
+    pthread_rwlock_unlock(&of->ip->lock);
+    fdUnlock(of);
+    return copied;
+}
+
+int File_Writev(int fd, const FS_IoVec *iov, int iovcnt) {
+    long long total = iov == NULL || iovcnt < 0 ? -1 : iovTotal(iov, iovcnt);
+    if (total < 0) {
+        return 0;
+    }
+    if (readOnly) {
+        return fdToFile(fd) == NULL ? E_BAD_FD : E_READ_ONLY;
+    }
+
+    OpenFile *of = fdLock(fd);
+    if (of == NULL) {
+        return E_BAD_FD;
+    }
+
+    int fp = of->filePointer;
+    if (total == 0 || total > FS_MAX_FILE_SIZE - fp) {
+        fdUnlock(of);
+        return total == 0 ? 0 : E_FILE_TOO_BIG;
+    }
+
+    journalStart();
+    pthread_rwlock_wrlock(&of->ip->lock);
+    Inode *ino = &of->ip->ino;
+
+    // a piece at a time, as for File_Write; iovec i is used up to off
+    int start = fp, end = fp + (int)total, i = 0, off = 0;
+    while (fp < end) {
+        if (fp > start) {
+            journalRestart(of->ip);
+        }
+        int n = journalPieceEnd(fp, end) - fp;
+        // a single buffer is known up front: its whole zero blocks can stay holes
+        WriteSpan w;
+        if (writeSpanReserve(of, fp, n, iovcnt == 1 ? (char *)iov[0].base + (fp - start) : NULL, &w) < 0) {
+            of->ip->dirty = 1;
+            break;
+        }
+        for (int left = n; left > 0; ) {
+            int chunk = iov[i].len - off < left ? iov[i].len - off : left;
+            fp = writeSpan(of, ino, &w, fp, (char *)iov[i].base + off, chunk);
+            left -= chunk;
+            off  += chunk;
+            if (off == iov[i].len) {
+                i++;
+                off = 0;
+            }
+        }
+        writeSpanEnd(of, ino, &w, fp);
+    }
+
+    pthread_rwlock_unlock(&of->ip->lock);
+    journalStop();
+
+    of->filePointer = fp;
+    fdUnlock(of);
+    return fp > start ? fp - start : E_NO_SPACE;
+}
+
+/* ------------------------- */
+/*      File_Allocate()      */
+/* ------------------------- */
+
+/*
+ * Preallocate the file out to size bytes. Missing blocks are reserved as
+ * contiguous unwritten extents: nothing is zeroed or written, they read back
+ * as zeros, and the first File_Write into each one fills it in place. The
+ * file grows to size if it was shorter, a piece at a time (so it may grow
+ * part of the way before running out of space); the file pointer does not
+ * move.
+ */
+int File_Allocate(int fd, int size) {
+    if (size < 0 || size > FS_MAX_FILE_SIZE) {
+        return fdToFile(fd) == NULL ? E_BAD_FD : E_FILE_TOO_BIG;
+    }
+    if (readOnly) {
+        return fdToFile(fd) == NULL ? E_BAD_FD : E_READ_ONLY;
+    }
+    OpenFile *of = fdLock(fd);
+    if (of == NULL) {
+        return E_BAD_FD;
+    }
+    if (size == 0) {
+        fdUnlock(of);
+        return 0;
+    }
 
-            // zero out new data block
-            char zeroBuf[BLOCK_SIZE];
-            memset(zeroBuf, 0, BLOCK_SIZE);
-            Disk_Write(newBlock, zeroBuf);
+    journalStart();
+    pthread_rwlock_wrlock(&of->ip->lock);
+    Inode *ino = &of->ip->ino;
 
-            ino.dataBlocks[blockIndex] = newBlock;
+    int rc = 0;
+    if ((ino->flags & INODE_INLINE) && size <= INLINE_DATA_SIZE) {
+        // still fits inline: the new bytes are zeros in place
+        if (size > ino->size) {
+            memset(inlineData(ino) + ino->size, 0, size - ino->size);
+            ino->size = size;
         }
-
-        int diskBlock = ino.dataBlocks[blockIndex];
-
-        char blockBuf[BLOCK_SIZE];
-        Disk_Read(diskBlock, blockBuf);
-
-        int blockOffset = fp % BLOCK_SIZE;
-        int chunk = BLOCK_SIZE - blockOffset;
-        if (chunk > (size - written)) {
-            chunk = size - written;
+    } else if ((rc = inlineSpill(of, ino)) == 0) {
+        for (int fp = 0; fp < size && rc == 0; ) {
+            if (fp > 0) {
+                journalRestart(of->ip);
+            }
+            int end = journalPieceEnd(fp, size);
+            rc = reserveBlocks(of, ino, fp / FS_BLOCK_SIZE, (end - 1) / FS_BLOCK_SIZE, PTR_UNWRITTEN, NULL, NULL);
+            if (rc == 0 && end > ino->size) {
+                ino->size = end;
+            }
+            fp = end;
         }
+    }
+    of->ip->dirty = 1;
 
-        memcpy(blockBuf + blockOffset, (char *)buffer + written, chunk);
-        Disk_Write(diskBlock, blockBuf);
+    pthread_rwlock_unlock(&of->ip->lock);
+    journalStop();
+    fdUnlock(of);
+    return rc;
+}
 
-        fp      += chunk;
-        written += chunk;
+/* ------------------------- */
+/*  File_ReadBlocks/Write    */
+/* ------------------------- */
+
+/*
+ * Block-granular transfers: count whole blocks at the current file pointer,
+ * which must sit on a block boundary. Every chunk then takes the aligned
+ * full-block path of File_Read/File_Write. Return values match those calls.
+ * The alignment is checked with the fd locked, in the same call that moves
+ * the pointer, so a seek from another thread cannot slip in between.
+ */
+int File_ReadBlocks(int fd, void *buffer, int count) {
+    if (count < 0 || count > FS_MAX_FILE_SIZE / FS_BLOCK_SIZE) {
+        return fdToFile(fd) == NULL ? E_BAD_FD : E_FILE_TOO_BIG;
     }
+    STAT_TIMED(FS_STAT_READ, readFile(fd, buffer, count * FS_BLOCK_SIZE, 1));
+}
 
-    if (fp > ino.size) {
-        ino.size = fp;
+int File_WriteBlocks(int fd, void *buffer, int count) {
+    if (count < 0 || count > FS_MAX_FILE_SIZE / FS_BLOCK_SIZE) {
+        return fdToFile(fd) == NULL ? E_BAD_FD : E_FILE_TOO_BIG;
     }
+    STAT_TIMED(FS_STAT_WRITE, writeFile(fd, buffer, count * FS_BLOCK_SIZE, 1));
+}
 
-    // save updated inode
-    writeInode(of->inodeIndex, &ino);
+/* ------------------------- */
+/*        File_Seek()        */
+/* ------------------------- */
 
-    of->filePointer = fp;
-    return written;
+/*
+ * Move the file pointer to offset, which may be past the end of the file
+ * (up to the largest file size): a write there leaves a hole in between,
+ * a read there returns 0. A seek ends any sequential run.
+ */
+int File_Seek(int fd, int offset) {
+    OpenFile *of = fdLock(fd);
+    if (of == NULL) {
+        return E_BAD_FD;
+    }
+    if (offset < 0 || offset > FS_MAX_FILE_SIZE) {
+        fdUnlock(of);
+        return E_SEEK_OUT_OF_BOUNDS;
+    }
+    of->filePointer = offset;
+    of->raNext      = -1;
+    of->raWindow    = 0;
+    of->raAhead     = 0;
+    fdUnlock(of);
+    return 0;
 }
 
 /* ------------------------- */
 /*        File_Close()       */
 /* ------------------------- */
 
-int File_Close(int fd) {
-    int idx = fdToIndex(fd);
-    if (idx < 0) {
+static int closeFile(int fd) {
+    OpenFile *of = fdLock(fd);
+    if (of == NULL) {
         return E_BAD_FD;
     }
 
-    oft[idx].used        = 0;
-    oft[idx].inodeIndex  = -1;
-    oft[idx].filePointer = 0;
+    // compress what was written, write back the inode and the dirty data blocks; metadata rides the next commit
+    journalStart();
+    pthread_rwlock_wrlock(&of->ip->lock);
+    fileCompress(of, of->ip);
+    pthread_rwlock_unlock(&of->ip->lock);
+    inodePut(of->ip);
+    if (batchDepth == 0) {
+        cacheFlushData();  // a batch flushes once, at its end
+    }
+
+    of->filePointer = 0;
+    releaseOFTEntry(fd - FD_OFFSET);
+    journalStop();
 
     return 0;
 }
 
+int File_Close(int fd) {
+    STAT_TIMED(FS_STAT_CLOSE, closeFile(fd));
+}
+
 /* ------------------------- */
-/*        File_Delete()      */
+/*   File_Delete/Dir_Delete  */
 /* ------------------------- */
 
-int File_Delete(char *file) {
-    int inodeIndex = lookupFile(file);
-    if (inodeIndex < 0) {
+/* Remove the file or (empty) directory at path; type says which it must be */
+static int removeNode(char *path, int type) {
+    if (path == NULL) {
         return E_NO_SUCH_FILE;
     }
+    if (readOnly) {
+        return E_READ_ONLY;
+    }
 
-    // If file is currently open, do not delete
-    for (int i = 0; i < OPEN_FILE_TABLE_SIZE; i++) {
-        if (oft[i].used && oft[i].inodeIndex == inodeIndex) {
-            return E_FILE_IN_USE;
-        }
+    journalStart();
+    pthread_rwlock_wrlock(&nameLock);
+
+    int dir, childType = 0;
+    char name[MAX_FILENAME_LENGTH];
+    int inodeIndex = -1;
+    int rc = pathWalk(path, &dir, name);
+    if (rc == 0 && name[0] == '\0') {
+        rc = type == DIRENT_DIR ? E_FILE_IN_USE : E_IS_A_DIRECTORY;  // the root stays
+    } else if (rc == 0 && (inodeIndex = dirLookup(dir, name, &childType)) < 0) {
+        rc = E_NO_SUCH_FILE;
+    } else if (rc == 0 && childType != type) {
+        rc = type == DIRENT_DIR ? E_NOT_A_DIRECTORY : E_IS_A_DIRECTORY;
     }
 
     Inode ino;
-    readInode(inodeIndex, &ino);
-
-    // Free all data blocks used by this inode
-    for (int i = 0; i < NUM_DIRECT_POINTERS; i++) {
-        if (ino.dataBlocks[i] >= 0) {
-            freeDataBlock(ino.dataBlocks[i]);
-            ino.dataBlocks[i] = -1;
+    if (rc == 0) {
+        readInode(inodeIndex, &ino);
+        if (type == DIRENT_DIR && !dirIsEmpty(&ino)) {
+            rc = E_DIR_NOT_EMPTY;
         }
     }
 
+    // If file is currently open, do not delete (no File_Open can pin it while we hold nameLock)
+    pthread_mutex_lock(&openInodesMutex);
+    if (rc == 0 && openInodes[inodeIndex] != NULL && openInodes[inodeIndex]->openCount > 0) {
+        rc = E_FILE_IN_USE;
+    }
+    pthread_mutex_unlock(&openInodesMutex);
+
+    if (rc < 0) {
+        pthread_rwlock_unlock(&nameLock);
+        journalStop();
+        return rc;
+    }
+
+    // Free all data and pointer blocks used by this inode
+    freeInodeBlocks(&ino);
+
     // Clear inode on disk (optional but nice)
     memset(&ino, 0, sizeof(Inode));
     writeInode(inodeIndex, &ino);
 
-    // Mark inode as free in bitmap
+    // Drop it from its directory and the dentry cache, and mark inode as free in bitmap
+    Inode dirIno;
+    readInode(dir, &dirIno);
+    dirRemove(&dirIno, name);
+    dcacheRemove(dir, name);
     freeInode(inodeIndex);
+    pthread_rwlock_unlock(&nameLock);
+    journalStop();
+
+    return 0;
+}
+
+int File_Delete(char *file) {
+    STAT_TIMED(FS_STAT_DELETE, removeNode(file, DIRENT_FILE));
+}
+
+int Dir_Delete(char *path) {
+    return removeNode(path, DIRENT_DIR);
+}
+
+
+/* ------------------------- */
+/*         SNAPSHOTS         */
+/* ------------------------- */
+
+/*
+ * A snapshot is the whole file system frozen at one moment. FS_Snapshot
+ * copies the metadata - the inode table and inode bitmap, every directory
+ * block and every pointer block - into new blocks, and keeps the file data
+ * in common: each data block the copy points at gains a reference
+ * (blockRefs). From then on the live file system copies a shared block
+ * before writing to it (unshareRange), and freeing one only drops a
+ * reference, so nothing the snapshot reaches ever changes. The copied table
+ * is kept as a file whose inode sits in the superblock's snapshot record;
+ * FS_BootSnapshot reads inodes from there, and every other pointer in the
+ * copy is an ordinary block number.
+ *
+ * Both run with the journal locked, so no operation is in progress. A new
+ * snapshot's references are committed before its record, and a deleted
+ * one's record before its references go: a crash in between leaks blocks
+ * but never frees one still in use.
+ */
+
+/* Blocks a snapshot being built has taken and referenced, given back if it runs out of space */
+typedef struct {
+    int *blocks;
+    int  nBlocks;
+    int  capBlocks;
+    int *refs;
+    int  nRefs;
+    int  capRefs;
+    int  goal;      // where the next copy goes: the copy is laid out in one stretch where it can be
+} SnapshotBuild;
+
+static int snapshotTrack(int **list, int *n, int *cap, int block) {
+    if (*n == *cap) {
+        int grown = *cap ? *cap * 2 : 64;
+        int *l = realloc(*list, grown * sizeof(int));
+        if (l == NULL) {
+            return -1;
+        }
+        *list = l;
+        *cap  = grown;
+    }
+    (*list)[(*n)++] = block;
+    return 0;
+}
+
+/* A new block holding buf, written with the data on the next flush; -1 if out of space */
+static int snapshotWrite(SnapshotBuild *s, const char *buf) {
+    int got = 0;
+    int block = allocateDataExtent(s->goal, 1, &got);
+    if (block < 0) {
+        return -1;
+    }
+    if (snapshotTrack(&s->blocks, &s->nBlocks, &s->capBlocks, block) < 0) {
+        freeDataRun(block, 1);
+        return -1;
+    }
+    s->goal = block + 1;
+    cacheLock();
+    CacheEntry *e = cacheGet(block, 0);
+    memcpy(e->data, buf, FS_BLOCK_SIZE);
+    e->dirty = 1;
+    cacheUnlock();
+    return block;
+}
+
+static int snapshotCopyBlock(SnapshotBuild *s, int block) {
+    char buf[FS_BLOCK_SIZE];
+    cacheRead(block, buf);
+    return snapshotWrite(s, buf);
+}
+
+/* The snapshot takes a reference to a file's data block */
+static int snapshotShare(SnapshotBuild *s, int ptr) {
+    int block = PTR_BLOCK(ptr);
+    if (block == 0) {
+        return 0;  // the tail of a compressed group: no block of its own
+    }
+    if (refAdd(block) < 0) {
+        return -1;
+    }
+    if (snapshotTrack(&s->refs, &s->nRefs, &s->capRefs, block) < 0) {
+        refDrop(block);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Copy a pointer block of the given depth (1 = it points at data): a
+ * directory's blocks are copied along with it, a file's are shared.
+ * Returns the copy, -1 if out of space.
+ */
+static int snapshotCopyTree(SnapshotBuild *s, int block, int depth, int isDir) {
+    int ptrs[PTRS_PER_BLOCK];
+    cacheRead(block, (char *)ptrs);
+    for (int i = 0; i < PTRS_PER_BLOCK; i++) {
+        if (ptrs[i] < 0) continue;
+        if (depth > 1) {
+            ptrs[i] = snapshotCopyTree(s, ptrs[i], depth - 1, isDir);
+        } else if (isDir) {
+            ptrs[i] = snapshotCopyBlock(s, ptrs[i]);
+        } else if (snapshotShare(s, ptrs[i]) < 0) {
+            return -1;
+        }
+        if (ptrs[i] < 0) {
+            return -1;
+        }
+    }
+    return snapshotWrite(s, (char *)ptrs);
+}
+
+/* Point an inode's copy in the snapshot at copies of its metadata; its data is shared */
+static int snapshotCopyInode(SnapshotBuild *s, Inode *ino) {
+    if (ino->flags & INODE_INLINE) {
+        return 0;  // all in the inode
+    }
+    int isDir = (ino->flags & INODE_DIR) != 0;
+    for (int i = 0; i < NUM_DIRECT_POINTERS; i++) {
+        if (ino->dataBlocks[i] < 0) continue;
+        if (isDir ? (ino->dataBlocks[i] = snapshotCopyBlock(s, ino->dataBlocks[i])) < 0
+                  : snapshotShare(s, ino->dataBlocks[i]) < 0) {
+            return -1;
+        }
+    }
+    if (ino->indirectBlock >= 0 &&
+        (ino->indirectBlock = snapshotCopyTree(s, ino->indirectBlock, 1, isDir)) < 0) {
+        return -1;
+    }
+    if (ino->doubleIndirectBlock >= 0 &&
+        (ino->doubleIndirectBlock = snapshotCopyTree(s, ino->doubleIndirectBlock, 2, isDir)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Fill in table as a file of the n blocks in order, writing its pointer blocks */
+static int snapshotMapTable(SnapshotBuild *s, Inode *table, const int *blocks, int n) {
+    int ptrs[PTRS_PER_BLOCK], top[PTRS_PER_BLOCK];
+    memset(table, 0, sizeof(Inode));
+    table->size                = n * FS_BLOCK_SIZE;
+    table->indirectBlock       = -1;
+    table->doubleIndirectBlock = -1;
+    int at = 0;
+    for (int i = 0; i < NUM_DIRECT_POINTERS; i++) {
+        table->dataBlocks[i] = at < n ? blocks[at++] : -1;
+    }
+    if (at < n) {
+        memset(ptrs, 0xFF, sizeof(ptrs));
+        for (int k = 0; k < PTRS_PER_BLOCK && at < n; k++) ptrs[k] = blocks[at++];
+        if ((table->indirectBlock = snapshotWrite(s, (char *)ptrs)) < 0) return -1;
+    }
+    if (at < n) {
+        memset(top, 0xFF, sizeof(top));
+        for (int j = 0; j < PTRS_PER_BLOCK && at < n; j++) {
+            memset(ptrs, 0xFF, sizeof(ptrs));
+            for (int k = 0; k < PTRS_PER_BLOCK && at < n; k++) ptrs[k] = blocks[at++];
+            if ((top[j] = snapshotWrite(s, (char *)ptrs)) < 0) return -1;
+        }
+        if ((table->doubleIndirectBlock = snapshotWrite(s, (char *)top)) < 0) return -1;
+    }
+    return at < n ? -1 : 0;
+}
+
+static void superblockRead(Superblock *sb) {
+    cacheCopyOut(SUPERBLOCK_INDEX, 0, sb, sizeof(Superblock));
+}
+
+static void superblockWrite(const Superblock *sb) {
+    cacheLock();
+    CacheEntry *e = cacheGet(SUPERBLOCK_INDEX, 1);
+    memcpy(e->data, sb, sizeof(Superblock));
+    cacheDirtyMeta(e);
+    cacheUnlock();
+}
+
+/* FS_Snapshot with journalTxLock held for write */
+static int snapshotCreate(void) {
+    journalCommitLocked();  // the open files' inodes into the table, and the running work committed
+    Superblock sb;
+    superblockRead(&sb);
+    int slot = 0;
+    while (slot < FS_MAX_SNAPSHOTS && sb.snapshots[slot].id > 0) slot++;
+    int n = INODE_TABLE_BLOCKS + INODE_BITMAP_BLOCKS;
+    if (slot == FS_MAX_SNAPSHOTS || REFCOUNT_BLOCKS == 0 || (long long)n * FS_BLOCK_SIZE > FS_MAX_FILE_SIZE) {
+        return E_NO_SPACE;  // no free record, an image without reference counts, or a table too big
+    }
+    bitmapsEnsure();
+
+    SnapshotBuild s;
+    memset(&s, 0, sizeof(s));
+    s.goal = -1;
+    int *table = malloc(n * sizeof(int));
+    int rc = table != NULL ? 0 : -1;
+    char buf[FS_BLOCK_SIZE];
+
+    // the inode table, each inode in use repointed at its copy
+    for (int t = 0; t < INODE_TABLE_BLOCKS && rc == 0; t++) {
+        cacheRead(INODE_TABLE_START + t, buf);
+        for (int j = 0; j < INODES_PER_BLOCK && rc == 0; j++) {
+            int inodeIndex = t * INODES_PER_BLOCK + j;
+            if (inodeIndex < FS_NUM_INODES && bitmapTest(inodeBitmap, inodeIndex)) {
+                Inode ino;
+                memcpy(&ino, buf + j * sizeof(Inode), sizeof(Inode));
+                rc = snapshotCopyInode(&s, &ino);
+                memcpy(buf + j * sizeof(Inode), &ino, sizeof(Inode));
+            }
+        }
+        if (rc == 0) {
+            rc = (table[t] = snapshotWrite(&s, buf)) < 0 ? -1 : 0;
+        }
+    }
+    // then the inode bitmap
+    int words = BITMAP_WORDS(FS_NUM_INODES);
+    for (int b = 0; b < INODE_BITMAP_BLOCKS && rc == 0; b++) {
+        int first = b * BITMAP_WORDS_PER_BLOCK;
+        int count = words - first < BITMAP_WORDS_PER_BLOCK ? words - first : BITMAP_WORDS_PER_BLOCK;
+        memset(buf, 0, FS_BLOCK_SIZE);
+        memcpy(buf, inodeBitmap + first, count * sizeof(uint64_t));
+        rc = (table[INODE_TABLE_BLOCKS + b] = snapshotWrite(&s, buf)) < 0 ? -1 : 0;
+    }
+    Inode tableIno;
+    if (rc == 0) {
+        rc = snapshotMapTable(&s, &tableIno, table, n);
+    }
+
+    if (rc < 0) {
+        for (int i = 0; i < s.nRefs; i++) refDrop(s.refs[i]);
+        for (int i = 0; i < s.nBlocks; i++) freeDataRun(s.blocks[i], 1);
+    } else {
+        // committed with the references in one transaction (the copy is flushed first)
+        superblockRead(&sb);
+        sb.lastSnapshotId++;
+        sb.snapshots[slot].id    = sb.lastSnapshotId;
+        sb.snapshots[slot].table = tableIno;
+        superblockWrite(&sb);
+        __atomic_add_fetch(&snapshotCount, 1, __ATOMIC_RELAXED);
+        rc = sb.lastSnapshotId;
+    }
+    journalCommitLocked();
+    free(table);
+    free(s.blocks);
+    free(s.refs);
+    return rc < 0 ? E_NO_SPACE : rc;
+}
+
+/*
+ * FS_SnapshotDelete with journalTxLock held for write. The record goes in
+ * the same transaction as the blocks and references it releases.
+ */
+static int snapshotDelete(int id) {
+    journalCommitLocked();  // the running work first: the transaction is the snapshot's alone
+    bitmapsEnsure();  // with the reference counts, while the snapshot still counts
+    Superblock sb;
+    superblockRead(&sb);
+    int slot = 0;
+    while (slot < FS_MAX_SNAPSHOTS && (id <= 0 || sb.snapshots[slot].id != id)) slot++;
+    if (slot == FS_MAX_SNAPSHOTS) {
+        return E_NO_SUCH_FILE;
+    }
+    Inode table = sb.snapshots[slot].table;
+    memset(&sb.snapshots[slot], 0, sizeof(SnapshotRecord));
+    superblockWrite(&sb);
+    __atomic_sub_fetch(&snapshotCount, 1, __ATOMIC_RELAXED);
+
+    // the copied inode bitmap says which copied inodes to release
+    int words = BITMAP_WORDS(FS_NUM_INODES);
+    uint64_t *inUse = calloc(words, sizeof(uint64_t));
+    char buf[FS_BLOCK_SIZE];
+    for (int b = 0; b < INODE_BITMAP_BLOCKS && inUse != NULL; b++) {
+        int first = b * BITMAP_WORDS_PER_BLOCK;
+        int count = words - first < BITMAP_WORDS_PER_BLOCK ? words - first : BITMAP_WORDS_PER_BLOCK;
+        cacheRead(bmap(NULL, &table, INODE_TABLE_BLOCKS + b), buf);
+        memcpy(inUse + first, buf, count * sizeof(uint64_t));
+    }
+    // each one's copied metadata is freed, its shared data loses a reference
+    for (int t = 0; t < INODE_TABLE_BLOCKS && inUse != NULL; t++) {
+        cacheRead(bmap(NULL, &table, t), buf);
+        for (int j = 0; j < INODES_PER_BLOCK; j++) {
+            int inodeIndex = t * INODES_PER_BLOCK + j;
+            if (inodeIndex < FS_NUM_INODES && bitmapTest(inUse, inodeIndex)) {
+                Inode ino;
+                memcpy(&ino, buf + j * sizeof(Inode), sizeof(Inode));
+                freeInodeBlocks(&ino);
+            }
+        }
+    }
+    if (inUse != NULL) {
+        freeInodeBlocks(&table);
+    }
+    free(inUse);
+    journalCommitLocked();
+    return 0;
+}
+
+int FS_Snapshot(void) {
+    if (g_disk_path[0] == '\0') {
+        return E_DISK_ERROR;
+    }
+    if (readOnly) {
+        return E_READ_ONLY;
+    }
+    pthread_rwlock_wrlock(&journalTxLock);
+    int rc = snapshotCreate();
+    pthread_rwlock_unlock(&journalTxLock);
+    return rc;
+}
+
+int FS_SnapshotDelete(int id) {
+    if (g_disk_path[0] == '\0') {
+        return E_DISK_ERROR;
+    }
+    if (readOnly) {
+        return E_READ_ONLY;
+    }
+    pthread_rwlock_wrlock(&journalTxLock);
+    int rc = snapshotDelete(id);
+    pthread_rwlock_unlock(&journalTxLock);
+    return rc;
+}
+
+int FS_SnapshotList(int *ids, int max) {
+    if (g_disk_path[0] == '\0') {
+        return E_DISK_ERROR;
+    }
+    Superblock sb;
+    superblockRead(&sb);
+    int found[FS_MAX_SNAPSHOTS];
+    int n = 0;
+    for (int i = 0; i < FS_MAX_SNAPSHOTS; i++) {
+        if (sb.snapshots[i].id > 0) {
+            found[n++] = sb.snapshots[i].id;
+        }
+    }
+    qsort(found, n, sizeof(int), compareInt);
+    for (int i = 0; i < n && i < max && ids != NULL; i++) {
+        ids[i] = found[i];
+    }
+    return n;
+}
 
+/* Mount path, then switch to snapshot id: read-only from here to the next FS_Boot */
+int FS_BootSnapshot(char *path, int id) {
+    int rc = FS_Boot(path);
+    if (rc < 0) {
+        return rc;
+    }
+    Superblock sb;
+    superblockRead(&sb);
+    for (int i = 0; i < FS_MAX_SNAPSHOTS; i++) {
+        if (id > 0 && sb.snapshots[i].id == id) {
+            snapshotTable = sb.snapshots[i].table;
+            readOnly = 1;
+            dcacheReset();
+            return 0;
+        }
+    }
+    return E_NO_SUCH_FILE;  // the live file system stays mounted
+}
+
+/* ------------------------- */
+/*         FS_Stat()         */
+/* ------------------------- */
+
+int FS_Stat(FS_StatInfo *info) {
+    if (info == NULL || g_disk_path[0] == '\0') {
+        return E_DISK_ERROR;
+    }
+    info->blockSize   = FS_BLOCK_SIZE;
+    info->totalBlocks = FS_NUM_BLOCKS - DATA_BLOCK_START;
+    info->freeBlocks  = __atomic_load_n(&freeBlockCount, __ATOMIC_RELAXED);
+    info->totalInodes = FS_NUM_INODES;
+    info->freeInodes  = __atomic_load_n(&freeInodeCount, __ATOMIC_RELAXED);
+    info->maxFileSize = FS_MAX_FILE_SIZE;
     return 0;
 }
 
+/* ------------------------- */
+/*     FS_GetCacheStats()    */
+/* ------------------------- */
+
+void FS_GetCacheStats(FS_CacheStats *stats) {
+    if (stats != NULL) {
+        cacheLock();
+        *stats = cacheStats;
+        cacheUnlock();
+    }
+}
+
+/* ------------------------- */
+/*  FS_GetStats/FS_DumpStats */
+/* ------------------------- */
+
+void FS_GetStats(FS_Stats *stats) {
+    if (stats == NULL) {
+        return;
+    }
+    memset(stats, 0, sizeof(*stats));
+#ifdef TINYFS_STATS
+    stats->enabled = 1;
+    for (ThreadStats *t = __atomic_load_n(&statsList, __ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+        for (int op = 0; op < FS_STAT_OPS; op++) {
+            FS_LatencyStats *from = &t->ops[op], *to = &stats->ops[op];
+            to->calls   += __atomic_load_n(&from->calls, __ATOMIC_RELAXED);
+            to->totalNs += __atomic_load_n(&from->totalNs, __ATOMIC_RELAXED);
+            unsigned long max = __atomic_load_n(&from->maxNs, __ATOMIC_RELAXED);
+            if (max > to->maxNs) {
+                to->maxNs = max;
+            }
+            for (int b = 0; b < FS_STAT_BUCKETS; b++) {
+                to->buckets[b] += __atomic_load_n(&from->buckets[b], __ATOMIC_RELAXED);
+            }
+        }
+        for (int r = 0; r < FS_REGIONS; r++) {
+            stats->diskReads[r]  += __atomic_load_n(&t->diskReads[r], __ATOMIC_RELAXED);
+            stats->diskWrites[r] += __atomic_load_n(&t->diskWrites[r], __ATOMIC_RELAXED);
+        }
+        stats->lookups       += __atomic_load_n(&t->lookups, __ATOMIC_RELAXED);
+        stats->lookupEntries += __atomic_load_n(&t->lookupEntries, __ATOMIC_RELAXED);
+        stats->dcacheHits    += __atomic_load_n(&t->dcacheHits, __ATOMIC_RELAXED);
+        stats->dcacheMisses  += __atomic_load_n(&t->dcacheMisses, __ATOMIC_RELAXED);
+    }
+    FS_GetCacheStats(&stats->cache);
+#endif
+}
+
+void FS_DumpStats(FILE *out) {
+    static const char *opNames[FS_STAT_OPS] = { "create", "open", "read", "write", "close", "delete", "sync" };
+    static const char *regionNames[FS_REGIONS] = { "superblock", "bitmap", "journal", "inode_table", "data" };
+    FS_Stats st;
+    FS_GetStats(&st);
+    if (out == NULL) {
+        out = stderr;
+    }
+
+    fprintf(out, "stats.enabled %d\n", st.enabled);
+    for (int op = 0; op < FS_STAT_OPS; op++) {
+        const FS_LatencyStats *l = &st.ops[op];
+        fprintf(out, "op.%s.calls %lu\nop.%s.total_ns %lu\nop.%s.max_ns %lu\n",
+                opNames[op], l->calls, opNames[op], l->totalNs, opNames[op], l->maxNs);
+        for (int b = 0; b < FS_STAT_BUCKETS; b++) {
+            if (l->buckets[b] > 0) {
+                fprintf(out, "op.%s.hist_ns.%lu %lu\n", opNames[op], 1ul << b, l->buckets[b]);
+            }
+        }
+    }
+    for (int r = 0; r < FS_REGIONS; r++) {
+        fprintf(out, "disk.%s.reads %lu\ndisk.%s.writes %lu\n",
+                regionNames[r], st.diskReads[r], regionNames[r], st.diskWrites[r]);
+    }
+    fprintf(out, "lookup.calls %lu\nlookup.entries %lu\n", st.lookups, st.lookupEntries);
+    fprintf(out, "dcache.hits %lu\ndcache.misses %lu\n", st.dcacheHits, st.dcacheMisses);
+    fprintf(out, "cache.hits %lu\ncache.misses %lu\ncache.evictions %lu\ncache.writebacks %lu\ncache.readaheads %lu\n",
+            st.cache.hits, st.cache.misses, st.cache.evictions, st.cache.writebacks, st.cache.readaheads);
+}
+
+
+/* ------------------------- */
+/*         FS_Batch()        */
+/* ------------------------- */
+
+/*
+ * Runs ops in order as one unit for the journal: the whole batch counts as
+ * a single operation toward group commit, and the data blocks written by
+ * its closes are flushed once at the end instead of per close. Each op gets
+ * the return value of the call it stands for in result. An fd of
+ * FS_BATCH_LAST_OPEN refers to the fd of the latest FS_OP_OPEN in the batch.
+ * Stops at the first op that fails and returns the number of ops that
+ * succeeded (count when all of them did).
+ */
+int FS_Batch(FS_BatchOp *ops, int count) {
+    if (ops == NULL || count <= 0) {
+        return 0;
+    }
+
+    batchDepth++;
+    int lastOpen = E_BAD_FD;
+    int done = 0;
+    for (; done < count; done++) {
+        FS_BatchOp *op = &ops[done];
+        int fd = op->fd == FS_BATCH_LAST_OPEN ? lastOpen : op->fd;
+        switch (op->op) {
+        case FS_OP_CREATE: op->result = File_Create(op->file);                break;
+        case FS_OP_OPEN:   op->result = lastOpen = File_Open(op->file);       break;
+        case FS_OP_WRITE:  op->result = File_Write(fd, op->buffer, op->size); break;
+        case FS_OP_CLOSE:  op->result = File_Close(fd);                       break;
+        default:           op->result = E_BAD_FD;                             break;
+        }
+        if (op->result < 0) {
+            break;
+        }
+    }
+    batchDepth--;
+
+    // the batch's single journal operation, after its data is home
+    journalStart();
+    if (batchDepth == 0) {
+        cacheFlushData();
+    }
+    journalStop();
+    return done;
+}
+
+/* ------------------------- */
+/*     ASYNCHRONOUS I/O      */
+/* ------------------------- */
+
+/* The fd's busy flag, NULL for fds outside the table (they fail with E_BAD_FD anyway) */
+static unsigned char *asyncBusyFlag(int fd) {
+    int idx = fd - FD_OFFSET;
+    return idx >= 0 && idx < MAX_OPEN_FILES ? &asyncFdBusy[idx] : NULL;
+}
+
+/* Oldest queued request whose fd has nothing running; asyncMutex held */
+static AsyncRequest *asyncNextRunnable(void) {
+    for (int id = asyncOldest; id < asyncNextId; id++) {
+        AsyncRequest *r = &asyncQueue[id % ASYNC_QUEUE_DEPTH];
+        unsigned char *busy = asyncBusyFlag(r->fd);
+        if (r->id == id && r->state == ASYNC_QUEUED && (busy == NULL || !*busy)) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+/* Execute one request outside asyncMutex, then publish its result; asyncMutex held */
+static void asyncRun(AsyncRequest *r) {
+    unsigned char *busy = asyncBusyFlag(r->fd);
+    r->state = ASYNC_RUNNING;
+    if (busy != NULL) *busy = 1;
+    pthread_mutex_unlock(&asyncMutex);
+
+    int result = r->write ? File_Write(r->fd, r->buffer, r->size)
+                          : File_Read(r->fd, r->buffer, r->size);
+
+    pthread_mutex_lock(&asyncMutex);
+    r->result = result;
+    r->state  = ASYNC_DONE;
+    if (busy != NULL) *busy = 0;
+    pthread_cond_broadcast(&asyncDone);
+    pthread_cond_broadcast(&asyncWork);
+}
+
+/* Load the oldest queued read-ahead run into the cache; asyncMutex held */
+static void readAheadRun(void) {
+    Extent run = readAheadRuns[readAheadHead];
+    readAheadHead = (readAheadHead + 1) % READAHEAD_QUEUE;
+    readAheadCount--;
+    readAheadRunning++;
+    pthread_mutex_unlock(&asyncMutex);
+
+    for (int i = 0; i < run.len; i++) {
+        cachePrefetch(run.pblk + i);
+    }
+
+    pthread_mutex_lock(&asyncMutex);
+    readAheadRunning--;
+    pthread_cond_broadcast(&asyncDone);
+}
+
+static void *asyncWorker(void *unused) {
+    (void)unused;
+    pthread_mutex_lock(&asyncMutex);
+    for (;;) {
+        AsyncRequest *r = asyncNextRunnable();
+        if (r != NULL) {
+            asyncRun(r);
+        } else if (readAheadCount > 0) {
+            readAheadRun();
+        } else {
+            pthread_cond_wait(&asyncWork, &asyncMutex);
+        }
+    }
+    return NULL;
+}
+
+static void startAsyncWorkers(void) {
+    for (int i = 0; i < ASYNC_WORKERS; i++) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, asyncWorker, NULL) == 0) {
+            pthread_detach(t);
+            asyncWorkers++;
+        }
+    }
+}
+
+static int submitAsync(int write, int fd, void *buffer, int size, FS_AsyncCallback callback, void *arg) {
+    if (fdToFile(fd) == NULL) {
+        return E_BAD_FD;
+    }
+    pthread_once(&asyncOnce, startAsyncWorkers);
+
+    pthread_mutex_lock(&asyncMutex);
+    if (asyncNextId - asyncOldest >= ASYNC_QUEUE_DEPTH) {
+        pthread_mutex_unlock(&asyncMutex);
+        return E_QUEUE_FULL;
+    }
+    int id = asyncNextId++;
+    AsyncRequest *r = &asyncQueue[id % ASYNC_QUEUE_DEPTH];
+    r->id       = id;
+    r->state    = ASYNC_QUEUED;
+    r->waited   = 0;
+    r->write    = write;
+    r->fd       = fd;
+    r->buffer   = buffer;
+    r->size     = size;
+    r->result   = 0;
+    r->callback = callback;
+    r->arg      = arg;
+
+    if (asyncWorkers == 0) {
+        // no worker could be started: run it here, it still completes through the queue
+        asyncRun(r);
+    } else {
+        pthread_cond_signal(&asyncWork);
+    }
+    pthread_mutex_unlock(&asyncMutex);
+    return id;
+}
+
+/* Queue disk blocks pblk..pblk+len-1 for read-ahead; a full queue drops the run */
+static void readAheadQueue(int pblk, int len) {
+    pthread_once(&asyncOnce, startAsyncWorkers);
+    if (asyncWorkers == 0) {
+        return;
+    }
+    pthread_mutex_lock(&asyncMutex);
+    if (readAheadCount < READAHEAD_QUEUE) {
+        Extent *run = &readAheadRuns[(readAheadHead + readAheadCount) % READAHEAD_QUEUE];
+        run->lblk = 0;
+        run->pblk = pblk;
+        run->len  = len;
+        readAheadCount++;
+        pthread_cond_signal(&asyncWork);
+    }
+    pthread_mutex_unlock(&asyncMutex);
+}
+
+/* Drop queued read-ahead and wait out runs in flight (before FS_Boot resets the disk) */
+static void readAheadDrain(void) {
+    pthread_mutex_lock(&asyncMutex);
+    readAheadCount = 0;
+    while (readAheadRunning > 0) {
+        pthread_cond_wait(&asyncDone, &asyncMutex);
+    }
+    pthread_mutex_unlock(&asyncMutex);
+}
+
+int File_ReadAsync(int fd, void *buffer, int size, FS_AsyncCallback callback, void *arg) {
+    return submitAsync(0, fd, buffer, size, callback, arg);
+}
+
+int File_WriteAsync(int fd, void *buffer, int size, FS_AsyncCallback callback, void *arg) {
+    return submitAsync(1, fd, buffer, size, callback, arg);
+}
+
+/* Free a finished request's slot, keeping a copy for its callback; asyncMutex held */
+static AsyncRequest asyncReap(AsyncRequest *r) {
+    AsyncRequest done = *r;
+    r->id = 0;
+    while (asyncOldest < asyncNextId && asyncQueue[asyncOldest % ASYNC_QUEUE_DEPTH].id != asyncOldest) {
+        asyncOldest++;
+    }
+    return done;
+}
+
+static void asyncCallback(const AsyncRequest *r) {
+    if (r->callback != NULL) {
+        r->callback(r->id, r->result, r->arg);
+    }
+}
+
+int FS_PollAsync(void) {
+    AsyncRequest done[ASYNC_QUEUE_DEPTH];
+    int n = 0;
+
+    pthread_mutex_lock(&asyncMutex);
+    for (int id = asyncOldest; id < asyncNextId; id++) {
+        AsyncRequest *r = &asyncQueue[id % ASYNC_QUEUE_DEPTH];
+        if (r->id == id && r->state == ASYNC_DONE && !r->waited) {
+            done[n++] = asyncReap(r);
+        }
+    }
+    pthread_mutex_unlock(&asyncMutex);
+
+    // callbacks run unlocked: they may submit more requests
+    for (int i = 0; i < n; i++) {
+        asyncCallback(&done[i]);
+    }
+    return n;
+}
+
+int FS_WaitAsync(int request) {
+    pthread_mutex_lock(&asyncMutex);
+    AsyncRequest *r = &asyncQueue[(unsigned)request % ASYNC_QUEUE_DEPTH];
+    if (request < asyncOldest || request >= asyncNextId || r->id != request || r->waited) {
+        pthread_mutex_unlock(&asyncMutex);
+        return E_NO_SUCH_REQUEST;  // unknown, reaped already or another thread waits for it
+    }
+    r->waited = 1;
+    while (r->state != ASYNC_DONE) {
+        pthread_cond_wait(&asyncDone, &asyncMutex);
+    }
+    AsyncRequest done = asyncReap(r);
+    pthread_mutex_unlock(&asyncMutex);
+
+    asyncCallback(&done);
+    return done.result;
+}
@@ -5,15 +5,23 @@
 #ifndef __LibFS_h__
 #define __LibFS_h__
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 #define MAX_FILES 100 
-#define MAX_OPEN_FILES 5
-#define MAX_FILE_SIZE (BLOCK_SIZE * 5)
-#define NUM_DIRECT_POINTERS 5               // this filesystem only have direct pointers
-#define MAX_FILENAME_LENGTH 128
+#define MAX_OPEN_FILES 4096
+#define NUM_DIRECT_POINTERS 4               // direct pointers in each inode
+#define NUM_INDIRECT_POINTERS (BLOCK_SIZE / 4)  // pointers held by one indirect block
+// largest file of the default geometry (BLOCK_SIZE), kept within an int
+// offset; an image formatted with another block size has its own limit,
+// see FS_StatInfo.maxFileSize
+#define MAX_FILE_BLOCKS ((long long)NUM_DIRECT_POINTERS + NUM_INDIRECT_POINTERS + \
+                         (long long)NUM_INDIRECT_POINTERS * NUM_INDIRECT_POINTERS)
+#define MAX_FILE_SIZE (MAX_FILE_BLOCKS * BLOCK_SIZE < INT_MAX ? (int)(MAX_FILE_BLOCKS * BLOCK_SIZE) : \
+                       INT_MAX / BLOCK_SIZE * BLOCK_SIZE)
+#define MAX_FILENAME_LENGTH 128            // per path component
 
 #define E_FILE_EXISTS -2
 #define E_NO_SUCH_FILE -3
@@ -23,21 +31,176 @@
 #define E_FILE_TOO_BIG -7
 #define E_SEEK_OUT_OF_BOUNDS -8
 #define E_FILE_IN_USE -9
+#define E_BAD_ALIGNMENT -10
+#define E_QUEUE_FULL -11
+#define E_NO_SUCH_REQUEST -12
+#define E_NOT_A_DIRECTORY -13
+#define E_IS_A_DIRECTORY -14
+#define E_DIR_NOT_EMPTY -15
+#define E_READ_ONLY -16
+
+// block cache counters, see FS_GetCacheStats()
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long writebacks;
+    unsigned long readaheads;   // blocks loaded by sequential read-ahead
+} FS_CacheStats;
        
-// File system generic call
-int FS_Boot(char *path);
+// free-space summary, see FS_Stat()
+typedef struct {
+    int blockSize;
+    int totalBlocks;   // data blocks
+    int freeBlocks;
+    int totalInodes;
+    int freeInodes;
+    int maxFileSize;   // bytes, for the mounted geometry
+} FS_StatInfo;
+
+// geometry of a new file system, see FS_Format(); a field left 0 takes the
+// default (BLOCK_SIZE, NUM_BLOCKS, and MAX_FILES + 1 inodes)
+typedef struct {
+    int blockSize;   // a power of two, 512 ... 32768
+    int numBlocks;
+    int numInodes;   // files and directories, the root directory included
+} FS_Geometry;
+
+// File system generic calls (all calls but FS_Boot and FS_Format may be made from several threads)
+int FS_Boot(char *path);  // mount the image at path, or format one of the default geometry
+int FS_Format(char *path, const FS_Geometry *geometry);  // new empty file system at path, mounted
+int FS_Sync(void);  // write back cached state, then only the changed disk blocks
+int FS_Stat(FS_StatInfo *info);  // free-space summary, O(1); 0 or E_DISK_ERROR before FS_Boot
 
-// file ops
+// copy-on-write snapshots: FS_Snapshot freezes the whole file system as it is
+// now and returns the snapshot's id (> 0). It copies the metadata only; file
+// data stays shared until the live file system rewrites it. FS_BootSnapshot
+// mounts a snapshot read-only (changes fail with E_READ_ONLY). Taking and
+// deleting snapshots reach the image with the next FS_Sync, like any change.
+#define FS_MAX_SNAPSHOTS 8
+int FS_Snapshot(void);  // E_NO_SPACE if FS_MAX_SNAPSHOTS exist or the copy does not fit
+int FS_SnapshotDelete(int id);  // E_NO_SUCH_FILE if there is no snapshot id
+int FS_SnapshotList(int *ids, int max);  // ids, oldest first (up to max); returns how many exist
+int FS_BootSnapshot(char *path, int id);
+
+// file ops; names are '/'-separated paths below the root directory
 int File_Create(char *file);
 int File_Open(char *file);
 int File_Read(int fd, void *buffer, int size);
-int File_Write(int fd, void *buffer, int size);
+int File_Write(int fd, void *buffer, int size);  // fewer than size bytes if space runs out part of the way
 int File_Close(int fd);
 int File_Delete(char *file);
 
-// Only Graduate Students uncomment this
+// directory ops; Dir_Delete needs the directory to be empty
+int Dir_Create(char *path);
+int Dir_Delete(char *path);
+
+// preallocate (as unwritten, zero-reading blocks) out to size bytes; on
+// E_NO_SPACE the file may have grown part of the way
+int File_Allocate(int fd, int size);
+
+// per-file compression: while on, each full group of FS_COMPRESS_GROUP blocks
+// that was written is stored compressed when the file is closed (if that
+// saves a block). Reads decompress transparently (a group that does not
+// decompress fails the read with E_DISK_ERROR); off keeps what is stored.
+#define FS_COMPRESS_GROUP 8
+int File_SetCompression(int fd, int on);
+
+// per-file deduplication: while on, a whole block written with the same
+// contents as one already written since the mount shares that block
+int File_SetDedup(int fd, int on);
+
+// block-granular ops: count whole blocks at a block-aligned file pointer
+int File_ReadBlocks(int fd, void *buffer, int count);
+int File_WriteBlocks(int fd, void *buffer, int count);
+
+// scatter/gather: transfer the iovecs back to back at the file pointer in one call
+typedef struct {
+    void *base;
+    int   len;
+} FS_IoVec;
+int File_Readv(int fd, const FS_IoVec *iov, int iovcnt);
+int File_Writev(int fd, const FS_IoVec *iov, int iovcnt);
+
+// batched file ops, run in order as one journal operation; see FS_Batch()
+#define FS_OP_CREATE 1
+#define FS_OP_OPEN   2
+#define FS_OP_WRITE  3
+#define FS_OP_CLOSE  4
+#define FS_BATCH_LAST_OPEN -1   // fd: the one returned by the batch's latest FS_OP_OPEN
+
+typedef struct {
+    int   op;       // FS_OP_*
+    char *file;     // FS_OP_CREATE, FS_OP_OPEN
+    int   fd;       // FS_OP_WRITE, FS_OP_CLOSE
+    void *buffer;   // FS_OP_WRITE
+    int   size;     // FS_OP_WRITE
+    int   result;   // set to the op's return value
+} FS_BatchOp;
+int FS_Batch(FS_BatchOp *ops, int count);  // returns the number of ops that succeeded
+
+// move the file pointer to offset, which may be past the end: a write there
+// leaves a hole that reads back as zeros; 0 on success
 int File_Seek(int fd, int offset);
 
+// asynchronous I/O: the call is queued and returns a request id (> 0) at once;
+// worker threads run it, requests on one fd in submission order. The
+// callback (may be NULL) gets the File_Read/File_Write result and runs in
+// the thread that reaps the request with FS_PollAsync or FS_WaitAsync.
+// FS_PollAsync leaves a request some thread is waiting for to that waiter;
+// waiting for one already reaped or already waited for gives E_NO_SUCH_REQUEST.
+typedef void (*FS_AsyncCallback)(int request, int result, void *arg);
+int File_ReadAsync(int fd, void *buffer, int size, FS_AsyncCallback callback, void *arg);
+int File_WriteAsync(int fd, void *buffer, int size, FS_AsyncCallback callback, void *arg);
+int FS_PollAsync(void);         // reap finished requests without blocking; returns how many
+int FS_WaitAsync(int request);  // block until request finishes and reap it; returns its result
+
+// block cache instrumentation
+void FS_GetCacheStats(FS_CacheStats *stats);
+
+// call and I/O instrumentation, built in with -DTINYFS_STATS (make STATS=1).
+// Counts are per thread and summed by FS_GetStats, so keeping them costs no
+// shared writes; without TINYFS_STATS they are compiled out and read as 0.
+#define FS_STAT_CREATE 0
+#define FS_STAT_OPEN   1
+#define FS_STAT_READ   2
+#define FS_STAT_WRITE  3
+#define FS_STAT_CLOSE  4
+#define FS_STAT_DELETE 5
+#define FS_STAT_SYNC   6
+#define FS_STAT_OPS    7
+
+#define FS_REGION_SUPERBLOCK  0
+#define FS_REGION_BITMAP      1   // inode and data bitmaps, block reference counts
+#define FS_REGION_JOURNAL     2
+#define FS_REGION_INODE_TABLE 3
+#define FS_REGION_DATA        4
+#define FS_REGIONS            5
+
+#define FS_STAT_BUCKETS 32  // latency bucket i: [2^i, 2^(i+1)) ns; the last one takes everything longer
+
+typedef struct {
+    unsigned long calls;
+    unsigned long totalNs;
+    unsigned long maxNs;
+    unsigned long buckets[FS_STAT_BUCKETS];
+} FS_LatencyStats;
+
+typedef struct {
+    int             enabled;                   // 1 = built with TINYFS_STATS
+    FS_LatencyStats ops[FS_STAT_OPS];          // File_Create ... FS_Sync, by FS_STAT_*
+    unsigned long   diskReads[FS_REGIONS];     // blocks, by FS_REGION_*
+    unsigned long   diskWrites[FS_REGIONS];
+    unsigned long   lookups;                   // directory searches (dentry cache misses)
+    unsigned long   lookupEntries;             // directory entries they examined
+    unsigned long   dcacheHits;
+    unsigned long   dcacheMisses;
+    FS_CacheStats   cache;                     // as FS_GetCacheStats
+} FS_Stats;
+
+void FS_GetStats(FS_Stats *stats);
+void FS_DumpStats(FILE *out);  // FS_GetStats as "name value" lines; NULL = stderr
+
 #endif
 
 
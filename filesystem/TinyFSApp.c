@@ -1,4 +1,6 @@
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
 #include "TinyFS.h"
 #include "TinyDisk.h"
 
@@ -11,6 +13,55 @@ void custom_assert(int condition, char *msg, int expected, int actual) {
     }
 }
 
+/* Thread body for the concurrency test: own file round trip, then read the shared file */
+#define TEST_THREADS 4
+static char sharedOut[BLOCK_SIZE * 8];
+
+static void *thread_worker(void *arg) {
+    long id = (long)arg;
+    char name[32], out[BLOCK_SIZE * 3], in[BLOCK_SIZE * 8];
+    sprintf(name, "thread%ld.txt", id);
+    memset(out, 'a' + (int)id, sizeof(out));
+
+    long ok = File_Create(name) == 0;
+    int fd = File_Open(name);
+    ok = ok && File_Write(fd, out, sizeof(out)) == (int)sizeof(out);
+    File_Close(fd);
+    fd = File_Open(name);
+    ok = ok && File_Read(fd, in, sizeof(in)) == (int)sizeof(out) && memcmp(in, out, sizeof(out)) == 0;
+    File_Close(fd);
+    ok = ok && File_Delete(name) == 0;
+
+    fd = File_Open("shared.bin");
+    ok = ok && File_Read(fd, in, sizeof(in)) == (int)sizeof(sharedOut) && memcmp(in, sharedOut, sizeof(sharedOut)) == 0;
+    File_Close(fd);
+    return (void *)ok;
+}
+
+/* Completion callback for the async test: counts completions */
+static void async_done(int request, int result, void *arg) {
+    (void)request;
+    (void)result;
+    (*(int *)arg)++;
+}
+
+/* Callback and poller thread for reaping from two threads at once */
+static void async_count(int request, int result, void *arg) {
+    (void)request;
+    (void)result;
+    __atomic_add_fetch((int *)arg, 1, __ATOMIC_RELAXED);
+}
+
+static int pollerStop = 0;
+
+static void *async_poller(void *arg) {
+    (void)arg;
+    while (!__atomic_load_n(&pollerStop, __ATOMIC_ACQUIRE)) {
+        FS_PollAsync();
+    }
+    return NULL;
+}
+
 int main() {
     /* ------------------------------------------------------ *
      *                         FS_Boot                         *
@@ -63,6 +114,14 @@ int main() {
     custom_assert(read >= 0,"File_Read: reading from valid fd",0, read);
 
 
+    /* ------------------------------------------------------ *
+     *                    FS_GetCacheStats                     *
+     * ------------------------------------------------------ */
+    FS_CacheStats cstats;
+    FS_GetCacheStats(&cstats);
+    custom_assert(cstats.hits > 0, "FS_GetCacheStats: re-reading the inode hits the block cache", 1, (int)cstats.hits);
+
+
     /* ------------------------------------------------------ *
      *                         File_Close                      *
      * ------------------------------------------------------ */
@@ -115,6 +174,283 @@ int main() {
     custom_assert(result == E_BAD_FD, "File_Close: invalid fd returns E_BAD_FD", E_BAD_FD, result);
     
 
+    /* ------------------------------------------------------ *
+     *     Indirect blocks: file beyond the direct pointers   *
+     * ------------------------------------------------------ */
+    static char bigOut[BLOCK_SIZE * 40], bigIn[BLOCK_SIZE * 40];
+    for (int i = 0; i < (int)sizeof(bigOut); i++) {
+        bigOut[i] = (char)(i * 7);
+    }
+    File_Create("big.bin");
+    int fd_big = File_Open("big.bin");
+    result = File_Write(fd_big, bigOut, sizeof(bigOut));
+    custom_assert(result == (int)sizeof(bigOut), "File_Write: write past the direct pointers", (int)sizeof(bigOut), result);
+    File_Close(fd_big);
+
+    fd_big = File_Open("big.bin");
+    result = File_Read(fd_big, bigIn, sizeof(bigIn));
+    custom_assert(result == (int)sizeof(bigIn) && memcmp(bigIn, bigOut, sizeof(bigIn)) == 0,
+                  "File_Read: read back through the indirect block", (int)sizeof(bigIn), result);
+    File_Close(fd_big);
+    File_Delete("big.bin");
+
+
+    /* ------------------------------------------------------ *
+     *     File_WriteBlocks / File_ReadBlocks                 *
+     * ------------------------------------------------------ */
+    File_Create("blocks.bin");
+    int fd_blk = File_Open("blocks.bin");
+    result = File_WriteBlocks(fd_blk, bigOut, 4);
+    custom_assert(result == 4 * BLOCK_SIZE, "File_WriteBlocks: write 4 whole blocks", 4 * BLOCK_SIZE, result);
+    File_Write(fd_blk, "x", 1);
+    result = File_WriteBlocks(fd_blk, bigOut, 1);
+    custom_assert(result == E_BAD_ALIGNMENT, "File_WriteBlocks: unaligned file pointer returns E_BAD_ALIGNMENT", E_BAD_ALIGNMENT, result);
+    File_Close(fd_blk);
+
+    fd_blk = File_Open("blocks.bin");
+    memset(bigIn, 0, sizeof(bigIn));
+    result = File_ReadBlocks(fd_blk, bigIn, 4);
+    custom_assert(result == 4 * BLOCK_SIZE && memcmp(bigIn, bigOut, 4 * BLOCK_SIZE) == 0,
+                  "File_ReadBlocks: read 4 whole blocks back", 4 * BLOCK_SIZE, result);
+    File_Close(fd_blk);
+    File_Delete("blocks.bin");
+
+
+    /* ------------------------------------------------------ *
+     *     File_Allocate: unwritten blocks read as zeros      *
+     * ------------------------------------------------------ */
+    File_Create("prealloc.bin");
+    int fd_pre = File_Open("prealloc.bin");
+    result = File_Allocate(fd_pre, 3 * BLOCK_SIZE);
+    custom_assert(result == 0, "File_Allocate: preallocate 3 blocks", 0, result);
+    File_Write(fd_pre, "head", 4);
+    File_Close(fd_pre);
+
+    fd_pre = File_Open("prealloc.bin");
+    memset(bigIn, 0x55, sizeof(bigIn));
+    result = File_Read(fd_pre, bigIn, sizeof(bigIn));
+    int zeros = 1;
+    for (int i = 4; i < 3 * BLOCK_SIZE; i++) {
+        if (bigIn[i] != 0) zeros = 0;
+    }
+    custom_assert(result == 3 * BLOCK_SIZE && memcmp(bigIn, "head", 4) == 0 && zeros,
+                  "File_Read: preallocated blocks read back as zeros", 3 * BLOCK_SIZE, result);
+    File_Close(fd_pre);
+    File_Delete("prealloc.bin");
+
+
+    /* ------------------------------------------------------ *
+     *     Concurrent calls from several threads              *
+     * ------------------------------------------------------ */
+    for (int i = 0; i < (int)sizeof(sharedOut); i++) {
+        sharedOut[i] = (char)(i * 13);
+    }
+    File_Create("shared.bin");
+    int fd_shared = File_Open("shared.bin");
+    File_Write(fd_shared, sharedOut, sizeof(sharedOut));
+    File_Close(fd_shared);
+
+    pthread_t threads[TEST_THREADS];
+    for (long i = 0; i < TEST_THREADS; i++) {
+        pthread_create(&threads[i], NULL, thread_worker, (void *)i);
+    }
+    int threads_ok = 0;
+    for (int i = 0; i < TEST_THREADS; i++) {
+        void *ok;
+        pthread_join(threads[i], &ok);
+        threads_ok += ok != NULL;
+    }
+    custom_assert(threads_ok == TEST_THREADS, "Threads: concurrent create/write/read/delete and shared reads", TEST_THREADS, threads_ok);
+    File_Delete("shared.bin");
+
+
+    /* ------------------------------------------------------ *
+     *     Asynchronous reads and writes                      *
+     * ------------------------------------------------------ */
+    static char asyncOut[BLOCK_SIZE * 4], asyncIn[BLOCK_SIZE * 4];
+    for (int i = 0; i < (int)sizeof(asyncOut); i++) {
+        asyncOut[i] = (char)(i * 7 + 1);
+    }
+    int callbacks = 0;
+    File_Create("async.bin");
+    int fd_async = File_Open("async.bin");
+    // two writes queued back to back on one fd must land in submission order
+    int w1 = File_WriteAsync(fd_async, asyncOut, BLOCK_SIZE * 3, async_done, &callbacks);
+    int w2 = File_WriteAsync(fd_async, asyncOut + BLOCK_SIZE * 3, BLOCK_SIZE, async_done, &callbacks);
+    result = FS_WaitAsync(w2);
+    while (callbacks < 2) {
+        FS_PollAsync();
+    }
+    File_Close(fd_async);
+    custom_assert(w1 > 0 && w2 > 0 && result == BLOCK_SIZE && FS_WaitAsync(w1) == E_NO_SUCH_REQUEST,
+                  "File_WriteAsync: queued writes complete and are reaped once", BLOCK_SIZE, result);
+
+    fd_async = File_Open("async.bin");
+    int r1 = File_ReadAsync(fd_async, asyncIn, sizeof(asyncIn), async_done, &callbacks);
+    result = FS_WaitAsync(r1);
+    File_Close(fd_async);
+    custom_assert(result == (int)sizeof(asyncIn) && memcmp(asyncIn, asyncOut, sizeof(asyncOut)) == 0 && callbacks == 3,
+                  "File_ReadAsync: reads back the async writes, one callback per request", (int)sizeof(asyncIn), result);
+
+    // with FS_PollAsync running in another thread every request is reaped exactly once:
+    // by the poller if it finished before the wait began, else by FS_WaitAsync
+    pthread_t poller;
+    int counted = 0, waitedOk = 1;
+    pthread_create(&poller, NULL, async_poller, NULL);
+    fd_async = File_Open("async.bin");
+    for (int i = 0; i < 2000; i++) {
+        int w = File_WriteAsync(fd_async, asyncOut, 64, async_count, &counted);
+        int waited = FS_WaitAsync(w);
+        waitedOk = waitedOk && w > 0 && (waited == 64 || waited == E_NO_SUCH_REQUEST);
+    }
+    __atomic_store_n(&pollerStop, 1, __ATOMIC_RELEASE);
+    pthread_join(poller, NULL);
+    File_Close(fd_async);
+    custom_assert(waitedOk && counted == 2000, "FS_WaitAsync: reaps its request once while another thread polls",
+                  2000, counted);
+    File_Delete("async.bin");
+
+
+    /* ------------------------------------------------------ *
+     *     Vectored and batched operations                    *
+     * ------------------------------------------------------ */
+    // header and payload pieces that straddle block boundaries
+    static char vecOut[BLOCK_SIZE * 3], vecIn[BLOCK_SIZE * 3];
+    for (int i = 0; i < (int)sizeof(vecOut); i++) {
+        vecOut[i] = (char)(i * 11 + 3);
+    }
+    FS_IoVec wv[3] = { { vecOut, 100 }, { vecOut + 100, BLOCK_SIZE }, { vecOut + 100 + BLOCK_SIZE, BLOCK_SIZE * 2 - 100 } };
+    File_Create("vec.bin");
+    int fd_vec = File_Open("vec.bin");
+    result = File_Writev(fd_vec, wv, 3);
+    File_Close(fd_vec);
+    fd_vec = File_Open("vec.bin");
+    FS_IoVec rv[2] = { { vecIn, 7 }, { vecIn + 7, (int)sizeof(vecIn) } };
+    int readv = File_Readv(fd_vec, rv, 2);
+    File_Close(fd_vec);
+    custom_assert(result == (int)sizeof(vecOut) && readv == (int)sizeof(vecIn) && memcmp(vecIn, vecOut, sizeof(vecOut)) == 0,
+                  "File_Writev/File_Readv: gathered pieces read back scattered", (int)sizeof(vecOut), readv);
+    File_Delete("vec.bin");
+
+    FS_BatchOp batch[] = {
+        { FS_OP_CREATE, "batch.bin", 0, NULL, 0, 0 },
+        { FS_OP_OPEN,   "batch.bin", 0, NULL, 0, 0 },
+        { FS_OP_WRITE,  NULL, FS_BATCH_LAST_OPEN, vecOut, 300, 0 },
+        { FS_OP_WRITE,  NULL, FS_BATCH_LAST_OPEN, vecOut + 300, 400, 0 },
+        { FS_OP_CLOSE,  NULL, FS_BATCH_LAST_OPEN, NULL, 0, 0 },
+        { FS_OP_CREATE, "batch.bin", 0, NULL, 0, 0 },
+    };
+    result = FS_Batch(batch, 6);
+    int fd_batch = File_Open("batch.bin");
+    int batchRead = File_Read(fd_batch, vecIn, sizeof(vecIn));
+    File_Close(fd_batch);
+    custom_assert(result == 5 && batch[5].result == E_FILE_EXISTS && batchRead == 700 && memcmp(vecIn, vecOut, 700) == 0,
+                  "FS_Batch: runs ops in order and stops at the first failure", 5, result);
+    File_Delete("batch.bin");
+
+
+    /* ------------------------------------------------------ *
+     *     Sequential read-ahead and File_Seek                *
+     * ------------------------------------------------------ */
+    static char scanOut[BLOCK_SIZE * 16], scanIn[BLOCK_SIZE * 16];
+    for (int i = 0; i < (int)sizeof(scanOut); i++) {
+        scanOut[i] = (char)(i * 5 + 2);
+    }
+    File_Create("scan.bin");
+    int fd_scan = File_Open("scan.bin");
+    File_Write(fd_scan, scanOut, sizeof(scanOut));
+    File_Close(fd_scan);
+    FS_Sync();
+    FS_Boot("filesystem.img");  // an empty cache: only read-ahead can bring the next blocks in
+
+    FS_CacheStats before, after;
+    FS_GetCacheStats(&before);
+    fd_scan = File_Open("scan.bin");
+    int scanned = File_Read(fd_scan, scanIn, 100);
+    // the first read queues the blocks after it; wait for the async workers to load
+    // them before reading on, or the reader would cache them first
+    for (int i = 0; i < 10000000; i++) {
+        FS_GetCacheStats(&after);
+        if (after.readaheads > before.readaheads) break;
+        sched_yield();
+    }
+    for (int n; (n = File_Read(fd_scan, scanIn + scanned, 100)) > 0; ) {
+        scanned += n;
+    }
+    custom_assert(scanned == (int)sizeof(scanOut) && memcmp(scanIn, scanOut, sizeof(scanOut)) == 0 && after.readaheads > before.readaheads,
+                  "File_Read: small sequential reads trigger read-ahead", 1, (int)(after.readaheads - before.readaheads));
+
+    result = File_Seek(fd_scan, -1);
+    custom_assert(result == E_SEEK_OUT_OF_BOUNDS, "File_Seek: a negative offset returns E_SEEK_OUT_OF_BOUNDS", E_SEEK_OUT_OF_BOUNDS, result);
+    result = File_Seek(fd_scan, (int)sizeof(scanOut) + 1);
+    int pastRead = File_Read(fd_scan, scanIn, 50);
+    custom_assert(result == 0 && pastRead == 0, "File_Seek: past the end is allowed and reads nothing", 0, pastRead);
+    result = File_Seek(fd_scan, BLOCK_SIZE * 5 + 7);
+    int seekRead = File_Read(fd_scan, scanIn, 50);
+    custom_assert(result == 0 && seekRead == 50 && memcmp(scanIn, scanOut + BLOCK_SIZE * 5 + 7, 50) == 0,
+                  "File_Seek: reads continue at the new offset", 0, result);
+    File_Close(fd_scan);
+    File_Delete("scan.bin");
+
+
+    /* ------------------------------------------------------ *
+     *     Inline small files                                 *
+     * ------------------------------------------------------ */
+    // a tiny file lives in its inode, then spills to a block when it grows
+    static char tinyOut[BLOCK_SIZE], tinyIn[BLOCK_SIZE];
+    for (int i = 0; i < (int)sizeof(tinyOut); i++) {
+        tinyOut[i] = (char)(i * 3 + 9);
+    }
+    File_Create("tiny");
+    int fd_tiny = File_Open("tiny");
+    result = File_Write(fd_tiny, tinyOut, 20);
+    File_Close(fd_tiny);
+    fd_tiny = File_Open("tiny");
+    int tinyRead = File_Read(fd_tiny, tinyIn, sizeof(tinyIn));
+    custom_assert(result == 20 && tinyRead == 20 && memcmp(tinyIn, tinyOut, 20) == 0,
+                  "File_Write: small file round trip stored inline", 20, tinyRead);
+
+    File_Seek(fd_tiny, 20);
+    File_Write(fd_tiny, tinyOut + 20, sizeof(tinyOut) - 20);
+    File_Seek(fd_tiny, 0);
+    tinyRead = File_Read(fd_tiny, tinyIn, sizeof(tinyIn));
+    File_Close(fd_tiny);
+    custom_assert(tinyRead == (int)sizeof(tinyOut) && memcmp(tinyIn, tinyOut, sizeof(tinyOut)) == 0,
+                  "File_Write: growing an inline file moves it to data blocks", (int)sizeof(tinyOut), tinyRead);
+    File_Delete("tiny");
+
+
+    /* ------------------------------------------------------ *
+     *     Directories and paths                              *
+     * ------------------------------------------------------ */
+    result = Dir_Create("docs");
+    int sub = Dir_Create("/docs/notes");
+    File_Create("docs/notes/todo.txt");
+    int fd_path = File_Open("docs//notes/todo.txt");
+    File_Write(fd_path, "buy milk", 8);
+    File_Close(fd_path);
+    fd_path = File_Open("/docs/notes/todo.txt");
+    char pathBuf[16] = {0};
+    int pathRead = File_Read(fd_path, pathBuf, sizeof(pathBuf));
+    File_Close(fd_path);
+    custom_assert(result == 0 && sub == 0 && pathRead == 8 && memcmp(pathBuf, "buy milk", 8) == 0,
+                  "Dir_Create/File_Open: files resolve through nested directories", 8, pathRead);
+
+    result = File_Create("docs/missing/x.txt");
+    custom_assert(result == E_NO_SUCH_FILE, "File_Create: missing parent directory returns E_NO_SUCH_FILE", E_NO_SUCH_FILE, result);
+    result = File_Create("docs/notes/todo.txt/x");
+    custom_assert(result == E_NOT_A_DIRECTORY, "File_Create: file used as a directory returns E_NOT_A_DIRECTORY", E_NOT_A_DIRECTORY, result);
+    result = File_Open("docs");
+    custom_assert(result == E_IS_A_DIRECTORY, "File_Open: opening a directory returns E_IS_A_DIRECTORY", E_IS_A_DIRECTORY, result);
+    result = Dir_Delete("docs");
+    custom_assert(result == E_DIR_NOT_EMPTY, "Dir_Delete: non-empty directory returns E_DIR_NOT_EMPTY", E_DIR_NOT_EMPTY, result);
+
+    File_Delete("docs/notes/todo.txt");
+    Dir_Delete("docs/notes");
+    result = Dir_Delete("docs");
+    custom_assert(result == 0, "Dir_Delete: empty directories are removed", 0, result);
+
+
     /* ------------------------------------------------------ *
      *     E_TOO_MANY_OPEN_FILES test                         *
      * ------------------------------------------------------ */
@@ -129,12 +465,25 @@ int main() {
         custom_assert(fds[i] >= 0, "File_Open: open file for limit test", 0, fds[i]);
     }
     
-    // Try to open a 6th file
+    // Fill the rest of the open file table by opening a 6th file over and over
     result = File_Create("file6.txt");
     custom_assert(result == 0, "File_Create: create 6th file", 0, result);
-    
+
+    static int extra_fds[MAX_OPEN_FILES];
+    int extra = 0;
+    while (extra < MAX_OPEN_FILES && (extra_fds[extra] = File_Open("file6.txt")) >= 0) {
+        extra++;
+    }
+    custom_assert(extra == MAX_OPEN_FILES - 5, "File_Open: open files up to MAX_OPEN_FILES", MAX_OPEN_FILES - 5, extra);
+
     int fd_overflow = File_Open("file6.txt");
-    custom_assert(fd_overflow == E_TOO_MANY_OPEN_FILES, "File_Open: opening 6th file returns E_TOO_MANY_OPEN_FILES", E_TOO_MANY_OPEN_FILES, fd_overflow);
+    custom_assert(fd_overflow == E_TOO_MANY_OPEN_FILES, "File_Open: opening past MAX_OPEN_FILES returns E_TOO_MANY_OPEN_FILES", E_TOO_MANY_OPEN_FILES, fd_overflow);
+
+    result = File_Delete("file6.txt");
+    custom_assert(result == E_FILE_IN_USE, "File_Delete: file open on many fds returns E_FILE_IN_USE", E_FILE_IN_USE, result);
+    for (int i = 0; i < extra; i++) {
+        File_Close(extra_fds[i]);
+    }
     
     for (int i = 0; i < 5; i++) {
         File_Close(fds[i]);
@@ -173,5 +522,345 @@ int main() {
         File_Delete(filename);
     }
 
+
+    /* ------------------------------------------------------ *
+     *     FS_Format: geometry chosen at format time          *
+     * ------------------------------------------------------ */
+    FS_Geometry badGeometry = { 1000, 5000, 300 };
+    result = FS_Format("geometry.img", &badGeometry);
+    custom_assert(result == E_DISK_ERROR, "FS_Format: block size that is not a power of two is refused", E_DISK_ERROR, result);
+
+    // more blocks and inodes than one bitmap block holds at the default block size
+    FS_Geometry geometry = { 0, BLOCK_SIZE * 8 + 1000, MAX_FILES * 2 + 1 };
+    result = FS_Format("geometry.img", &geometry);
+    int geoCreated = 0;
+    for (int i = 0; i < MAX_FILES * 2 && result == 0; i++) {
+        char filename[30];
+        sprintf(filename, "geo_%d.txt", i);
+        geoCreated += File_Create(filename) == 0;
+    }
+    int fd_geo = File_Open("geo_0.txt");
+    File_Write(fd_geo, bigOut, BLOCK_SIZE * 40);
+    File_Close(fd_geo);
+    FS_Sync();
+    FS_Boot("geometry.img");
+    fd_geo = File_Open("geo_0.txt");
+    memset(bigIn, 0, sizeof(bigIn));
+    int geoRead = File_Read(fd_geo, bigIn, BLOCK_SIZE * 40);
+    File_Close(fd_geo);
+    custom_assert(result == 0 && geoCreated == MAX_FILES * 2 && geoRead == BLOCK_SIZE * 40 &&
+                  memcmp(bigIn, bigOut, BLOCK_SIZE * 40) == 0,
+                  "FS_Format: custom geometry holds more files and mounts again", MAX_FILES * 2, geoCreated);
+
+    /* ------------------------------------------------------ *
+     *     Lazy mount: bitmaps read in by the first write     *
+     * ------------------------------------------------------ */
+    // geometry.img was just mounted: the first allocation must see geo_0.txt's blocks as taken
+    fd_geo = File_Open("geo_1.txt");
+    int lazyWritten = File_Write(fd_geo, bigIn + BLOCK_SIZE, BLOCK_SIZE * 39);
+    File_Close(fd_geo);
+    fd_geo = File_Open("geo_0.txt");
+    memset(bigIn, 0, sizeof(bigIn));
+    geoRead = File_Read(fd_geo, bigIn, BLOCK_SIZE * 40);
+    File_Close(fd_geo);
+    custom_assert(lazyWritten == BLOCK_SIZE * 39 && geoRead == BLOCK_SIZE * 40 &&
+                  memcmp(bigIn, bigOut, BLOCK_SIZE * 40) == 0,
+                  "Lazy mount: new blocks do not overwrite a file from before the mount", BLOCK_SIZE * 39, lazyWritten);
+
+    /* ------------------------------------------------------ *
+     *     FS_Stat: free-space counters                       *
+     * ------------------------------------------------------ */
+    FS_StatInfo stBefore, stWritten, stMounted, stDeleted;
+    FS_Stat(&stBefore);  // every inode is in use, the root's and geo_*.txt
+    int fd_stat = File_Open("geo_2.txt");
+    File_Write(fd_stat, bigOut, BLOCK_SIZE * 3);
+    File_Close(fd_stat);
+    FS_Stat(&stWritten);
+    FS_Sync();
+    FS_Boot("geometry.img");
+    FS_Stat(&stMounted);  // from the superblock: nothing has read the bitmaps yet
+    File_Delete("geo_2.txt");
+    FS_Stat(&stDeleted);
+    custom_assert(stBefore.freeInodes == 0 && stWritten.freeBlocks == stBefore.freeBlocks - 3 &&
+                  stMounted.freeInodes == stWritten.freeInodes && stMounted.freeBlocks == stWritten.freeBlocks &&
+                  stDeleted.freeInodes == 1 && stDeleted.freeBlocks == stBefore.freeBlocks,
+                  "FS_Stat: counts follow allocation, survive a mount and come back on delete",
+                  stBefore.freeBlocks - 3, stWritten.freeBlocks);
+    custom_assert(stBefore.maxFileSize == MAX_FILE_SIZE,
+                  "FS_Stat: the default geometry's file size limit is MAX_FILE_SIZE", MAX_FILE_SIZE, stBefore.maxFileSize);
+
+    /* ------------------------------------------------------ *
+     *     Large directories: the index grows a level         *
+     * ------------------------------------------------------ */
+    // more names than full leaves under one index block can hold (20-byte entries, 8-byte index entries)
+    int wideLeaves = (BLOCK_SIZE - 8) / 8, wideCount = (wideLeaves + 1) * (BLOCK_SIZE / 20);
+    FS_Geometry wideGeometry = { 0, wideCount * 96 / BLOCK_SIZE + 500, wideCount + 2 };
+    FS_Format("geometry.img", &wideGeometry);
+    Dir_Create("wide");
+    int wideCreated = 0;
+    for (int i = 0; i < wideCount; i++) {
+        char filename[30];
+        sprintf(filename, "wide/entry_%d", i);
+        wideCreated += File_Create(filename) == 0;
+    }
+    FS_Sync();
+    FS_Boot("geometry.img");  // lookups from the disk, not the dentry cache
+    int wideFound = 0, wideDeleted = 0;
+    for (int i = 0; i < wideCount; i++) {
+        char filename[30];
+        sprintf(filename, "wide/entry_%d", i);
+        wideFound   += File_Create(filename) == E_FILE_EXISTS;
+        wideDeleted += File_Delete(filename) == 0;
+    }
+    result = Dir_Delete("wide");
+    custom_assert(wideCreated == wideCount && wideFound == wideCount && wideDeleted == wideCount && result == 0,
+                  "Dir_Create: a directory grows past one index block of leaves", wideCount, wideCreated);
+
+    /* ------------------------------------------------------ *
+     *     FS_Snapshot: copy-on-write snapshots               *
+     * ------------------------------------------------------ */
+    FS_Geometry snapGeometry = { 0, 1024, 64 };
+    FS_Format("snapshot.img", &snapGeometry);
+    Dir_Create("snap");
+    File_Create("snap/a.txt");
+    File_Create("snap/b.txt");
+    int fd_snap = File_Open("snap/a.txt");
+    File_Write(fd_snap, bigOut, BLOCK_SIZE * 20);
+    File_Close(fd_snap);
+    FS_StatInfo stSnapBase, stSnapTaken, stSnapGone;
+    FS_Stat(&stSnapBase);
+    int snapId = FS_Snapshot();
+    FS_Stat(&stSnapTaken);
+
+    // change the live file system: overwrite part of a.txt, append to it, delete b.txt
+    char snapNew[BLOCK_SIZE];
+    memset(snapNew, 'S', sizeof(snapNew));
+    fd_snap = File_Open("snap/a.txt");
+    File_Seek(fd_snap, BLOCK_SIZE * 3 + 100);
+    File_Write(fd_snap, snapNew, BLOCK_SIZE);
+    File_Seek(fd_snap, BLOCK_SIZE * 20);
+    File_Write(fd_snap, snapNew, BLOCK_SIZE);
+    File_Close(fd_snap);
+    File_Delete("snap/b.txt");
+    FS_Sync();
+
+    // the snapshot still has the old contents, and refuses changes
+    result = FS_BootSnapshot("snapshot.img", snapId);
+    fd_snap = File_Open("snap/a.txt");
+    memset(bigIn, 0, sizeof(bigIn));
+    int snapRead = File_Read(fd_snap, bigIn, BLOCK_SIZE * 40);
+    int snapWrite = File_Write(fd_snap, snapNew, 1);
+    File_Close(fd_snap);
+    int snapOld = File_Open("snap/b.txt");
+    File_Close(snapOld);
+    int snapCreate = File_Create("snap/c.txt");
+    custom_assert(result == 0 && snapId > 0 && snapRead == BLOCK_SIZE * 20 && memcmp(bigIn, bigOut, BLOCK_SIZE * 20) == 0 &&
+                  snapOld >= 0 && snapWrite == E_READ_ONLY && snapCreate == E_READ_ONLY &&
+                  stSnapTaken.freeBlocks < stSnapBase.freeBlocks,
+                  "FS_BootSnapshot: a snapshot keeps the old files, read-only", BLOCK_SIZE * 20, snapRead);
+
+    // the live file system has the new ones
+    FS_Boot("snapshot.img");
+    fd_snap = File_Open("snap/a.txt");
+    memset(bigIn, 0, sizeof(bigIn));
+    snapRead = File_Read(fd_snap, bigIn, BLOCK_SIZE * 40);
+    File_Close(fd_snap);
+    int liveOk = snapRead == BLOCK_SIZE * 21 && memcmp(bigIn, bigOut, BLOCK_SIZE * 3 + 100) == 0 &&
+                 memcmp(bigIn + BLOCK_SIZE * 3 + 100, snapNew, BLOCK_SIZE) == 0 &&
+                 memcmp(bigIn + BLOCK_SIZE * 4 + 100, bigOut + BLOCK_SIZE * 4 + 100, BLOCK_SIZE * 16 - 100) == 0 &&
+                 memcmp(bigIn + BLOCK_SIZE * 20, snapNew, BLOCK_SIZE) == 0 &&
+                 File_Open("snap/b.txt") == E_NO_SUCH_FILE;
+    custom_assert(liveOk, "FS_Snapshot: writes after a snapshot go to new blocks of the live files", BLOCK_SIZE * 21, snapRead);
+
+    // deleting the snapshot gives its blocks back
+    int snapIds[FS_MAX_SNAPSHOTS];
+    int snapListed = FS_SnapshotList(snapIds, FS_MAX_SNAPSHOTS);
+    result = FS_SnapshotDelete(snapId);
+    File_Delete("snap/a.txt");
+    FS_Stat(&stSnapGone);
+    custom_assert(snapListed == 1 && snapIds[0] == snapId && result == 0 &&
+                  FS_SnapshotList(NULL, 0) == 0 && FS_SnapshotDelete(snapId) == E_NO_SUCH_FILE &&
+                  stSnapGone.freeBlocks == stSnapBase.freeBlocks + 21,
+                  "FS_SnapshotDelete: the snapshot's blocks are free again", stSnapBase.freeBlocks + 21, stSnapGone.freeBlocks);
+
+    /* ------------------------------------------------------ *
+     *     File_SetCompression: compressed block groups       *
+     * ------------------------------------------------------ */
+    static char text[BLOCK_SIZE * 32], textIn[BLOCK_SIZE * 32];
+    for (int i = 0; i < (int)sizeof(text); i++) {
+        text[i] = "the quick brown fox jumps over the lazy dog\n"[i % 44];
+    }
+    FS_Format("snapshot.img", &snapGeometry);
+    FS_StatInfo stPlain, stPacked;
+    FS_Stat(&stPlain);
+    File_Create("text.txt");
+    int fd_text = File_Open("text.txt");
+    int compressOn = File_SetCompression(fd_text, 1);
+    File_Write(fd_text, text, sizeof(text));
+    File_Close(fd_text);
+    FS_Stat(&stPacked);
+    int packedBlocks = stPlain.freeBlocks - stPacked.freeBlocks;
+
+    // rewrite a stretch in the middle, then read it all back after a remount
+    memset(text + BLOCK_SIZE * 9 + 7, '#', BLOCK_SIZE);
+    fd_text = File_Open("text.txt");
+    File_Seek(fd_text, BLOCK_SIZE * 9 + 7);
+    File_Write(fd_text, text + BLOCK_SIZE * 9 + 7, BLOCK_SIZE);
+    File_Close(fd_text);
+    FS_Sync();
+    FS_Boot("snapshot.img");
+    fd_text = File_Open("text.txt");
+    int textRead = File_Read(fd_text, textIn, sizeof(textIn));
+    File_Close(fd_text);
+    custom_assert(compressOn == 0 && packedBlocks < 32 / 4 && textRead == (int)sizeof(text) &&
+                  memcmp(textIn, text, sizeof(text)) == 0,
+                  "File_SetCompression: text takes fewer blocks and reads back the same", 32, packedBlocks);
+
+    /* ------------------------------------------------------ *
+     *     File_SetDedup: identical blocks stored once        *
+     * ------------------------------------------------------ */
+    // 300 distinct blocks: past the indirect block, and enough that some share an index slot
+    enum { DUP_BLOCKS = 300 };
+    static char dupOut[BLOCK_SIZE * DUP_BLOCKS], dupIn[BLOCK_SIZE * DUP_BLOCKS];
+    for (int i = 0; i < DUP_BLOCKS; i++) {
+        memset(dupOut + i * BLOCK_SIZE, 'a' + i % 26, BLOCK_SIZE);
+        memcpy(dupOut + i * BLOCK_SIZE, &i, sizeof(i));
+    }
+    FS_Format("snapshot.img", &snapGeometry);
+    FS_StatInfo stDupBase, stDupOne, stDupTwo, stDupGone;
+    char *dupNames[2] = { "dup1.bin", "dup2.bin" };
+    File_Create(dupNames[0]);
+    File_Create(dupNames[1]);
+    FS_Sync();
+    FS_Stat(&stDupBase);  // with the directory block, which stays
+    int dedupOn = 0;
+    for (int f = 0; f < 2; f++) {
+        int fd_dup = File_Open(dupNames[f]);
+        dedupOn |= File_SetDedup(fd_dup, 1);
+        File_Write(fd_dup, dupOut, sizeof(dupOut));
+        File_Close(fd_dup);
+        FS_Sync();
+        FS_Stat(f == 0 ? &stDupOne : &stDupTwo);
+    }
+    // the second copy's blocks map onto the first's: only its own pointer blocks are new
+    int dupMeta = stDupBase.freeBlocks - stDupOne.freeBlocks - DUP_BLOCKS;
+    custom_assert(dedupOn == 0 && stDupOne.freeBlocks - stDupTwo.freeBlocks == dupMeta,
+                  "File_SetDedup: a second copy of the same blocks takes no data blocks",
+                  dupMeta, stDupOne.freeBlocks - stDupTwo.freeBlocks);
+
+    // a write to one copy leaves the other alone, across a remount too
+    static char dupChanged[BLOCK_SIZE];
+    memset(dupChanged, 'z', sizeof(dupChanged));
+    int fd_dup = File_Open("dup1.bin");
+    File_Seek(fd_dup, BLOCK_SIZE * 3);
+    File_Write(fd_dup, dupChanged, BLOCK_SIZE);
+    File_Close(fd_dup);
+    FS_Sync();
+    FS_Boot("snapshot.img");
+    fd_dup = File_Open("dup2.bin");
+    int dupRead = File_Read(fd_dup, dupIn, sizeof(dupIn));
+    File_Close(fd_dup);
+    int dupSame = dupRead == (int)sizeof(dupOut) && memcmp(dupIn, dupOut, sizeof(dupOut)) == 0;
+    fd_dup = File_Open("dup1.bin");
+    dupRead = File_Read(fd_dup, dupIn, sizeof(dupIn));
+    File_Close(fd_dup);
+    memcpy(dupOut + BLOCK_SIZE * 3, dupChanged, BLOCK_SIZE);
+    dupSame = dupSame && dupRead == (int)sizeof(dupOut) && memcmp(dupIn, dupOut, sizeof(dupOut)) == 0;
+    custom_assert(dupSame, "File_SetDedup: writing one copy leaves the other unchanged", 1, dupSame);
+
+    File_Delete("dup1.bin");
+    File_Delete("dup2.bin");
+    FS_Sync();
+    FS_Stat(&stDupGone);
+    custom_assert(stDupGone.freeBlocks == stDupBase.freeBlocks,
+                  "File_SetDedup: deleting both copies frees every block", stDupBase.freeBlocks, stDupGone.freeBlocks);
+
+    /* ------------------------------------------------------ *
+     *     Sparse files: holes and zero blocks                *
+     * ------------------------------------------------------ */
+    static char sparseIn[BLOCK_SIZE * 41], zeroOut[BLOCK_SIZE * 16];
+    FS_Format("snapshot.img", &snapGeometry);
+    File_Create("sparse.bin");
+    File_Create("zero.bin");
+    FS_Sync();
+    FS_StatInfo stSparseBase, stSparse, stZero;
+    FS_Stat(&stSparseBase);
+
+    // a write far past the end: only the block it lands in (and a pointer block) is used
+    int fd_sparse = File_Open("sparse.bin");
+    File_Seek(fd_sparse, BLOCK_SIZE * 40 + 10);
+    File_Write(fd_sparse, "tail", 5);
+    File_Close(fd_sparse);
+    FS_Sync();
+    FS_Stat(&stSparse);
+    custom_assert(stSparseBase.freeBlocks - stSparse.freeBlocks <= 2,
+                  "File_Seek: writing past the end leaves a hole that takes no blocks", 2,
+                  stSparseBase.freeBlocks - stSparse.freeBlocks);
+
+    // whole blocks of zeros are not allocated
+    int fd_zero = File_Open("zero.bin");
+    int zeroWrote = File_Write(fd_zero, zeroOut, sizeof(zeroOut));
+    File_Close(fd_zero);
+    FS_Sync();
+    FS_Stat(&stZero);
+    custom_assert(zeroWrote == (int)sizeof(zeroOut) && stSparse.freeBlocks - stZero.freeBlocks <= 1,
+                  "File_Write: whole blocks of zeros take no data blocks", 1, stSparse.freeBlocks - stZero.freeBlocks);
+
+    // after a remount the holes read back as zeros without a disk read
+    FS_Boot("snapshot.img");
+    fd_sparse = File_Open("sparse.bin");
+    FS_CacheStats holeBefore, holeAfter;
+    FS_GetCacheStats(&holeBefore);
+    memset(sparseIn, 'x', sizeof(sparseIn));
+    int holeRead = File_Read(fd_sparse, sparseIn, BLOCK_SIZE * 32);
+    FS_GetCacheStats(&holeAfter);
+    int sparseOk = holeRead == BLOCK_SIZE * 32 && holeAfter.misses - holeBefore.misses <= 1;  // the pointer block
+    File_Seek(fd_sparse, 0);
+    int sparseRead = File_Read(fd_sparse, sparseIn, sizeof(sparseIn));
+    File_Close(fd_sparse);
+    sparseOk = sparseOk && sparseRead == BLOCK_SIZE * 40 + 15 && memcmp(sparseIn + BLOCK_SIZE * 40 + 10, "tail", 5) == 0;
+    for (int i = 0; i < BLOCK_SIZE * 40 + 10; i++) {
+        sparseOk = sparseOk && sparseIn[i] == 0;
+    }
+    fd_zero = File_Open("zero.bin");
+    memset(sparseIn, 'x', sizeof(zeroOut));
+    int zeroRead = File_Read(fd_zero, sparseIn, sizeof(zeroOut));
+    File_Close(fd_zero);
+    sparseOk = sparseOk && zeroRead == (int)sizeof(zeroOut) && memcmp(sparseIn, zeroOut, sizeof(zeroOut)) == 0;
+    custom_assert(sparseOk, "File_Read: holes read back as zeros without touching the disk", 1, sparseOk);
+
+    // filling part of a hole allocates just that block
+    fd_sparse = File_Open("sparse.bin");
+    File_Seek(fd_sparse, BLOCK_SIZE * 20 + 3);
+    File_Write(fd_sparse, "middle", 7);
+    File_Seek(fd_sparse, 0);
+    sparseRead = File_Read(fd_sparse, sparseIn, sizeof(sparseIn));
+    File_Close(fd_sparse);
+    custom_assert(sparseRead == BLOCK_SIZE * 40 + 15 && memcmp(sparseIn + BLOCK_SIZE * 20 + 3, "middle", 7) == 0 &&
+                  sparseIn[BLOCK_SIZE * 20 + 2] == 0 && sparseIn[BLOCK_SIZE * 20 + 10] == 0 &&
+                  memcmp(sparseIn + BLOCK_SIZE * 40 + 10, "tail", 5) == 0,
+                  "File_Write: a write into a hole fills in just its block", BLOCK_SIZE * 40 + 15, sparseRead);
+    FS_Boot("geometry.img");
+
+    /* ------------------------------------------------------ *
+     *     FS_GetStats: call and I/O instrumentation          *
+     * ------------------------------------------------------ */
+    FS_Stats stats;
+    FS_GetStats(&stats);
+    unsigned long dataReads = stats.diskReads[FS_REGION_DATA];
+    int statsOk;
+    if (stats.enabled) {
+        // everything above went through the counted calls
+        statsOk = stats.ops[FS_STAT_CREATE].calls > 0 && stats.ops[FS_STAT_SYNC].calls > 0 &&
+                  stats.ops[FS_STAT_READ].buckets[FS_STAT_BUCKETS - 1] < stats.ops[FS_STAT_READ].calls &&
+                  stats.diskWrites[FS_REGION_SUPERBLOCK] > 0 && dataReads > 0 &&
+                  stats.lookups > 0 && stats.lookupEntries >= stats.lookups && stats.dcacheHits > 0;
+    } else {
+        statsOk = stats.ops[FS_STAT_CREATE].calls == 0 && dataReads == 0 && stats.lookups == 0;
+    }
+    FS_DumpStats(stdout);
+    custom_assert(statsOk, "FS_GetStats: counts calls, disk blocks by region and lookups when built in",
+                  stats.enabled, (int)stats.ops[FS_STAT_CREATE].calls);
+
     return 0;
 }
@@ -0,0 +1,316 @@
+/*********************************************************************
+* Microbenchmarks for TinyFS (`make bench`, then ./bench).
+*
+* Each benchmark prints one JSON object per line: its parameters, ops/s
+* and p50/p99 latency of the timed call (ns), and the blocks touched per
+* op, both in the block cache (hits + misses) and on the disk (the
+* FS_GetStats region counters, which `make bench` builds in). FS_Boot and
+* FS_Format print a line of their own, so take the lines that start with
+* '{', or pass a file name and the JSON goes there instead of stdout.
+*
+* ./bench [--quick] [results.json]
+**********************************************************************/
+
+#define _XOPEN_SOURCE 700
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "TinyFS.h"
+#include "TinyDisk.h"
+
+#define BENCH_IMAGE "bench.img"
+
+static FILE *out;
+static int   quick = 0;
+
+static uint64_t nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* xorshift64*: same sequence on every run */
+static uint64_t rngState = 0x9e3779b97f4a7c15ull;
+
+static uint64_t rng(void) {
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+    return rngState * 2685821657736338717ull;
+}
+
+static int compareU64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* ------------------------------------------------------ *
+ *     Measurement: one Run per benchmark line            *
+ * ------------------------------------------------------ */
+
+typedef struct {
+    uint64_t     *lat;     // per-op latencies, ns
+    int           n;
+    int           cap;
+    FS_CacheStats cache;   // at the start
+    FS_Stats      stats;
+} Run;
+
+static unsigned long diskBlocks(const FS_Stats *st) {
+    unsigned long n = 0;
+    for (int r = 0; r < FS_REGIONS; r++) {
+        n += st->diskReads[r] + st->diskWrites[r];
+    }
+    return n;
+}
+
+static void runBegin(Run *r, int cap) {
+    r->lat = malloc((size_t)(cap > 0 ? cap : 1) * sizeof(uint64_t));
+    r->n   = 0;
+    r->cap = cap;
+    FS_GetCacheStats(&r->cache);
+    FS_GetStats(&r->stats);
+}
+
+static void runOp(Run *r, uint64_t t0) {
+    if (r->n < r->cap) {
+        r->lat[r->n++] = nowNs() - t0;
+    }
+}
+
+/* Print the run as {"bench": name, <params>, results}; params is JSON members or "" */
+static void runEnd(Run *r, const char *name, const char *params) {
+    FS_CacheStats cache;
+    FS_Stats st;
+    FS_GetCacheStats(&cache);
+    FS_GetStats(&st);
+
+    qsort(r->lat, r->n, sizeof(uint64_t), compareU64);
+    int n = r->n > 0 ? r->n : 1;
+    uint64_t busy = 0;
+    for (int i = 0; i < r->n; i++) {
+        busy += r->lat[i];
+    }
+    // FS_Boot starts the cache counters over: then count from there
+    unsigned long cacheBlocks = cache.hits + cache.misses;
+    if (cacheBlocks >= r->cache.hits + r->cache.misses) {
+        cacheBlocks -= r->cache.hits + r->cache.misses;
+    }
+    unsigned long disk = diskBlocks(&st) - diskBlocks(&r->stats);
+
+    fprintf(out, "{\"bench\": \"%s\"%s%s, \"ops\": %d, \"ops_per_s\": %.1f, "
+                 "\"p50_ns\": %llu, \"p99_ns\": %llu, "
+                 "\"cache_blocks_per_op\": %.2f, \"disk_blocks_per_op\": %.2f, \"stats\": %s}\n",
+            name, params[0] ? ", " : "", params, r->n,
+            busy > 0 ? r->n * 1e9 / (double)busy : 0.0,
+            r->n > 0 ? (unsigned long long)r->lat[r->n / 2] : 0ull,
+            r->n > 0 ? (unsigned long long)r->lat[(r->n * 99) / 100] : 0ull,
+            (double)cacheBlocks / n, (double)disk / n, st.enabled ? "true" : "false");
+    fflush(out);
+    free(r->lat);
+}
+
+/* A fresh file system big enough for every benchmark below */
+static void formatBench(int numInodes) {
+    FS_Geometry g = { 0, 1 << 16, numInodes };
+    if (FS_Format(BENCH_IMAGE, &g) != 0) {
+        fprintf(stderr, "bench: FS_Format failed\n");
+        exit(1);
+    }
+}
+
+/* ------------------------------------------------------ *
+ *     Create and lookup rate vs. number of files         *
+ * ------------------------------------------------------ */
+static void benchNames(int files) {
+    char params[64], name[32];
+    formatBench(files + 16);
+    sprintf(params, "\"files\": %d", files);
+
+    Run r;
+    runBegin(&r, files);
+    for (int i = 0; i < files; i++) {
+        sprintf(name, "f%07d", i);
+        uint64_t t0 = nowNs();
+        File_Create(name);
+        runOp(&r, t0);
+    }
+    runEnd(&r, "create", params);
+
+    runBegin(&r, files);
+    for (int i = 0; i < files; i++) {
+        sprintf(name, "f%07d", (int)(rng() % (uint64_t)files));
+        uint64_t t0 = nowNs();
+        int fd = File_Open(name);
+        runOp(&r, t0);
+        File_Close(fd);
+    }
+    runEnd(&r, "lookup", params);
+}
+
+/* ------------------------------------------------------ *
+ *     Small writes and reads                             *
+ * ------------------------------------------------------ */
+static void benchSmallIo(int ioSize, int total) {
+    char params[64], buf[4096];
+    memset(buf, 'x', sizeof(buf));
+    formatBench(64);
+    sprintf(params, "\"io_bytes\": %d, \"file_bytes\": %d", ioSize, total);
+
+    File_Create("small.bin");
+    int fd = File_Open("small.bin");
+    Run r;
+    runBegin(&r, total / ioSize);
+    for (int done = 0; done + ioSize <= total; done += ioSize) {
+        uint64_t t0 = nowNs();
+        File_Write(fd, buf, ioSize);
+        runOp(&r, t0);
+    }
+    runEnd(&r, "small_write", params);
+
+    File_Seek(fd, 0);
+    runBegin(&r, total / ioSize);
+    for (int done = 0; done + ioSize <= total; done += ioSize) {
+        uint64_t t0 = nowNs();
+        File_Read(fd, buf, ioSize);
+        runOp(&r, t0);
+    }
+    runEnd(&r, "small_read", params);
+    File_Close(fd);
+}
+
+/* ------------------------------------------------------ *
+ *     Sequential vs. random File_Read / File_Seek        *
+ * ------------------------------------------------------ */
+static void benchReadPattern(int total) {
+    static char buf[BLOCK_SIZE * 8];
+    int ioSize = BLOCK_SIZE * 8;
+    char params[64];
+    formatBench(64);
+    sprintf(params, "\"io_bytes\": %d, \"file_bytes\": %d", ioSize, total);
+
+    File_Create("scan.bin");
+    int fd = File_Open("scan.bin");
+    for (int done = 0; done < total; done += ioSize) {
+        File_Write(fd, buf, ioSize);
+    }
+    File_Close(fd);
+    FS_Sync();
+
+    // remount before each pattern so both start from an empty cache
+    const char *names[2] = { "seq_read", "random_read" };
+    for (int pattern = 0; pattern < 2; pattern++) {
+        FS_Boot(BENCH_IMAGE);
+        fd = File_Open("scan.bin");
+        Run r;
+        runBegin(&r, total / ioSize);
+        for (int i = 0; i < total / ioSize; i++) {
+            uint64_t t0 = nowNs();
+            if (pattern == 1) {
+                File_Seek(fd, (int)(rng() % (uint64_t)(total / ioSize)) * ioSize);
+            }
+            File_Read(fd, buf, ioSize);
+            runOp(&r, t0);
+        }
+        runEnd(&r, names[pattern], params);
+        File_Close(fd);
+    }
+}
+
+/* ------------------------------------------------------ *
+ *     FS_Boot cold start                                 *
+ * ------------------------------------------------------ */
+static void benchBoot(int files, int boots) {
+    char params[64], name[32];
+    formatBench(files + 16);
+    for (int i = 0; i < files; i++) {
+        sprintf(name, "b%07d", i);
+        File_Create(name);
+    }
+    FS_Sync();
+    sprintf(params, "\"files\": %d", files);
+
+    Run r;
+    runBegin(&r, boots);
+    for (int i = 0; i < boots; i++) {
+        uint64_t t0 = nowNs();
+        FS_Boot(BENCH_IMAGE);
+        runOp(&r, t0);
+    }
+    runEnd(&r, "boot", params);
+
+    // and to the first lookup, which has to bring the metadata in
+    runBegin(&r, boots);
+    for (int i = 0; i < boots; i++) {
+        uint64_t t0 = nowNs();
+        FS_Boot(BENCH_IMAGE);
+        File_Close(File_Open("b0000000"));
+        runOp(&r, t0);
+    }
+    runEnd(&r, "boot_first_open", params);
+}
+
+/* ------------------------------------------------------ *
+ *     FS_Sync cost vs. dirty blocks                      *
+ * ------------------------------------------------------ */
+static void benchSync(int dirtyBlocks, int rounds) {
+    static char buf[BLOCK_SIZE];
+    char params[64];
+    formatBench(64);
+    sprintf(params, "\"dirty_blocks\": %d", dirtyBlocks);
+
+    File_Create("sync.bin");
+    int fd = File_Open("sync.bin");
+    for (int i = 0; i < dirtyBlocks; i++) {
+        File_Write(fd, buf, BLOCK_SIZE);
+    }
+    FS_Sync();
+
+    Run r;
+    runBegin(&r, rounds);
+    for (int round = 0; round < rounds; round++) {
+        // dirty the same blocks again, then time only the sync
+        memset(buf, 'a' + round % 26, sizeof(buf));
+        File_Seek(fd, 0);
+        for (int i = 0; i < dirtyBlocks; i++) {
+            File_Write(fd, buf, BLOCK_SIZE);
+        }
+        uint64_t t0 = nowNs();
+        FS_Sync();
+        runOp(&r, t0);
+    }
+    runEnd(&r, "sync", params);
+    File_Close(fd);
+}
+
+int main(int argc, char **argv) {
+    out = stdout;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            quick = 1;
+        } else if ((out = fopen(argv[i], "w")) == NULL) {
+            perror(argv[i]);
+            return 1;
+        }
+    }
+    int scale = quick ? 10 : 1;
+
+    int fileCounts[] = { 100, 1000, 5000 };
+    for (int i = 0; i < 3; i++) {
+        benchNames(fileCounts[i] / (quick && fileCounts[i] > 100 ? 5 : 1));
+    }
+    benchSmallIo(64, (1 << 20) / scale);
+    benchSmallIo(512, (1 << 20) / scale);
+    benchReadPattern((4 << 20) / scale);
+    benchBoot(2000 / scale, 50 / scale);
+    int dirtyCounts[] = { 1, 16, 128, 1024 };
+    for (int i = 0; i < 4; i++) {
+        benchSync(dirtyCounts[i], 20 / (quick ? 4 : 1));
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    return 0;
+}
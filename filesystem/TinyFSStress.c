@@ -0,0 +1,749 @@
+/*********************************************************************
+* Stress and crash-consistency harness for TinyFS (`make stress`).
+*
+* Two phases, both driven by one seed:
+*
+*  1. Concurrency: worker threads run random creates, seeks, writes, reads
+*     and deletes (and the odd FS_Sync) on files of their own, compressed,
+*     deduplicated and with holes or not, checking every result against an
+*     in-memory model of those files, while sharing the directory,
+*     allocator, cache and journal. A remount at the end checks every file
+*     again, and the op rate is reported.
+*
+*  2. Crashes: a single-threaded workload of the same ops, with an FS_Sync
+*     every STRESS_EPOCH_OPS ops, is cut off at a chosen Disk_Write: the disk
+*     is copied right after that write (Disk_SetWriteHook, Disk_Copy), saved,
+*     and mounted with FS_Boot. Every file the interrupted epoch did not
+*     touch must read back exactly as of the last completed FS_Sync; the
+*     others may be in either state but must read cleanly; the inode bitmap
+*     must agree with the directory. Every snapshot (FS_Snapshot, taken
+*     now and then at the end of an epoch) must still hold the files as
+*     they were when it was taken. Now and then an epoch also ends by
+*     preallocating or deleting a bulk file, one call that changes more
+*     metadata blocks than the block cache holds. The file system must then
+*     take new writes and survive another remount, and once every file and
+*     snapshot is deleted, exactly as many blocks must be free as right
+*     after the format, every one of them allocatable.
+*
+* The op sequences follow from the seed, so a failure replays with the
+* seed and crash point it prints (thread interleavings do not replay).
+*
+* ./stress [--seed n] [--threads n] [--ops n] [--crashes n] [--crash-at n]
+**********************************************************************/
+
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "TinyFS.h"
+#include "TinyDisk.h"
+
+#define STRESS_IMAGE       "stress.img"
+#define STRESS_CRASH_IMAGE "stress-crash.img"
+
+#define STRESS_MAX_THREADS 16
+#define STRESS_FILES       8            // per worker thread
+#define STRESS_MAX_SIZE    (64 * 1024)
+#define STRESS_MAX_IO      4096
+
+#define CRASH_DIR          "crash"
+#define CRASH_FILES        12
+#define CRASH_MAX_SIZE     (16 * 1024)
+#define CRASH_BULK_NAME    CRASH_DIR "/bulk"
+#define CRASH_BULK_SIZE    (5 * 1024 * 1024)  // ~80 pointer blocks at 512 bytes, past CACHE_BLOCKS
+#define STRESS_EPOCH_OPS   20
+#define CRASH_SNAPSHOTS    2            // kept at once; the oldest goes to make room
+
+static uint64_t seed       = 1;
+static int      numThreads = 4;
+static int      numOps     = 2000;  // per thread, and for the crash workload
+static int      numCrashes = 20;
+static long     onlyCrash  = -1;    // --crash-at: that one crash point only
+
+/* xorshift64*, one state per stream */
+static uint64_t rngNext(uint64_t *s) {
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ull;
+}
+
+static uint64_t rngSeed(uint64_t base, uint64_t stream) {
+    uint64_t s = base * 0x9e3779b97f4a7c15ull + stream * 0xbf58476d1ce4e5b9ull;
+    return s != 0 ? s : 1;
+}
+
+static double nowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* ------------------------------------------------------ *
+ *     Reference model                                    *
+ * ------------------------------------------------------ */
+
+typedef struct {
+    int           exists;
+    int           size;
+    unsigned char data[STRESS_MAX_SIZE];
+} ModelFile;
+
+/* Read the whole file name back and compare it with m; NULL if it matches, else what differs */
+static const char *modelCheck(const char *name, const ModelFile *m) {
+    static __thread unsigned char buf[STRESS_MAX_SIZE + 1];
+    int fd = File_Open((char *)name);
+    if (!m->exists) {
+        if (fd >= 0) {
+            File_Close(fd);
+            return "deleted file can be opened";
+        }
+        return fd == E_NO_SUCH_FILE ? NULL : "open of a missing file fails oddly";
+    }
+    if (fd < 0) {
+        return "file is missing";
+    }
+    int n = File_Read(fd, buf, sizeof(buf));
+    File_Close(fd);
+    if (n != m->size) {
+        return "file has the wrong size";
+    }
+    return memcmp(buf, m->data, n) == 0 ? NULL : "file has the wrong contents";
+}
+
+/*
+ * One random op on file name, checked against m; sizes stay below maxSize.
+ * Returns NULL on success, or what went wrong.
+ */
+static const char *modelOp(uint64_t *rng, const char *name, ModelFile *m, int maxSize) {
+    static __thread unsigned char buf[STRESS_MAX_IO * 2];
+    int op = (int)(rngNext(rng) % 100);
+
+    if (op < 10) {
+        int rc = File_Create((char *)name);
+        if (rc != (m->exists ? E_FILE_EXISTS : 0)) {
+            return "File_Create result";
+        }
+        if (!m->exists) {
+            m->exists = 1;
+            m->size   = 0;
+        }
+    } else if (op < 20) {
+        int rc = File_Delete((char *)name);
+        if (rc != (m->exists ? 0 : E_NO_SUCH_FILE)) {
+            return "File_Delete result";
+        }
+        m->exists = 0;
+    } else if (op < 60) {
+        if (!m->exists) {
+            if (File_Create((char *)name) != 0) {
+                return "File_Create before a write";
+            }
+            m->exists = 1;
+            m->size   = 0;
+        }
+        // up to STRESS_MAX_IO past the end, leaving a hole
+        int off = (int)(rngNext(rng) % (uint64_t)(m->size + STRESS_MAX_IO + 1));
+        int len = 1 + (int)(rngNext(rng) % STRESS_MAX_IO);
+        // a third compressible, a third whole blocks of zeros or one of a few bytes
+        // (duplicates across files), and compression and dedup switched on or off for each
+        int pattern = (int)(rngNext(rng) % 3);
+        unsigned char c = (unsigned char)rngNext(rng);
+        if (pattern == 2) {
+            off -= off % BLOCK_SIZE;
+            len  = BLOCK_SIZE * (1 + (int)(rngNext(rng) % (STRESS_MAX_IO / BLOCK_SIZE + 1)));
+            c    = (unsigned char)(c % 5 == 0 ? 0 : '0' + c % 4);
+        }
+        if (off > maxSize) {
+            off = maxSize;
+        }
+        if (off + len > maxSize) {
+            len = maxSize - off;
+        }
+        for (int i = 0; i < len; i++) {
+            buf[i] = pattern == 1 ? (unsigned char)(c + i % 7) : pattern == 2 ? c : (unsigned char)rngNext(rng);
+        }
+        int fd = File_Open((char *)name);
+        if (fd < 0 || File_Seek(fd, off) != 0 || File_SetCompression(fd, (int)(rngNext(rng) % 2)) != 0 ||
+            File_SetDedup(fd, (int)(rngNext(rng) % 2)) != 0) {
+            return "File_Open/File_Seek before a write";
+        }
+        int rc = File_Write(fd, buf, len);
+        if (File_Close(fd) != 0 || rc != len) {
+            return "File_Write result";
+        }
+        if (len > 0) {
+            if (off > m->size) {
+                memset(m->data + m->size, 0, off - m->size);  // the hole reads as zeros
+            }
+            memcpy(m->data + off, buf, len);
+            if (off + len > m->size) {
+                m->size = off + len;
+            }
+        }
+    } else {
+        int fd = File_Open((char *)name);
+        if (!m->exists) {
+            return fd == E_NO_SUCH_FILE ? NULL : "File_Open of a missing file";
+        }
+        int off = (int)(rngNext(rng) % (uint64_t)(m->size + 1));
+        int len = 1 + (int)(rngNext(rng) % (STRESS_MAX_IO * 2));
+        if (fd < 0 || File_Seek(fd, off) != 0) {
+            return "File_Open/File_Seek before a read";
+        }
+        int rc = File_Read(fd, buf, len);
+        File_Close(fd);
+        int want = m->size - off < len ? m->size - off : len;
+        if (rc != want || memcmp(buf, m->data + off, want) != 0) {
+            return "File_Read result";
+        }
+    }
+    return NULL;
+}
+
+/* ------------------------------------------------------ *
+ *     Phase 1: concurrent workers                        *
+ * ------------------------------------------------------ */
+
+typedef struct {
+    int         id;
+    uint64_t    rng;
+    const char *failure;
+    int         failedOp;
+    ModelFile   files[STRESS_FILES];
+} Worker;
+
+static Worker workers[STRESS_MAX_THREADS];
+
+static void workerName(int id, int i, char *name) {
+    sprintf(name, "w%d_%d", id, i);
+}
+
+static void *workerRun(void *arg) {
+    Worker *w = arg;
+    char name[32];
+    for (int op = 0; op < numOps && w->failure == NULL; op++) {
+        if (rngNext(&w->rng) % 100 < 2) {
+            if (FS_Sync() != 0) {
+                w->failure = "FS_Sync result";
+            }
+        } else {
+            int i = (int)(rngNext(&w->rng) % STRESS_FILES);
+            workerName(w->id, i, name);
+            w->failure = modelOp(&w->rng, name, &w->files[i], STRESS_MAX_SIZE);
+        }
+        w->failedOp = op;
+    }
+    return NULL;
+}
+
+static int concurrencyPhase(void) {
+    FS_Geometry g = { 0, 16384, STRESS_MAX_THREADS * STRESS_FILES + 16 };
+    if (FS_Format(STRESS_IMAGE, &g) != 0) {
+        printf("stress: FAIL seed=%llu: FS_Format\n", (unsigned long long)seed);
+        return 1;
+    }
+
+    pthread_t tids[STRESS_MAX_THREADS];
+    double start = nowSeconds();
+    for (int t = 0; t < numThreads; t++) {
+        memset(&workers[t], 0, sizeof(workers[t]));
+        workers[t].id  = t;
+        workers[t].rng = rngSeed(seed, (uint64_t)t + 1);
+        pthread_create(&tids[t], NULL, workerRun, &workers[t]);
+    }
+    for (int t = 0; t < numThreads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    double elapsed = nowSeconds() - start;
+
+    int failed = 0;
+    for (int t = 0; t < numThreads; t++) {
+        if (workers[t].failure != NULL) {
+            printf("stress: FAIL seed=%llu thread=%d op=%d: %s\n", (unsigned long long)seed,
+                   t, workers[t].failedOp, workers[t].failure);
+            failed = 1;
+        }
+    }
+
+    // everything must come back after a remount
+    if (!failed && (FS_Sync() != 0 || FS_Boot(STRESS_IMAGE) != 0)) {
+        printf("stress: FAIL seed=%llu: FS_Sync/FS_Boot after the workers\n", (unsigned long long)seed);
+        failed = 1;
+    }
+    char name[32];
+    for (int t = 0; t < numThreads && !failed; t++) {
+        for (int i = 0; i < STRESS_FILES && !failed; i++) {
+            workerName(t, i, name);
+            const char *why = modelCheck(name, &workers[t].files[i]);
+            if (why != NULL) {
+                printf("stress: FAIL seed=%llu: after remount, %s: %s\n", (unsigned long long)seed, name, why);
+                failed = 1;
+            }
+        }
+    }
+
+    long ops = (long)numThreads * numOps;
+    printf("stress: concurrency threads=%d ops=%ld seconds=%.3f ops_per_s=%.0f %s\n",
+           numThreads, ops, elapsed, elapsed > 0 ? ops / elapsed : 0.0, failed ? "FAIL" : "ok");
+    return failed;
+}
+
+/* ------------------------------------------------------ *
+ *     Phase 2: crash at a Disk_Write, then remount       *
+ * ------------------------------------------------------ */
+
+static ModelFile model[CRASH_FILES];     // as the workload goes
+static ModelFile durable[CRASH_FILES];   // as of the last completed FS_Sync
+static int       touched[CRASH_FILES];   // changed since then
+
+/* Filled in by crashHook at the crash point */
+static long      diskWrites;
+static long      crashAt;
+static int       crashed;
+static char     *crashImage;
+static size_t    crashBytes;
+static ModelFile crashDurable[CRASH_FILES];
+static int       crashTouched[CRASH_FILES];
+static int       crashFormatFree;          // free blocks with only CRASH_DIR made
+
+/* The bulk file: there (CRASH_BULK_SIZE of zeros) or not, like model/durable/touched */
+static int       bulk, durableBulk, bulkTouched;
+static int       crashDurableBulk, crashBulkTouched;
+
+/* Snapshots: ids run from 1 on a fresh file system; snapshot id holds snapModel[id % ...] */
+static ModelFile snapModel[CRASH_SNAPSHOTS + 2][CRASH_FILES];
+static int       snapBulk[CRASH_SNAPSHOTS + 2];
+static int       snapOldest, snapNext;             // the ones there are: [snapOldest, snapNext)
+static int       durableOldest, durableNext;       // as of the last completed FS_Sync
+static int       crashOldest, crashNext;
+
+static void crashName(int i, char *name) {
+    sprintf(name, CRASH_DIR "/c%d", i);
+}
+
+/* After every Disk_Write: at the crash point, keep the disk and what it should hold */
+static void crashHook(int block) {
+    (void)block;
+    if (crashed || ++diskWrites != crashAt) {
+        return;
+    }
+    crashBytes = (size_t)Disk_NumBlocks() * (size_t)Disk_BlockSize();
+    crashImage = realloc(crashImage, crashBytes);
+    if (crashImage != NULL && Disk_Copy(crashImage) == 0) {
+        memcpy(crashDurable, durable, sizeof(durable));
+        memcpy(crashTouched, touched, sizeof(touched));
+        crashDurableBulk = durableBulk;
+        crashBulkTouched = bulkTouched;
+        crashOldest = durableOldest;
+        crashNext   = durableNext;
+        crashed = 1;
+    }
+}
+
+/* Take a snapshot, deleting the oldest first if there are enough */
+static const char *crashSnapshot(void) {
+    if (snapNext - snapOldest == CRASH_SNAPSHOTS) {
+        if (FS_SnapshotDelete(snapOldest) != 0) {
+            return "FS_SnapshotDelete";
+        }
+        snapOldest++;
+    }
+    if (crashed) {
+        return NULL;  // the model is past the crash point
+    }
+    memcpy(snapModel[snapNext % (CRASH_SNAPSHOTS + 2)], model, sizeof(model));
+    snapBulk[snapNext % (CRASH_SNAPSHOTS + 2)] = bulk;
+    if (FS_Snapshot() != snapNext) {
+        return "FS_Snapshot";
+    }
+    snapNext++;
+    return NULL;
+}
+
+/* Preallocate the bulk file in one call, or delete it */
+static const char *bulkOp(void) {
+    if (bulk) {
+        bulk = 0;
+        return File_Delete(CRASH_BULK_NAME) == 0 ? NULL : "File_Delete of the bulk file";
+    }
+    if (File_Create(CRASH_BULK_NAME) != 0) {
+        return "File_Create of the bulk file";
+    }
+    int fd = File_Open(CRASH_BULK_NAME);
+    int rc = File_Allocate(fd, CRASH_BULK_SIZE);
+    if (File_Close(fd) != 0 || rc != 0) {
+        return "File_Allocate of the bulk file";
+    }
+    bulk = 1;
+    return NULL;
+}
+
+/*
+ * Check the bulk file: there and all zeros if exists, else missing. When
+ * interrupted it may also be missing, or zeros part of the way.
+ */
+static const char *bulkCheck(int exists, int interrupted) {
+    static unsigned char buf[64 * 1024];
+    int fd = File_Open(CRASH_BULK_NAME);
+    if (fd == E_NO_SUCH_FILE) {
+        return exists && !interrupted ? "bulk file is missing" : NULL;
+    }
+    if (fd < 0) {
+        return "bulk file opens badly";
+    }
+    if (!exists && !interrupted) {
+        File_Close(fd);
+        return "deleted bulk file can be opened";
+    }
+    int size = 0, n;
+    while ((n = File_Read(fd, buf, sizeof(buf))) > 0) {
+        for (int i = 0; i < n; i++) {
+            if (buf[i] != 0) {
+                File_Close(fd);
+                return "bulk file has the wrong contents";
+            }
+        }
+        size += n;
+    }
+    File_Close(fd);
+    if (n < 0 || size > CRASH_BULK_SIZE || (size != CRASH_BULK_SIZE && !interrupted)) {
+        return "bulk file has the wrong size";
+    }
+    return NULL;
+}
+
+/*
+ * Mount each snapshot of image in turn and check its files, then mount
+ * image again. The snapshots in [first, next) must be there; after a crash
+ * the epoch's delete and new one may each have happened or not, so the
+ * ones that may be there go from oldest to upTo (== next without a crash).
+ */
+static const char *snapshotsVerify(char *image, int oldest, int first, int next, int upTo) {
+    int ids[FS_MAX_SNAPSHOTS];
+    int n = FS_SnapshotList(ids, FS_MAX_SNAPSHOTS);
+    int found = 0;
+    for (int k = 0; k < n; k++) {
+        if (ids[k] < oldest || ids[k] >= upTo) {
+            return "unknown snapshot";
+        }
+        found += ids[k] >= first && ids[k] < next;
+    }
+    if (found < next - first) {
+        return "snapshot is missing";
+    }
+    char name[32];
+    for (int k = 0; k < n; k++) {
+        if (FS_BootSnapshot(image, ids[k]) != 0) {
+            return "FS_BootSnapshot";
+        }
+        for (int i = 0; i < CRASH_FILES; i++) {
+            crashName(i, name);
+            const char *why = modelCheck(name, &snapModel[ids[k] % (CRASH_SNAPSHOTS + 2)][i]);
+            if (why != NULL) {
+                return why;
+            }
+        }
+        const char *why = bulkCheck(snapBulk[ids[k] % (CRASH_SNAPSHOTS + 2)], 0);
+        if (why != NULL) {
+            return why;
+        }
+    }
+    return FS_Boot(image) == 0 ? NULL : "FS_Boot after the snapshots";
+}
+
+/* The crash workload on a fresh file system, until it ends or the crash point passes */
+static const char *crashWorkload(void) {
+    // room for the bulk file live and in both snapshots, besides the small files
+    FS_Geometry g = { 0, 3 * (CRASH_BULK_SIZE / BLOCK_SIZE) + 4096, CRASH_FILES + 8 };
+    FS_StatInfo st;
+    if (FS_Format(STRESS_IMAGE, &g) != 0 || Dir_Create(CRASH_DIR) != 0 || FS_Sync() != 0 || FS_Stat(&st) != 0) {
+        return "FS_Format";
+    }
+    crashFormatFree = st.freeBlocks;
+    memset(model, 0, sizeof(model));
+    memset(durable, 0, sizeof(durable));
+    memset(touched, 0, sizeof(touched));
+    bulk = durableBulk = bulkTouched = 0;
+    diskWrites = 0;
+    crashed    = 0;
+    snapOldest = durableOldest = 1;
+    snapNext   = durableNext   = 1;
+
+    uint64_t rng = rngSeed(seed, 1000);
+    char name[32];
+    Disk_SetWriteHook(crashHook);
+    for (int op = 0; op < numOps && !crashed; op++) {
+        int i = (int)(rngNext(&rng) % CRASH_FILES);
+        crashName(i, name);
+        touched[i] = 1;
+        const char *why = modelOp(&rng, name, &model[i], CRASH_MAX_SIZE);
+        if (why != NULL) {
+            Disk_SetWriteHook(NULL);
+            return why;
+        }
+        if ((op + 1) % STRESS_EPOCH_OPS == 0 || op + 1 == numOps) {
+            const char *bulkWhy = NULL;
+            if (rngNext(&rng) % 4 == 0) {
+                bulkTouched = 1;
+                bulkWhy = bulkOp();
+            }
+            const char *snapWhy = bulkWhy != NULL ? bulkWhy : rngNext(&rng) % 4 == 0 ? crashSnapshot() : NULL;
+            if (snapWhy != NULL) {
+                Disk_SetWriteHook(NULL);
+                return snapWhy;
+            }
+            if (FS_Sync() != 0) {
+                Disk_SetWriteHook(NULL);
+                return "FS_Sync";
+            }
+            memcpy(durable, model, sizeof(model));
+            memset(touched, 0, sizeof(touched));
+            durableBulk   = bulk;
+            bulkTouched   = 0;
+            durableOldest = snapOldest;
+            durableNext   = snapNext;
+        }
+    }
+    Disk_SetWriteHook(NULL);
+    return NULL;
+}
+
+/*
+ * Delete every snapshot and file, then check the free blocks: as many as
+ * right after the format (none leaked, none freed twice), and the allocator
+ * hands out every one of them before it runs out of space.
+ */
+static const char *freeVerify(void) {
+    int ids[FS_MAX_SNAPSHOTS];
+    int n = FS_SnapshotList(ids, FS_MAX_SNAPSHOTS);
+    for (int k = 0; k < n; k++) {
+        if (FS_SnapshotDelete(ids[k]) != 0) {
+            return "FS_SnapshotDelete";
+        }
+    }
+    char name[32];
+    for (int i = -2; i < CRASH_FILES; i++) {
+        if (i >= 0) {
+            crashName(i, name);
+        } else {
+            strcpy(name, i == -2 ? "probe" : CRASH_BULK_NAME);
+        }
+        int rc = File_Delete(name);
+        if (rc != 0 && rc != E_NO_SUCH_FILE) {
+            return "File_Delete";
+        }
+    }
+    if (Dir_Delete(CRASH_DIR) != 0) {
+        return "Dir_Delete";
+    }
+    FS_StatInfo st;
+    if (FS_Sync() != 0 || FS_Stat(&st) != 0 || st.freeBlocks != crashFormatFree) {
+        return "free blocks disagree with the files";
+    }
+
+    // fill files, a halving step at a time, until not one more block fits;
+    // a step that fails may free blocks it took, which are reused only once
+    // committed, so each failure syncs before the smaller step
+    for (int k = 0, size = 1; size > 0; k++) {
+        sprintf(name, "fill%d", k);
+        if (File_Create(name) != 0) {
+            return "File_Create of a fill file";
+        }
+        int fd = File_Open(name);
+        size = 0;
+        for (int step = 256 * st.blockSize; step >= st.blockSize; ) {
+            if (size + step <= st.maxFileSize && File_Allocate(fd, size + step) == 0) {
+                size += step;
+            } else if (FS_Sync() == 0) {
+                step /= 2;
+            } else {
+                File_Close(fd);
+                return "FS_Sync while filling";
+            }
+        }
+        File_Close(fd);
+    }
+    if (FS_Stat(&st) != 0 || st.freeBlocks != 0) {
+        return "free blocks cannot all be allocated";
+    }
+    return NULL;
+}
+
+/* Mounted crash image: check it against crashDurable / crashTouched */
+static const char *crashVerify(char *failedName) {
+    char name[32];
+    int existing = 0;
+    for (int i = 0; i < CRASH_FILES; i++) {
+        crashName(i, name);
+        strcpy(failedName, name);
+        if (!crashTouched[i]) {
+            const char *why = modelCheck(name, &crashDurable[i]);
+            if (why != NULL) {
+                return why;
+            }
+            existing += crashDurable[i].exists;
+            continue;
+        }
+        // interrupted: either state will do, as long as it reads cleanly
+        static unsigned char buf[CRASH_MAX_SIZE + 1];
+        int fd = File_Open(name);
+        if (fd >= 0) {
+            int n = File_Read(fd, buf, sizeof(buf));
+            File_Close(fd);
+            if (n < 0 || n > CRASH_MAX_SIZE) {
+                return "interrupted file reads badly";
+            }
+            existing++;
+        } else if (fd != E_NO_SUCH_FILE) {
+            return "interrupted file opens badly";
+        }
+    }
+    strcpy(failedName, CRASH_BULK_NAME);
+    const char *bulkWhy = bulkCheck(crashDurableBulk, crashBulkTouched);
+    if (bulkWhy != NULL) {
+        return bulkWhy;
+    }
+    int bulkFd = File_Open(CRASH_BULK_NAME);
+    if (bulkFd >= 0) {
+        File_Close(bulkFd);
+        existing++;
+    }
+    strcpy(failedName, "snapshots");
+    const char *snapWhy = snapshotsVerify(STRESS_CRASH_IMAGE, crashOldest, crashOldest + 1, crashNext, crashNext + 1);
+    if (snapWhy != NULL) {
+        return snapWhy;
+    }
+    strcpy(failedName, "probe");
+
+    // the inode bitmap matches the directory: one more file takes exactly one inode
+    // (besides the files, the root directory and CRASH_DIR)
+    FS_StatInfo st;
+    if (File_Create("probe") != 0 || FS_Stat(&st) != 0 || st.freeInodes != st.totalInodes - 3 - existing) {
+        return "inode bitmap disagrees with the directory";
+    }
+
+    // still takes writes, and they last
+    static unsigned char out[CRASH_MAX_SIZE];
+    for (int i = 0; i < (int)sizeof(out); i++) {
+        out[i] = (unsigned char)(i * 13 + 1);
+    }
+    int fd = File_Open("probe");
+    int n  = File_Write(fd, out, sizeof(out));
+    File_Close(fd);
+    if (n != (int)sizeof(out) || FS_Sync() != 0 || FS_Boot(STRESS_CRASH_IMAGE) != 0) {
+        return "write and remount after recovery";
+    }
+    static ModelFile probe;
+    probe.exists = 1;
+    probe.size   = sizeof(out);
+    memcpy(probe.data, out, sizeof(out));
+    const char *why = modelCheck("probe", &probe);
+    if (why != NULL) {
+        return why;
+    }
+    strcpy(failedName, "free blocks");
+    return freeVerify();
+}
+
+static int crashPoint(long at) {
+    crashAt = at;
+    const char *why = crashWorkload();
+    char failedName[32] = "";
+    if (why == NULL && crashed) {
+        FILE *f = fopen(STRESS_CRASH_IMAGE, "w");
+        if (f == NULL || fwrite(crashImage, 1, crashBytes, f) != crashBytes) {
+            why = "saving the crash image";
+        }
+        if (f != NULL) {
+            fclose(f);
+        }
+        if (why == NULL && FS_Boot(STRESS_CRASH_IMAGE) != 0) {
+            why = "FS_Boot of the crash image";
+        }
+        if (why == NULL) {
+            why = crashVerify(failedName);
+        }
+    }
+    if (why != NULL) {
+        printf("stress: FAIL seed=%llu crash_at=%ld (replay: ./stress --seed %llu --crash-at %ld)%s%s: %s\n",
+               (unsigned long long)seed, at, (unsigned long long)seed, at,
+               failedName[0] ? " file " : "", failedName, why);
+        return 1;
+    }
+    return 0;
+}
+
+static int crashPhase(void) {
+    // a run to the end finds how many writes there are to crash at, and checks the clean case
+    double start = nowSeconds();
+    crashAt = -1;
+    const char *why = crashWorkload();
+    long total = diskWrites;
+    if (why == NULL && FS_Boot(STRESS_IMAGE) != 0) {
+        why = "FS_Boot after a clean run";
+    }
+    char name[32];
+    for (int i = 0; i < CRASH_FILES && why == NULL; i++) {
+        crashName(i, name);
+        why = modelCheck(name, &model[i]);
+    }
+    if (why == NULL) {
+        why = bulkCheck(bulk, 0);
+    }
+    if (why == NULL) {
+        why = snapshotsVerify(STRESS_IMAGE, snapOldest, snapOldest, snapNext, snapNext);
+    }
+    if (why == NULL) {
+        why = freeVerify();
+    }
+    if (why != NULL) {
+        printf("stress: FAIL seed=%llu crash workload without a crash: %s\n", (unsigned long long)seed, why);
+        return 1;
+    }
+
+    int failed = 0, points = 0;
+    if (onlyCrash > 0) {
+        failed = crashPoint(onlyCrash);
+        points = 1;
+    } else {
+        uint64_t rng = rngSeed(seed, 2000);
+        for (; points < numCrashes && total > 0; points++) {
+            failed |= crashPoint(1 + (long)(rngNext(&rng) % (uint64_t)total));
+        }
+    }
+    double elapsed = nowSeconds() - start;
+    printf("stress: crash writes_per_run=%ld points=%d seconds=%.3f %s\n",
+           total, points, elapsed, failed ? "FAIL" : "ok");
+    return failed;
+}
+
+int main(int argc, char **argv) {
+    setvbuf(stdout, NULL, _IOLBF, 0);   // FS_* output and ours in order, and kept if a check crashes
+    for (int i = 1; i + 1 < argc; i += 2) {
+        long v = atol(argv[i + 1]);
+        if (strcmp(argv[i], "--seed") == 0) {
+            seed = (uint64_t)v;
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            numThreads = v < 1 ? 1 : v > STRESS_MAX_THREADS ? STRESS_MAX_THREADS : (int)v;
+        } else if (strcmp(argv[i], "--ops") == 0) {
+            numOps = v < 1 ? 1 : (int)v;
+        } else if (strcmp(argv[i], "--crashes") == 0) {
+            numCrashes = (int)v;
+        } else if (strcmp(argv[i], "--crash-at") == 0) {
+            onlyCrash = v;
+        } else {
+            fprintf(stderr, "usage: %s [--seed n] [--threads n] [--ops n] [--crashes n] [--crash-at n]\n", argv[0]);
+            return 2;
+        }
+    }
+    printf("stress: seed=%llu threads=%d ops=%d crashes=%d\n",
+           (unsigned long long)seed, numThreads, numOps, numCrashes);
+
+    int failed = onlyCrash > 0 ? 0 : concurrencyPhase();
+    failed |= crashPhase();
+    free(crashImage);
+    return failed;
+}